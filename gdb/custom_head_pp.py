@@ -2,23 +2,23 @@ import gdb
 import gdb.printing
 import re
 
-# Regex adapted to match dixelu::details::mfunc<T>(void*, void*, dixelu::details::adj_mf_ops)
-__mfunc_regex__ = r"dixelu::details::mfunc<(.*)>\(\s*void\*\s*,\s*void\*\s*,.*dixelu::details::adj_mf_ops\s*\)"
+# Regex adapted to match dixelu::details::custom_ops_for<T> (per-type operations table)
+__ops_regex__ = r"dixelu::details::custom_ops_for<(.*)>\s+in section"
 
-def get_mfunc_parameter(func_ptr):
+def get_ops_parameter(ops_ptr):
 	try:
-		func_symbol = gdb.execute('info symbol 0x{:x}'.format(func_ptr), to_string=True)
+		ops_symbol = gdb.execute('info symbol 0x{:x}'.format(ops_ptr), to_string=True)
 
-		if 'No symbol matches' in func_symbol:
+		if 'No symbol matches' in ops_symbol:
 			return None
 
-		matches = re.finditer(__mfunc_regex__, func_symbol, re.MULTILINE)
+		matches = re.finditer(__ops_regex__, ops_symbol, re.MULTILINE)
 		for match in matches:
 			return match.group(1)
 
 		return None
 	except Exception as e:
-		print(f"Exception in get_mfunc_parameter: {e}")
+		print(f"Exception in get_ops_parameter: {e}")
 		return None
 
 
@@ -29,23 +29,28 @@ class CustomHeadPrinter:
 		self.val = val
 
 	def to_string(self):
-		typename = get_mfunc_parameter(int(self.val['mf']))
+		typename = get_ops_parameter(int(self.val['ops']))
 		if typename is None:
 			return "custom_head<unknown>"
 		return f"custom_head<{typename}>"
 
 	def children(self):
-		typename = get_mfunc_parameter(int(self.val['mf']))
+		typename = get_ops_parameter(int(self.val['ops']))
+
+		storage = self.val['storage']
 
 		if typename is None or "nullptr" in typename:
-			return [("empty", self.val['data'])]
+			return [("empty", storage['heap'])]
 
 		try:
 			gdb_type = gdb.lookup_type(typename)
 		except gdb.error:
 			return [("data", f"<unavailable type {typename}>")]
 
-		ptr = self.val['data'].cast(gdb_type.pointer())
+		if self.val['ops']['is_inline']:
+			ptr = storage['local'].address.cast(gdb_type.pointer())
+		else:
+			ptr = storage['heap'].cast(gdb_type.pointer())
 
 		try:
 			return [("data", ptr.dereference())]
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <functional>
-#include <map>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <typeinfo>
 #include <variant>
@@ -107,116 +113,685 @@ template<class... Ts>
 struct overloaded : Ts... { using Ts::operator()...; };
 
 template <typename T>
-static bool compare(void* ptr, void* ptr2, std::enable_if_t<is_bool_comparable<T, T>::value, void>* = nullptr)
+static bool compare(const T* ptr, const T* ptr2, std::enable_if_t<is_bool_comparable<T, T>::value, void>* = nullptr)
 {
-	const T& obj1 = *static_cast<T*>(ptr);
-	const T& obj2 = *static_cast<T*>(ptr2);
+	const T& obj1 = *ptr;
+	const T& obj2 = *ptr2;
 
 	return (obj1 == obj2);
 }
 
 template <typename T>
-static bool compare(void*, void*, std::enable_if_t<!is_bool_comparable<T, T>::value, void>* = nullptr)
+static bool compare(const T*, const T*, std::enable_if_t<!is_bool_comparable<T, T>::value, void>* = nullptr)
 {
 	return false;
 }
 
+/* Memory resource the calling thread currently builds mctx trees with,
+ * std::pmr::new_delete_resource() unless overridden by mctx_resource_scope.
+ */
+std::pmr::memory_resource* current_memory_resource() noexcept;
+void set_current_memory_resource(std::pmr::memory_resource* resource) noexcept;
+
+/* Stateful allocator of mctx containers: captures the thread's current
+ * memory resource on construction, so nested containers created inside of
+ * a scope end up in the same arena without threading allocators through
+ * every constructor. Copies of a container pick the resource that is current
+ * at the moment of copying, same as std::pmr containers pick the default one.
+ */
 template<typename T>
-void emplace_copy(void* from, void* to)
+class mctx_allocator
+{
+	std::pmr::memory_resource* resource;
+
+	template<typename U>
+	friend class mctx_allocator;
+
+public:
+	using value_type = T;
+
+	using propagate_on_container_copy_assignment = std::false_type;
+	using propagate_on_container_move_assignment = std::false_type;
+	using propagate_on_container_swap = std::false_type;
+	using is_always_equal = std::false_type;
+
+	mctx_allocator() noexcept :
+		resource(current_memory_resource()) {}
+
+	explicit mctx_allocator(std::pmr::memory_resource* resource) noexcept :
+		resource(resource) {}
+
+	template<typename U>
+	mctx_allocator(const mctx_allocator<U>& other) noexcept :
+		resource(other.resource) {}
+
+	[[nodiscard]] T* allocate(size_t n)
+	{
+		return static_cast<T*>(this->resource->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* ptr, size_t n) noexcept
+	{
+		this->resource->deallocate(ptr, n * sizeof(T), alignof(T));
+	}
+
+	[[nodiscard]] mctx_allocator select_on_container_copy_construction() const
+	{
+		return mctx_allocator{};
+	}
+
+	[[nodiscard]] std::pmr::memory_resource* get_resource() const noexcept
+	{
+		return this->resource;
+	}
+
+	template<typename U>
+	bool operator==(const mctx_allocator<U>& other) const noexcept
+	{
+		return this->resource == other.resource || this->resource->is_equal(*other.resource);
+	}
+};
+
+/* FNV-1a, usable in constant expressions */
+constexpr uint64_t key_hash(std::string_view key) noexcept
 {
-	new (to) T(*static_cast<T*>(from));
+	uint64_t hash = 14695981039346656037ull;
+
+	for (char c : key)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
 }
 
-enum class adj_mf_ops
+/* Immutable, reference counted key text shared by every mctx_key equal to
+ * it, the characters follow the header.
+ */
+struct key_atom
 {
-	NONE = 0,
-	EMPLACE_COPY = 1,
-	COMPARE = 2,
-	COPY_TYPE_NAME = 3,
-	ALLOCATE = 4,
-	DEALLOCATE = 5,
-	DESTROY = 6
+	mutable std::atomic<uint64_t> references;
+	uint64_t hash;
+	uint32_t size;
+
+	[[nodiscard]] const char* data() const noexcept { return reinterpret_cast<const char*>(this + 1); }
 };
 
-using adj_mf_ops::NONE;
-using adj_mf_ops::EMPLACE_COPY;
-using adj_mf_ops::COMPARE;
-using adj_mf_ops::COPY_TYPE_NAME;
-using adj_mf_ops::ALLOCATE;
-using adj_mf_ops::DEALLOCATE;
-using adj_mf_ops::DESTROY;
+const key_atom* intern_key(std::string_view text, uint64_t hash);
+void release_key(const key_atom* atom) noexcept;
+
+template<typename, typename>
+struct is_in_variant : std::false_type {};
+
+template<typename T, typename... Ts>
+struct is_in_variant<T, std::variant<Ts...>> :
+	std::bool_constant<(std::is_same_v<std::remove_cvref_t<T>, std::remove_cvref_t<Ts>> || ...)> {};
+
+template<typename T, typename Variant>
+constexpr bool is_in_variant_v = is_in_variant<T, Variant>::value;
+
+// std::erase_if that applies the predicate exactly once per element, front to back
+template<typename Vector, typename F>
+size_t compact_if(Vector& values, F&& pred)
+{
+	auto out = values.begin();
+
+	for (auto iter = values.begin(); iter != values.end(); ++iter)
+	{
+		const auto& value = *iter;
+		if (pred(value))
+			continue;
+
+		if (out != iter)
+			*out = std::move(*iter);
 
-/* Returns hash ID, calls one of instantiated subroutines to
- * perform a type-specific operation.
- * Possible to expand later on?
+		++out;
+	}
+
+	const auto removed = static_cast<size_t>(values.end() - out);
+	values.erase(out, values.end());
+
+	return removed;
+}
+
+}
+
+class mctx;
+
+using mctx_array = std::vector<mctx, details::mctx_allocator<mctx>>;
+
+/* Interned object key: all keys with the same text share one atom from a
+ * process wide table, so a key costs a pointer and keys compare by address.
+ * Atoms are released when the last key referring to them is gone, they
+ * never come from the mctx memory resources.
  */
-template <typename T>
-size_t mfunc(void* ptr, void* ptr2, adj_mf_ops adjacent_operation)
+class mctx_key
 {
-	static const auto& type_info(typeid(T));
-	static const size_t hash_code{ type_info.hash_code() };
-	static const char* type_name{ type_info.name() };
-	static std::allocator<T> alloc{};
+public:
+	mctx_key() noexcept;
+	explicit mctx_key(std::string_view text);
+	~mctx_key();
 
-	switch (adjacent_operation)
+	mctx_key(const mctx_key& other) noexcept;
+	mctx_key(mctx_key&& other) noexcept;
+
+	mctx_key& operator=(const mctx_key& other) noexcept;
+	mctx_key& operator=(mctx_key&& other) noexcept;
+
+	[[nodiscard]] std::string_view view() const noexcept;
+	[[nodiscard]] std::string str() const;
+
+	[[nodiscard]] const char* data() const noexcept;
+	[[nodiscard]] size_t size() const noexcept;
+	[[nodiscard]] bool empty() const noexcept;
+
+	// details::key_hash of the text, computed once per atom
+	[[nodiscard]] uint64_t hash() const noexcept;
+
+	[[nodiscard]] size_t find(std::string_view text, size_t position = 0) const noexcept;
+
+	operator std::string_view() const noexcept;
+
+	friend bool operator==(const mctx_key& lhs, const mctx_key& rhs) noexcept { return lhs.atom == rhs.atom; }
+	friend bool operator==(const mctx_key& lhs, std::string_view rhs) noexcept { return lhs.view() == rhs; }
+
+private:
+	const details::key_atom* atom;	// nullptr for the empty key
+};
+
+/* Path to a nested value prepared for repeated lookups: keys are interned
+ * once when the path is built, so resolving a step is a probe with the
+ * stored hash and an address comparison.
+ */
+class mctx_path
+{
+public:
+	class segment
 	{
-		case EMPLACE_COPY:
-		{
-			emplace_copy<T>(ptr, ptr2);
-			break;
-		}
-		case COMPARE:
-		{
-			return compare<T>(ptr, ptr2);
-		}
-		case COPY_TYPE_NAME:
-		{
-			auto static_string_buffer = static_cast<const char**>(ptr);
-			*static_string_buffer = type_name;
-			break;
-		}
-		case ALLOCATE:
-		{
-			auto static_data_buffer = static_cast<T**>(ptr);
-			*static_data_buffer = alloc.allocate(1);
-			break;
-		}
-		case DEALLOCATE:
+		std::variant<mctx_key, size_t> step;
+
+	public:
+		segment(mctx_key key) noexcept;
+		segment(std::string_view key);
+		segment(const char* key);
+		segment(const std::string& key);
+		segment(size_t index) noexcept;
+		segment(int index);
+
+		[[nodiscard]] const mctx_key* key() const noexcept;
+		[[nodiscard]] const size_t* index() const noexcept;
+	};
+
+	mctx_path() = default;
+	mctx_path(std::initializer_list<segment> segments);
+	explicit mctx_path(std::vector<segment> segments) noexcept;
+
+	[[nodiscard]] const std::vector<segment>& segments() const noexcept;
+	[[nodiscard]] size_t size() const noexcept;
+	[[nodiscard]] bool empty() const noexcept;
+
+	mctx_path& append(segment next);
+
+private:
+	std::vector<segment> steps;
+};
+
+/* Key-value storage of mctx objects: entries live in one contiguous vector
+ * in insertion order. Small objects are searched with a linear scan, bigger
+ * ones additionally keep an open addressing table of entry positions.
+ * Keys must not be modified through iterators.
+ * Iteration goes in insertion order too, not by key as it did when objects
+ * were a std::map: erasing keeps the order of the other entries, assigning
+ * to a key that exists keeps its place. The native writers and the parser
+ * keep that order, json DOMs (serialize_mctx) sort the keys.
+ */
+class mctx_object
+{
+public:
+	using key_type = mctx_key;
+	using mapped_type = mctx;
+	using value_type = std::pair<mctx_key, mctx>;
+	using allocator_type = details::mctx_allocator<value_type>;
+	using size_type = size_t;
+
+private:
+	using entries = std::vector<value_type, allocator_type>;
+	using allocator_traits = std::allocator_traits<allocator_type>;
+
+	static constexpr bool nothrow_move_assignment =
+		allocator_traits::propagate_on_container_move_assignment::value || allocator_traits::is_always_equal::value;
+
+public:
+	using iterator = entries::iterator;
+	using const_iterator = entries::const_iterator;
+	using reverse_iterator = entries::reverse_iterator;
+	using const_reverse_iterator = entries::const_reverse_iterator;
+
+	// Objects of up to that many keys are not indexed
+	static constexpr size_t linear_threshold = 16;
+
+	mctx_object();
+	~mctx_object();
+
+	mctx_object(const mctx_object& other);
+	mctx_object(mctx_object&& other) noexcept;
+
+	mctx_object& operator=(const mctx_object& other);
+
+	/* Takes the storage over when both objects use the same memory resource,
+	 * moves the entries one by one into its own otherwise, which allocates.
+	 * Conditionally noexcept like the std::pmr containers.
+	 */
+	mctx_object& operator=(mctx_object&& other) noexcept(nothrow_move_assignment);
+
+	[[nodiscard]] iterator find(std::string_view key);
+	[[nodiscard]] const_iterator find(std::string_view key) const;
+	[[nodiscard]] bool contains(std::string_view key) const;
+
+	// Interned keys are matched by address
+	[[nodiscard]] iterator find(const mctx_key& key);
+	[[nodiscard]] const_iterator find(const mctx_key& key) const;
+	[[nodiscard]] bool contains(const mctx_key& key) const;
+
+	mctx& operator[](std::string_view key);
+	mctx& operator[](std::string&& key);
+	mctx& operator[](const char* key);
+	mctx& operator[](const mctx_key& key);
+
+	[[nodiscard]] mctx& at(std::string_view key);
+	[[nodiscard]] const mctx& at(std::string_view key) const;
+
+	std::pair<iterator, bool> try_emplace(std::string_view key, mctx value);
+	std::pair<iterator, bool> try_emplace(mctx_key key, mctx value);
+	std::pair<iterator, bool> insert_or_assign(std::string_view key, mctx value);
+	std::pair<iterator, bool> insert_or_assign(mctx_key key, mctx value);
+
+	// Keeps the order of the other entries, so the ones after pos are moved
+	iterator erase(const_iterator pos);
+	iterator erase(const_iterator first, const_iterator last);
+	size_type erase(std::string_view key);
+
+	// Removes the entries pred(const value_type&) holds for in one pass, the index is rebuilt once
+	template<typename F>
+	size_type erase_if(F pred);
+
+	[[nodiscard]] iterator begin() noexcept;
+	[[nodiscard]] iterator end() noexcept;
+	[[nodiscard]] const_iterator begin() const noexcept;
+	[[nodiscard]] const_iterator end() const noexcept;
+	[[nodiscard]] const_iterator cbegin() const noexcept;
+	[[nodiscard]] const_iterator cend() const noexcept;
+
+	[[nodiscard]] reverse_iterator rbegin() noexcept;
+	[[nodiscard]] reverse_iterator rend() noexcept;
+	[[nodiscard]] const_reverse_iterator rbegin() const noexcept;
+	[[nodiscard]] const_reverse_iterator rend() const noexcept;
+
+	[[nodiscard]] size_type size() const noexcept;
+	[[nodiscard]] bool empty() const noexcept;
+
+	void clear() noexcept;
+	void reserve(size_type capacity);
+
+	[[nodiscard]] allocator_type get_allocator() const noexcept;
+
+	// Order-independent, as for JSON objects
+	bool operator==(const mctx_object& other) const;
+
+private:
+	entries items;
+	uint32_t* index;		// entry position + 1, 0 is a free slot
+	uint32_t index_capacity;	// power of two
+
+	[[nodiscard]] size_type lookup(std::string_view key) const noexcept;
+	[[nodiscard]] size_type lookup(const mctx_key& key) const noexcept;
+	iterator append(mctx_key key, mctx value);
+
+	// Brings the index in line with the entries after removals
+	void reindex();
+	void index_insert(size_type position, uint64_t hash) noexcept;
+
+	// Takes the entry at position out before it's erased, the later ones move down by one
+	void index_remove(size_type position) noexcept;
+	void rebuild_index();
+	void release_index() noexcept;
+};
+
+/* Contiguous storage of arrays whose elements are all of one scalar kind.
+ * Elements have no mctx of their own: reference access through a const
+ * array is served by a generic mirror built once on demand, mutable access
+ * unpacks the array into a generic one.
+ */
+class mctx_packed_array
+{
+public:
+	template<typename T>
+	using vector = std::vector<T, details::mctx_allocator<T>>;
+
+	using storage =
+		std::variant<
+			vector<bool>,
+			vector<int64_t>,
+			vector<uint64_t>,
+			vector<float>,
+			vector<double>
+		>;
+
+	template<typename T>
+	static constexpr bool is_element_v = details::is_in_variant_v<vector<T>, storage>;
+
+	explicit mctx_packed_array(storage values);
+	~mctx_packed_array();
+
+	mctx_packed_array(const mctx_packed_array& other);
+	mctx_packed_array(mctx_packed_array&& other) noexcept;
+
+	mctx_packed_array& operator=(const mctx_packed_array& other);
+
+	// Allocates when the memory resources differ, see mctx_object
+	mctx_packed_array& operator=(mctx_packed_array&& other) noexcept(std::is_nothrow_move_assignable_v<storage>);
+
+	[[nodiscard]] size_t size() const noexcept;
+	[[nodiscard]] bool empty() const noexcept;
+
+	[[nodiscard]] const storage& values() const noexcept;
+	[[nodiscard]] storage& values() noexcept;
+
+	template<typename T>
+	[[nodiscard]] const vector<T>* get_if() const noexcept;
+
+	template<typename T>
+	[[nodiscard]] vector<T>* get_if() noexcept;
+
+	[[nodiscard]] mctx element(size_t index) const;
+
+	// Appends if the value is of the element kind, returns false otherwise
+	bool try_push_back(const mctx& value);
+
+	// Generic copy of the elements, served from the mirror if it was built
+	[[nodiscard]] const mctx_array& mirror() const;
+	[[nodiscard]] mctx_array release_array();
+
+	bool operator==(const mctx_packed_array& other) const;
+
+private:
+	storage items;
+	mutable std::mutex mirror_lock;
+	mutable std::atomic<mctx_array*> mirror_array;
+
+	void reset_mirror() noexcept;
+};
+
+template<typename T>
+const mctx_packed_array::vector<T>* mctx_packed_array::get_if() const noexcept
+{
+	return std::get_if<vector<T>>(&this->items);
+}
+
+template<typename T>
+mctx_packed_array::vector<T>* mctx_packed_array::get_if() noexcept
+{
+	// Elements may be changed through the result, the mirror can't be trusted after that
+	this->reset_mirror();
+	return std::get_if<vector<T>>(&this->items);
+}
+
+/* String pointing into a buffer kept alive by its owner (the input text of
+ * a parsed document, for instance) instead of holding a copy. Reference
+ * access as a std::string is served by a copy made once on demand, mutable
+ * access turns the node into a regular string.
+ */
+class mctx_string_slice
+{
+public:
+	mctx_string_slice(std::shared_ptr<const void> owner, std::string_view text) noexcept;
+	~mctx_string_slice();
+
+	mctx_string_slice(const mctx_string_slice& other) noexcept;
+	mctx_string_slice(mctx_string_slice&& other) noexcept;
+
+	mctx_string_slice& operator=(const mctx_string_slice& other) noexcept;
+	mctx_string_slice& operator=(mctx_string_slice&& other) noexcept;
+
+	[[nodiscard]] std::string_view view() const noexcept;
+	[[nodiscard]] const std::shared_ptr<const void>& owner() const noexcept;
+
+	[[nodiscard]] const std::string& str() const;
+
+	bool operator==(const mctx_string_slice& other) const noexcept;
+
+private:
+	std::shared_ptr<const void> buffer;
+	std::string_view text;
+	mutable std::atomic<std::string*> copy;
+};
+
+/* Array or object of a parsed document that is only built on first access:
+ * until then it is the range of its text in the source buffer, kept alive
+ * by the owner. The node is built once (const access from several threads
+ * is safe) by the parser that made the range, from the memory resource that
+ * was current when the lazy node was made. Malformed text inside the range
+ * throws on first access rather than at parse time.
+ */
+class mctx_lazy
+{
+public:
+	using builder = mctx (*)(const std::shared_ptr<const void>& owner, std::string_view text);
+
+	mctx_lazy(std::shared_ptr<const void> owner, std::string_view text, builder build) noexcept;
+	~mctx_lazy();
+
+	mctx_lazy(const mctx_lazy& other) noexcept;
+	mctx_lazy(mctx_lazy&& other) noexcept;
+
+	mctx_lazy& operator=(const mctx_lazy& other) noexcept;
+	mctx_lazy& operator=(mctx_lazy&& other) noexcept;
+
+	[[nodiscard]] std::string_view text() const noexcept;
+	[[nodiscard]] const std::shared_ptr<const void>& owner() const noexcept;
+
+	[[nodiscard]] bool is_built() const noexcept;
+	[[nodiscard]] const mctx& get() const;
+
+	bool operator==(const mctx_lazy& other) const;
+
+private:
+	std::shared_ptr<const void> buffer;
+	std::string_view range;
+	builder build;
+	std::pmr::memory_resource* resource;
+
+	mutable std::mutex build_lock;
+	mutable std::atomic<mctx*> node;
+};
+
+namespace details
+{
+
+/* Inline payload capacity of custom_head. mctx keeps the head in a boxed
+ * node, so every custom value costs that one allocation; the inline buffer
+ * only saves a second one for the payload. It is sized so the boxed node
+ * (resource, reference count, head, hash and version stamp) takes one
+ * 64 byte cache line, which holds handles, pointers, shared_ptr, vectors and
+ * small structs of up to three words.
+ */
+constexpr size_t custom_box_size = 64;
+constexpr size_t custom_inline_size = custom_box_size - 5 * sizeof(void*);
+constexpr size_t custom_inline_align = alignof(void*);
+
+template<typename T>
+constexpr bool is_inline_storable =
+	sizeof(T) <= custom_inline_size &&
+	alignof(T) <= custom_inline_align &&
+	std::is_nothrow_move_constructible_v<T>;
+
+struct custom_heap_block
+{
+	void* ptr;
+	std::pmr::memory_resource* resource;
+};
+
+union custom_storage
+{
+	custom_heap_block heap;
+	alignas(custom_inline_align) unsigned char local[custom_inline_size];
+};
+
+template<typename T>
+T* storage_ptr(custom_storage* storage)
+{
+	if constexpr (is_inline_storable<T>)
+		return reinterpret_cast<T*>(storage->local);
+	else
+		return static_cast<T*>(storage->heap.ptr);
+}
+
+template<typename T>
+const T* storage_ptr(const custom_storage* storage)
+{
+	return storage_ptr<T>(const_cast<custom_storage*>(storage));
+}
+
+template<typename T>
+void allocate(custom_storage& storage)
+{
+	if constexpr (!is_inline_storable<T>)
+	{
+		auto resource = current_memory_resource();
+		storage.heap = { resource->allocate(sizeof(T), alignof(T)), resource };
+	}
+}
+
+template<typename T>
+void deallocate(custom_storage& storage)
+{
+	if constexpr (!is_inline_storable<T>)
+	{
+		storage.heap.resource->deallocate(storage.heap.ptr, sizeof(T), alignof(T));
+		storage.heap = { nullptr, nullptr };
+	}
+}
+
+template<typename T>
+void emplace_copy(const custom_storage& from, custom_storage& to)
+{
+	if constexpr (std::is_copy_constructible_v<T>)
+	{
+		allocate<T>(to);
+
+		try
 		{
-			alloc.deallocate(static_cast<T*>(ptr), 1);
-			break;
+			new (storage_ptr<T>(&to)) T(*storage_ptr<T>(&from));
 		}
-		case DESTROY:
+		catch (...)
 		{
-			if constexpr (!std::is_trivially_destructible_v<T>)
-				static_cast<T*>(ptr)->~T();
-			break;
+			deallocate<T>(to);
+			throw;
 		}
-		default:
-			break;
 	}
+	else
+		throw std::runtime_error("Custom type is not copy constructible");
+}
 
-	return hash_code;
+template<typename T>
+void emplace_move(custom_storage& from, custom_storage& to) noexcept
+{
+	if constexpr (is_inline_storable<T>)
+	{
+		auto moved_from = storage_ptr<T>(&from);
+		new (storage_ptr<T>(&to)) T(std::move(*moved_from));
+		moved_from->~T();
+	}
+	else
+	{
+		to.heap = from.heap;
+		from.heap = { nullptr, nullptr };
+	}
 }
 
-template<>
-size_t mfunc<std::nullptr_t>(void*, void*, adj_mf_ops);
+template<typename T>
+void destroy(custom_storage& storage) noexcept
+{
+	if constexpr (!std::is_trivially_destructible_v<T>)
+		storage_ptr<T>(&storage)->~T();
+
+	deallocate<T>(storage);
+}
 
-using mf_sig = size_t(*)(void* ptr, void* ptr2, adj_mf_ops adjacent_operation);
+template<typename T>
+bool compare_storage(const custom_storage& lhs, const custom_storage& rhs)
+{
+	return compare<T>(storage_ptr<T>(&lhs), storage_ptr<T>(&rhs));
+}
+
+/* Per-type table of operations over custom_storage.
+ * Every instantiation of custom_ops_for<T> has a unique address,
+ * which serves as compile-time type identity of the stored value.
+ */
+struct custom_ops
+{
+	const std::type_info* type;
+	bool is_inline;
+	void (*copy)(const custom_storage& from, custom_storage& to);
+	void (*move)(custom_storage& from, custom_storage& to) noexcept;
+	void (*destroy)(custom_storage& storage) noexcept;
+	bool (*compare)(const custom_storage& lhs, const custom_storage& rhs);
+};
+
+template<typename T>
+inline constexpr custom_ops custom_ops_for
+{
+	&typeid(T),
+	is_inline_storable<T>,
+	&emplace_copy<T>,
+	&emplace_move<T>,
+	&destroy<T>,
+	&compare_storage<T>
+};
+
+inline void empty_copy(const custom_storage&, custom_storage&) {}
+inline void empty_move(custom_storage&, custom_storage&) noexcept {}
+inline void empty_destroy(custom_storage&) noexcept {}
+inline bool empty_compare(const custom_storage&, const custom_storage&) { return true; }
+
+template<>
+inline constexpr custom_ops custom_ops_for<std::nullptr_t>
+{
+	&typeid(std::nullptr_t),
+	true,
+	&empty_copy,
+	&empty_move,
+	&empty_destroy,
+	&empty_compare
+};
 
 class custom_head final
 {
-	void* data;
-	mf_sig mf;
+	custom_storage storage;
+	const custom_ops* ops;
 
 public:
 	template<class T>
 	custom_head(T&& value) requires (!std::is_same_v<std::remove_cvref_t<T>, custom_head>) :
-		data(nullptr),
-		mf(mfunc<std::remove_cvref_t<T>>)
+		storage{ { nullptr, nullptr } },
+		ops(&custom_ops_for<std::nullptr_t>)
 	{
-		this->mf(&this->data, nullptr, ALLOCATE);
-		data = new (static_cast<std::remove_cvref_t<T>*>(this->data)) std::remove_cvref_t<T>(std::forward<T>(value));
+		using U = std::remove_cvref_t<T>;
+
+		allocate<U>(this->storage);
+
+		try
+		{
+			new (storage_ptr<U>(&this->storage)) U(std::forward<T>(value));
+		}
+		catch (...)
+		{
+			deallocate<U>(this->storage);
+			throw;
+		}
+
+		this->ops = &custom_ops_for<U>;
 	}
 
 	custom_head();
@@ -225,7 +800,7 @@ public:
 	custom_head(const custom_head& lhs);
 	custom_head(custom_head&& lhs) noexcept;
 
-	void reset(mf_sig new_mf_sig = mfunc<std::nullptr_t>);
+	void reset();
 	void swap(custom_head& lhs) noexcept;
 
 	custom_head& operator=(const custom_head& lhs);
@@ -236,15 +811,14 @@ public:
 	template<typename T>
 	[[nodiscard]] bool is() const
 	{
-		auto hash_id = typeid(T).hash_code();
-		return this->mf(nullptr, nullptr, NONE) == hash_id;
+		return this->ops == &custom_ops_for<std::remove_cv_t<T>>;
 	}
 
 	template<typename T>
 	T get() const
 	{
 		if (this->is<T>())
-			return *static_cast<const T*>(this->data);
+			return *storage_ptr<T>(&this->storage);
 
 		throw std::runtime_error("Bad get<T>() call");
 	}
@@ -252,69 +826,330 @@ public:
 	template<typename T>
 	T get(T default_value) const
 	{
-		if (this->is<T>())
-			return *static_cast<const T*>(this->data);
-		return default_value;
+		if (this->is<T>())
+			return *storage_ptr<T>(&this->storage);
+		return default_value;
+	}
+
+	template<typename T>
+	[[nodiscard]] const T& as() const
+	{
+		if (this->is<T>())
+			return *storage_ptr<T>(&this->storage);
+
+		throw std::runtime_error("Bad as<T>() const call");
+	}
+
+	template<typename T>
+	[[nodiscard]] T& as()
+	{
+		if (this->is<T>())
+			return *storage_ptr<T>(&this->storage);
+
+		throw std::runtime_error("Bad as<T>() const call");
+	}
+
+	[[nodiscard]] const char* get_type_name() const
+	{
+		return this->ops->type->name();
+	}
+
+	[[nodiscard]] const std::type_info& get_type() const
+	{
+		return *this->ops->type;
+	}
+
+	bool operator==(const custom_head& lhs) const;
+	bool operator!=(const custom_head& lhs) const;
+};
+
+template<typename T>
+constexpr bool is_integer_v = std::is_integral_v<T> && (!std::is_same_v<bool, T>);
+
+template<typename T, bool = is_integer_v<T>>
+struct __possible_integral_alternative
+{
+	using type = T;
+};
+
+template<typename T>
+struct __possible_integral_alternative<T, true>
+{
+	using type = std::conditional_t<std::is_signed_v<T>, int64_t, uint64_t>;
+};
+
+template<typename T>
+using possible_integral_alternative = __possible_integral_alternative<T>::type;
+
+template<typename T>
+struct as_res
+{
+	using U = possible_integral_alternative<T>;
+	constexpr static bool enable_type_punning = !std::is_same_v<U, T>;
+
+	using type = std::conditional_t<enable_type_punning, T, U>;
+};
+
+/* Pointer to a reference counted heap node taken from the memory resource
+ * that was current at construction, keeps mctx nodes small for the types
+ * that are bigger than a scalar.
+ * Copies share the node as long as they are taken under the same memory
+ * resource (and are deep otherwise), mutable access clones a shared node
+ * first. Mutable access also marks the node leaked: references into it may
+ * be held for as long as the node lives, so copies clone a leaked node
+ * instead of sharing it, like they would with a deep copy.
+ * The node also caches the structural hash of the value (see mctx::hash)
+ * unless it is leaked.
+ */
+template<typename T>
+class boxed
+{
+	struct node
+	{
+		std::pmr::memory_resource* resource;
+		std::atomic<size_t> references;
+		T value;
+		mutable std::atomic<uint64_t> hash = 0;	// 0 while not computed
+	};
+
+	node* ptr;
+
+	// Kept in the reference count, only ever set on nodes with a single owner
+	static constexpr size_t leaked = size_t(1) << (std::numeric_limits<size_t>::digits - 1);
+
+	template<typename... Args>
+	static node* make_node(Args&&... args)
+	{
+		auto resource = current_memory_resource();
+		auto memory = resource->allocate(sizeof(node), alignof(node));
+
+		try
+		{
+			return new (memory) node{ resource, 1, T(std::forward<Args>(args)...) };
+		}
+		catch (...)
+		{
+			resource->deallocate(memory, sizeof(node), alignof(node));
+			throw;
+		}
+	}
+
+	static node* share(node* shared)
+	{
+		if (shared == nullptr)
+			return nullptr;
+
+		if (shared->resource != current_memory_resource() || (shared->references.load(std::memory_order_relaxed) & leaked) != 0)
+			return make_node(std::as_const(shared->value));
+
+		shared->references.fetch_add(1, std::memory_order_relaxed);
+		return shared;
+	}
+
+	void release() noexcept
+	{
+		if (this->ptr == nullptr)
+			return;
+
+		if ((this->ptr->references.fetch_sub(1, std::memory_order_acq_rel) & ~leaked) == 1)
+		{
+			auto resource = this->ptr->resource;
+			this->ptr->~node();
+			resource->deallocate(this->ptr, sizeof(node), alignof(node));
+		}
+
+		this->ptr = nullptr;
+	}
+
+	void unshare()
+	{
+		if ((this->ptr->references.load(std::memory_order_acquire) & ~leaked) != 1)
+		{
+			auto copy = make_node(std::as_const(this->ptr->value));
+			this->release();
+			this->ptr = copy;
+		}
+
+		this->ptr->hash.store(0, std::memory_order_relaxed);
+	}
+
+public:
+	template<typename... Args>
+	explicit boxed(std::in_place_t, Args&&... args) :
+		ptr(make_node(std::forward<Args>(args)...)) {}
+
+	boxed(const boxed& other) :
+		ptr(share(other.ptr)) {}
+
+	boxed(boxed&& other) noexcept :
+		ptr(other.ptr)
+	{
+		other.ptr = nullptr;
+	}
+
+	~boxed()
+	{
+		this->release();
+	}
+
+	boxed& operator=(const boxed& other)
+	{
+		if (&other != this)
+		{
+			auto shared = share(other.ptr);
+			this->release();
+			this->ptr = shared;
+		}
+
+		return *this;
+	}
+
+	boxed& operator=(boxed&& other) noexcept
+	{
+		if (&other != this)
+		{
+			this->release();
+			this->ptr = other.ptr;
+			other.ptr = nullptr;
+		}
+
+		return *this;
+	}
+
+	[[nodiscard]] bool is_shared() const noexcept
+	{
+		return this->ptr != nullptr && (this->ptr->references.load(std::memory_order_relaxed) & ~leaked) > 1;
+	}
+
+	[[nodiscard]] bool is_leaked() const noexcept
+	{
+		return this->ptr != nullptr && (this->ptr->references.load(std::memory_order_relaxed) & leaked) != 0;
+	}
+
+	// Makes the node unique and marks it leaked, done by every mutable access below
+	void leak()
+	{
+		if (this->is_leaked())
+			return;
+
+		this->unshare();
+		this->ptr->references.store(1 | leaked, std::memory_order_relaxed);
+	}
+
+	/* Mutable access for changes that keep no reference into the value past
+	 * the call (appending, erasing), the node stays shareable.
+	 */
+	T& edit() { this->unshare(); return this->ptr->value; }
+
+	/* Drops the leaked mark, for owners that know no reference into the
+	 * value is held anymore. Gives the value to clear its elements too.
+	 */
+	T& seal() noexcept
+	{
+		this->ptr->references.fetch_and(~leaked, std::memory_order_relaxed);
+		return this->ptr->value;
+	}
+
+	[[nodiscard]] bool same_node(const boxed& other) const noexcept
+	{
+		return this->ptr == other.ptr;
 	}
 
-	template<typename T>
-	[[nodiscard]] const T& as() const
+	/* The node, if copies taken now share it and it can't be changed in
+	 * place while they're alive: it's not leaked, and it comes from the
+	 * current memory resource. nullptr otherwise.
+	 */
+	[[nodiscard]] const void* stable_node() const noexcept
 	{
-		if (this->is<T>())
-			return *static_cast<const T*>(data);
+		if (this->ptr == nullptr || this->is_leaked() || this->ptr->resource != current_memory_resource())
+			return nullptr;
 
-		throw std::runtime_error("Bad as<T>() const call");
+		return this->ptr;
 	}
 
-	template<typename T>
-	[[nodiscard]] T& as()
+	/* Nodes that never handed out mutable access can only change through
+	 * their owner, which drops the hash first. A leaked node could be
+	 * mutated through a reference held from before the hash without the
+	 * node seeing it, so it keeps none.
+	 */
+	[[nodiscard]] uint64_t cached_hash() const noexcept
 	{
-		if (this->is<T>())
-			return *static_cast<T*>(data);
-
-		throw std::runtime_error("Bad as<T>() const call");
+		return this->ptr == nullptr || this->is_leaked() ? 0 : this->ptr->hash.load(std::memory_order_relaxed);
 	}
 
-	[[nodiscard]] const char* get_type_name() const
+	void cache_hash(uint64_t hash) const noexcept
 	{
-		auto res = "";
-		this->mf(reinterpret_cast<void*>(&res), nullptr, COPY_TYPE_NAME);
-		return res;
+		if (this->ptr != nullptr && !this->is_leaked())
+			this->ptr->hash.store(hash, std::memory_order_relaxed);
 	}
 
-	bool operator==(const custom_head& lhs) const;
-	bool operator!=(const custom_head& lhs) const;
+	T& operator*() { this->leak(); return this->ptr->value; }
+	const T& operator*() const noexcept { return this->ptr->value; }
+
+	T* operator->() { this->leak(); return &this->ptr->value; }
+	const T* operator->() const noexcept { return &this->ptr->value; }
 };
 
+template<typename T, typename... Args>
+boxed<T> make_boxed(Args&&... args)
+{
+	return boxed<T>(std::in_place, std::forward<Args>(args)...);
+}
+
+template<typename>
+struct is_boxed : std::false_type {};
+
 template<typename T>
-using possible_integral_alternative =
-	std::conditional_t<std::is_integral_v<T> && (!std::is_same_v<bool, T>), uint64_t, T>;
+struct is_boxed<boxed<T>> : std::true_type {};
 
 template<typename T>
-struct as_res
+constexpr bool is_boxed_v = is_boxed<std::remove_cvref_t<T>>::value;
+
+template<typename T>
+decltype(auto) unbox(T& value)
 {
-	using U = possible_integral_alternative<T>;
-	constexpr static bool enable_type_punning = !std::is_same_v<U, T>;
+	if constexpr (is_boxed_v<T>)
+		return *value;
+	else
+		return (value);
+}
 
-	using type = std::conditional_t<enable_type_punning, T, U>;
-};
+}
 
-template<typename, typename>
-struct is_in_variant : std::false_type {};
+/* Makes containers (and heap-stored custom values) of mctx trees built by
+ * this thread come from the given memory resource until the scope ends.
+ * Trees built inside of the scope must not outlive the resource.
+ */
+class mctx_resource_scope
+{
+	std::pmr::memory_resource* previous;
 
-template<typename T, typename... Ts>
-struct is_in_variant<T, std::variant<Ts...>> :
-	std::bool_constant<(std::is_same_v<std::remove_cvref_t<T>, std::remove_cvref_t<Ts>> || ...)> {};
+public:
+	explicit mctx_resource_scope(std::pmr::memory_resource* resource) noexcept;
+	~mctx_resource_scope();
 
-template<typename T, typename Variant>
-constexpr bool is_in_variant_v = is_in_variant<T, Variant>::value;
+	mctx_resource_scope(const mctx_resource_scope&) = delete;
+	mctx_resource_scope& operator=(const mctx_resource_scope&) = delete;
+};
 
-}
+/* Monotonic arena for throw-away trees: everything built while the arena is
+ * alive is allocated from it, and released all at once when it is destroyed.
+ * Destroy (or clear) trees built inside of it before the arena itself.
+ */
+class mctx_arena
+{
+	std::pmr::monotonic_buffer_resource resource;
+	mctx_resource_scope scope;
 
-class mctx;
+public:
+	explicit mctx_arena(size_t initial_size = 64 * 1024);
+	explicit mctx_arena(std::pmr::memory_resource* upstream, size_t initial_size = 64 * 1024);
+
+	mctx_arena(const mctx_arena&) = delete;
+	mctx_arena& operator=(const mctx_arena&) = delete;
 
-using mctx_array = std::vector<mctx>;
-using mctx_object = std::map<std::string, mctx>;
+	[[nodiscard]] std::pmr::memory_resource* get_resource() noexcept;
+};
 
 class mctx
 {
@@ -322,20 +1157,54 @@ class mctx
 	using array = mctx_array;
 	using string = std::string;
 	using custom = details::custom_head;
+	using packed = mctx_packed_array;
+	using slice = mctx_string_slice;
+	using lazy = mctx_lazy;
 
-	using value =
+	friend class mctx_packed_array;
+	friend class mctx_snapshot;
+
+	// Kinds a node can hold, in the order of value alternatives
+	using value_types =
 		std::variant<
 			std::monostate,
 			bool,
+			int64_t,
 			uint64_t,
 			float,
 			double,
 			string,
 			custom,
 			array,
-			object
+			object,
+			packed,
+			slice,
+			lazy
+		>;
+
+	// Scalars are stored inline, everything bigger than a pointer is boxed
+	template<typename T>
+	using stored_t = std::conditional_t<(sizeof(T) > sizeof(void*)), details::boxed<T>, T>;
+
+	using value =
+		std::variant<
+			std::monostate,
+			bool,
+			int64_t,
+			uint64_t,
+			float,
+			double,
+			stored_t<string>,
+			stored_t<custom>,
+			stored_t<array>,
+			stored_t<object>,
+			stored_t<packed>,
+			stored_t<slice>,
+			stored_t<lazy>
 		>;
 
+	static_assert(std::variant_size_v<value> == std::variant_size_v<value_types>);
+
 	explicit mctx(custom v);
 
 	template<typename T>
@@ -346,19 +1215,43 @@ class mctx
 	static constexpr bool custom_type_reqs =
 		!std::is_fundamental_v<std::remove_cvref_t<T>> &&
 		!std::is_same_v<mctx, std::remove_cvref_t<T>> &&
-		!details::is_in_variant_v<std::remove_cvref_t<T>, value>;
+		!std::is_same_v<std::nullptr_t, std::remove_cvref_t<T>> &&
+		!details::is_in_variant_v<std::remove_cvref_t<T>, value_types>;
 
 public:
 
 	class value_iter;
 	class key_value_iter;
 
+	// Contiguous views straight over the container storage, iterated without per-step dispatch
+	using array_view = std::span<mctx>;
+	using const_array_view = std::span<const mctx>;
+	using object_view = std::span<mctx_object::value_type>;
+	using const_object_view = std::span<const mctx_object::value_type>;
+
+	enum class value_kind : uint8_t
+	{
+		none = 0,
+		boolean,
+		signed_integer,
+		unsigned_integer,
+		float32,
+		float64,
+		string,
+		custom,
+		array,
+		object,
+		packed_array,
+		string_slice
+	};
+
 	mctx();
-	virtual ~mctx() = default;
+	~mctx() = default;
 
 	template<typename T>
 	mctx(T&& v) requires integral_constructor_req<T>;
 
+	mctx(std::nullptr_t);
 	mctx(bool v);
 	mctx(double v);
 	mctx(float v);
@@ -366,6 +1259,15 @@ public:
 	mctx(const char* v);
 
 	mctx(std::string v);
+	mctx(mctx_string_slice v);
+	mctx(mctx_lazy v);
+
+	/* Take containers built beforehand. Unlike ones filled through
+	 * if_array() or if_object(), they aren't leaked (see details::boxed)
+	 * unless they hold leaked values.
+	 */
+	explicit mctx(mctx_array v);
+	explicit mctx(mctx_object v);
 
 	mctx(const mctx& v);
 	mctx(mctx&& v) noexcept;
@@ -376,6 +1278,7 @@ public:
 	template<typename T>
 	mctx& operator=(std::initializer_list<T>);
 
+	// Vectors of scalars are stored packed, see mctx_packed_array
 	template<typename T>
 	mctx(std::vector<T>);
 
@@ -383,6 +1286,8 @@ public:
 	mctx(T v) requires custom_type_reqs<T>;
 
 	[[nodiscard]] bool empty() const;
+	// Kind of the value, lazy nodes report the kind they are built into
+	[[nodiscard]] value_kind kind() const;
 
 	template<typename T>
 	[[nodiscard]] bool is() const;
@@ -403,18 +1308,54 @@ public:
 	[[nodiscard]] T get_as(T default_value = T()) const;
 
 	template<typename T>
-	[[nodiscard]] T get(const std::string& key, T default_value = T()) const;
+	[[nodiscard]] T get(std::string_view key, T default_value = T()) const;
+
+	template<typename T>
+	[[nodiscard]] T get_as(std::string_view key, T default_value = T()) const;
+
+	// Node at the path, nullptr if some step is missing. Mutable resolution unshares the nodes on the way
+	[[nodiscard]] const mctx* resolve(const mctx_path& path) const;
+	[[nodiscard]] mctx* resolve(const mctx_path& path);
+
+	template<typename T>
+	[[nodiscard]] T get(const mctx_path& path, T default_value = T()) const;
 
 	template<typename T>
-	[[nodiscard]] T get_as(const std::string& key, T default_value = T()) const;
+	[[nodiscard]] T get_as(const mctx_path& path, T default_value = T()) const;
 
 	[[nodiscard]] bool is_none() const;
 	[[nodiscard]] bool is_scalar() const;
 	[[nodiscard]] bool is_array() const;
 	[[nodiscard]] bool is_object() const;
 
-	[[nodiscard]] value_iter find(const std::string& str);
-	[[nodiscard]] value_iter find(const std::string& str) const;
+	[[nodiscard]] bool is_packed() const;
+	[[nodiscard]] bool is_slice() const;
+
+	/* True until a lazy node is replaced by what it builds. Const access
+	 * only builds it (once, shared by copies), mutable access or
+	 * materialize() put the built value in its place.
+	 */
+	[[nodiscard]] bool is_lazy() const noexcept;
+	void materialize();
+
+	// Text of a string or a string slice, throws for other kinds
+	[[nodiscard]] std::string_view as_string_view() const;
+
+	template<typename T>
+	[[nodiscard]] const mctx_packed_array::vector<T>& as_packed() const;
+
+	template<typename T>
+	[[nodiscard]] mctx_packed_array::vector<T>& as_packed();
+
+	// Packs a non-empty generic array whose elements are all of one scalar kind
+	bool try_pack();
+	void unpack();
+
+	// Replaces a string slice with its own copy of the text
+	void unslice();
+
+	[[nodiscard]] value_iter find(std::string_view str);
+	[[nodiscard]] value_iter find(std::string_view str) const;
 	[[nodiscard]] value_iter begin();
 	[[nodiscard]] value_iter end();
 	[[nodiscard]] value_iter begin() const;
@@ -426,8 +1367,9 @@ public:
 	[[nodiscard]] value_iter rbegin() const;
 	[[nodiscard]] value_iter rend() const;
 
-	[[nodiscard]] key_value_iter kvfind(const std::string& str);
-	[[nodiscard]] key_value_iter kvfind(const std::string& str) const;
+	// Objects are walked in insertion order, see mctx_object
+	[[nodiscard]] key_value_iter kvfind(std::string_view str);
+	[[nodiscard]] key_value_iter kvfind(std::string_view str) const;
 	[[nodiscard]] key_value_iter kvbegin() const;
 	[[nodiscard]] key_value_iter kvend() const;
 	[[nodiscard]] key_value_iter kvbegin();
@@ -436,15 +1378,29 @@ public:
 	value_iter erase(value_iter iter);
 	key_value_iter erase(key_value_iter iter);
 
+	/* Removes the elements of an array or the entries of an object that pred
+	 * holds for, in a single pass; returns how many were removed. pred takes
+	 * const mctx&, object entries may also be tested as
+	 * pred(const mctx_key&, const mctx&). Packed arrays stay packed.
+	 */
+	template<typename F>
+	size_t erase_if(F pred);
+
+	// Keeps only what pred holds for, the rest as erase_if
+	template<typename F>
+	size_t retain(F pred);
+
+	class erase_batch;
+
 	// Container operations
-	mctx& operator[](const std::string& key);
+	mctx& operator[](std::string_view key);
 
 	mctx& operator[](size_t index);
 	const mctx& operator[](size_t index) const;
 
-	[[nodiscard]] const mctx& at(const std::string& key) const;
+	[[nodiscard]] const mctx& at(std::string_view key) const;
 	[[nodiscard]] const mctx& at(size_t index) const;
-	mctx& at(const std::string& key);
+	mctx& at(std::string_view key);
 	mctx& at(size_t index);
 
 	void push_back(mctx value);
@@ -452,17 +1408,88 @@ public:
 	[[nodiscard]] size_t size() const;
 
 	void clear();
-	void erase(const std::string& str);
+	void erase(std::string_view str);
 	value_iter erase(const value_iter& begin, const value_iter& end);
 	key_value_iter erase(const key_value_iter& begin, const key_value_iter& end);
 
 	static mctx make_array();
 	static mctx make_object();
 
+	template<typename T>
+	static mctx make_packed_array(size_t capacity = 0) requires mctx_packed_array::is_element_v<T>;
+
+	/* Calls f with the held value in a single dispatch: std::monostate, bool,
+	 * int64_t, uint64_t, float, double, std::string, details::custom_head,
+	 * mctx_array, mctx_object, mctx_packed_array or mctx_string_slice.
+	 * Mutable visitation unshares the node.
+	 */
+	template<typename F>
+	decltype(auto) visit(F&& f);
+
+	template<typename F>
+	decltype(auto) visit(F&& f) const;
+
+	// Pointers to the held container or string, nullptr for other kinds
+	[[nodiscard]] const array* if_array() const;
+	[[nodiscard]] const object* if_object() const;
+	[[nodiscard]] const string* if_string() const;
+
+	// Mutable access to a packed array unpacks it, to a string slice unslices it
+	[[nodiscard]] array* if_array();
+	[[nodiscard]] object* if_object();
+	[[nodiscard]] string* if_string();
+
+	/* Elements of an array and entries of an object as typed views, empty
+	 * for other kinds. Same rules as if_array: const elements of a packed
+	 * array come from its mirror, mutable ones unpack it. Object keys must
+	 * not be modified through the views; std::views::values(members())
+	 * gives the values alone.
+	 */
+	[[nodiscard]] const_array_view elements() const;
+	[[nodiscard]] const_object_view members() const;
+	[[nodiscard]] array_view elements();
+	[[nodiscard]] object_view members();
+
+	/* Structural hash, consistent with operator==: equal trees hash the same
+	 * regardless of packing, slicing and object key order. Cached in boxed
+	 * nodes that were never given out for mutable access, the others are
+	 * hashed anew every time.
+	 */
+	[[nodiscard]] size_t hash() const;
+
+	// Shared nodes are equal without looking inside, nodes with different cached hashes are not
 	bool operator==(const mctx& v) const;
 
+	/* Address of the boxed node, if it holds the same value for as long as
+	 * a copy of this is kept (see details::boxed::stable_node). nullptr for
+	 * scalars, leaked and lazy nodes.
+	 */
+	[[nodiscard]] const void* stable_node() const noexcept;
+
 private:
 	value var;
+
+	// Node a lazy one is built into, nullptr for the other kinds
+	[[nodiscard]] const mctx* lazy_target() const;
+
+	// Lazy nodes are looked through: const access builds them, mutable access materializes them
+	template<typename T>
+	[[nodiscard]] T* get_if_value();
+
+	template<typename T>
+	[[nodiscard]] const T* get_if_value() const;
+
+	// Same as get_if_value, for changes that keep the node shareable (see details::boxed::edit)
+	template<typename T>
+	[[nodiscard]] T* edit_if_value();
+
+	/* Containers holding a leaked node are leaked too, so copies of them
+	 * can't share it either.
+	 */
+	[[nodiscard]] bool is_leaked() const noexcept;
+
+	// Drops the leaked marks of the tree, see details::boxed::seal
+	void seal() noexcept;
 };
 
 class mctx::value_iter
@@ -556,17 +1583,104 @@ private:
 	[[nodiscard]] object::value_type* access() const;
 };
 
+/* Deferred removal from an array or an object: erase only tombstones the
+ * element, so positions of the others stay put while the batch is open,
+ * and commit compacts the container once. Pending removals are committed
+ * on destruction. Elements may be appended to the target meanwhile, but it
+ * must not be reordered or have elements removed by other means.
+ */
+class mctx::erase_batch
+{
+	mctx& target;
+	std::vector<bool> tombstones;
+	size_t marked = 0;
+
+public:
+	explicit erase_batch(mctx& target);
+	~erase_batch();
+
+	erase_batch(const erase_batch&) = delete;
+	erase_batch& operator=(const erase_batch&) = delete;
+
+	// False if the element was already erased
+	bool erase(size_t index);
+
+	// Objects only, false if there is no such key or it was already erased
+	bool erase(std::string_view key);
+
+	[[nodiscard]] bool erased(size_t index) const noexcept;
+	[[nodiscard]] size_t pending() const noexcept;
+
+	// Removes the tombstoned elements, returns how many
+	size_t commit();
+};
+
 template<typename T>
 mctx::mctx(T&& v) requires integral_constructor_req<T> :
-	var(static_cast<uint64_t>( static_cast<details::try_unsigned<std::remove_cvref_t<T>>::type>(v))) { }
+	var(static_cast<details::possible_integral_alternative<std::remove_cvref_t<T>>>(v)) { }
 
 template <typename T>
-mctx::mctx(std::vector<T> values) :
-	var(array{std::move(values)}) {}
+mctx::mctx(std::vector<T> values)
+{
+	using element = details::possible_integral_alternative<T>;
+
+	if constexpr (packed::is_element_v<element>)
+	{
+		using vector = packed::vector<element>;
+		this->var = details::make_boxed<packed>(packed::storage(std::in_place_type<vector>, values.begin(), values.end()));
+	}
+	else
+	{
+		bool holds_leaked = false;
+		if constexpr (std::is_same_v<T, mctx>)
+			holds_leaked = std::ranges::any_of(values, [](const mctx& value) { return value.is_leaked(); });
+
+		auto elements = details::make_boxed<array>(std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()));
+		if (holds_leaked)
+			elements.leak();
+
+		this->var = std::move(elements);
+	}
+}
+
+template<typename T>
+mctx mctx::make_packed_array(size_t capacity) requires mctx_packed_array::is_element_v<T>
+{
+	packed::vector<T> values;
+	values.reserve(capacity);
+
+	mctx m;
+	m.var = details::make_boxed<packed>(packed::storage(std::move(values)));
+	return m;
+}
+
+template<typename T>
+const mctx_packed_array::vector<T>& mctx::as_packed() const
+{
+	const auto* packed_ptr = this->get_if_value<packed>();
+	const auto* values = packed_ptr == nullptr ? nullptr : packed_ptr->get_if<T>();
+
+	if (values == nullptr)
+		throw std::runtime_error("Bad as_packed<T> const call");
+
+	return *values;
+}
+
+template<typename T>
+mctx_packed_array::vector<T>& mctx::as_packed()
+{
+	auto* packed_ptr = this->get_if_value<packed>();
+	auto* values = packed_ptr == nullptr ? nullptr : packed_ptr->get_if<T>();
+
+	if (values == nullptr)
+		throw std::runtime_error("Bad as_packed<T> call");
+
+	return *values;
+}
 
 template <typename T>
 mctx::mctx(T v) requires custom_type_reqs<T> :
-	var(custom{v}) {}
+	var(details::make_boxed<custom>(std::move(v))) {}
 
 template <typename T>
 mctx& mctx::operator=(std::initializer_list<T> list)
@@ -577,22 +1691,166 @@ mctx& mctx::operator=(std::initializer_list<T> list)
 	for (auto & value : list)
 		values.emplace_back(std::move(value));
 
-	var = std::move(values);
+	var = details::make_boxed<array>(std::move(values));
 	return *this;
 }
 
+template<typename T>
+T* mctx::get_if_value()
+{
+	if constexpr (!std::is_same_v<T, lazy>)
+		this->materialize();
+
+	if (auto* ptr = std::get_if<stored_t<T>>(&this->var))
+		return &details::unbox(*ptr);
+
+	return nullptr;
+}
+
+template<typename T>
+T* mctx::edit_if_value()
+{
+	if constexpr (!std::is_same_v<T, lazy>)
+		this->materialize();
+
+	if (auto* ptr = std::get_if<stored_t<T>>(&this->var))
+	{
+		if constexpr (details::is_boxed_v<stored_t<T>>)
+			return &ptr->edit();
+		else
+			return ptr;
+	}
+
+	return nullptr;
+}
+
+template<typename T>
+const T* mctx::get_if_value() const
+{
+	if (const auto* ptr = std::get_if<stored_t<T>>(&this->var))
+		return &details::unbox(*ptr);
+
+	if constexpr (!std::is_same_v<T, lazy>)
+		if (const auto* target = this->lazy_target())
+			return target->template get_if_value<T>();
+
+	return nullptr;
+}
+
+template<typename F>
+decltype(auto) mctx::visit(F&& f)
+{
+	this->materialize();
+
+	return std::visit([&f](auto& v) -> decltype(auto)
+	{
+		// Never reached for lazy nodes, they are materialized above
+		if constexpr (std::is_same_v<std::remove_cvref_t<decltype(v)>, stored_t<lazy>>)
+		{
+			static std::monostate none;
+			return f(none);
+		}
+		else
+			return f(details::unbox(v));
+	}, this->var);
+}
+
+template<typename F>
+decltype(auto) mctx::visit(F&& f) const
+{
+	const auto* target = this->lazy_target();
+	const auto& node = target != nullptr ? *target : *this;
+
+	return std::visit([&f](const auto& v) -> decltype(auto)
+	{
+		// Never reached for lazy nodes, they are looked through above
+		if constexpr (std::is_same_v<std::remove_cvref_t<decltype(v)>, stored_t<lazy>>)
+		{
+			static constexpr std::monostate none;
+			return f(none);
+		}
+		else
+			return f(details::unbox(v));
+	}, node.var);
+}
+
+template<typename F>
+mctx_object::size_type mctx_object::erase_if(F pred)
+{
+	const auto removed = details::compact_if(this->items, pred);
+	if (removed != 0)
+		this->reindex();
+
+	return removed;
+}
+
+template<typename F>
+size_t mctx::erase_if(F pred)
+{
+	constexpr bool takes_value = std::is_invocable_v<F&, const mctx&>;
+
+	if (auto* o = this->edit_if_value<object>())
+	{
+		return o->erase_if([&pred](const object::value_type& entry) -> bool
+		{
+			if constexpr (std::is_invocable_v<F&, const mctx_key&, const mctx&>)
+				return pred(entry.first, entry.second);
+			else
+				return pred(entry.second);
+		});
+	}
+
+	if constexpr (takes_value)
+	{
+		if (auto* a = this->edit_if_value<array>())
+			return details::compact_if(*a, pred);
+
+		if (auto* p = this->edit_if_value<packed>())
+		{
+			return std::visit([&pred](auto& values)
+			{
+				using element = typename std::remove_cvref_t<decltype(values)>::value_type;
+				return details::compact_if(values, [&pred](element value) -> bool
+				{
+					const mctx m(value);
+					return pred(m);
+				});
+			}, p->values());
+		}
+	}
+	else if (this->is_array())
+		throw std::runtime_error("erase_if: array elements are tested with pred(const mctx&)");
+
+	return 0;
+}
+
+template<typename F>
+size_t mctx::retain(F pred)
+{
+	return this->erase_if([&pred](const auto&... args) -> bool
+		requires std::is_invocable_v<F&, decltype(args)...>
+	{
+		return !pred(args...);
+	});
+}
+
 template<>
 bool mctx::is<mctx::custom>() const;
 
 template<typename T>
 bool mctx::is() const
 {
-	if (std::holds_alternative<custom>(this->var))
-		return std::get<custom>(this->var).is<T>();
-
-	using U = details::possible_integral_alternative<T>;
-	if constexpr (details::is_in_variant_v<U, decltype(this->var)>)
-		return std::holds_alternative<U>(this->var);
+	if (const auto* c = this->get_if_value<custom>())
+		return c->is<T>();
+
+	if constexpr (details::is_integer_v<T>)
+		return std::holds_alternative<int64_t>(this->var) || std::holds_alternative<uint64_t>(this->var);
+	else if constexpr (std::is_same_v<std::remove_cvref_t<T>, array>)
+		return this->is_array();
+	else if constexpr (std::is_same_v<std::remove_cvref_t<T>, string>)
+		return this->get_if_value<string>() != nullptr || this->is_slice();
+	else if constexpr (details::is_in_variant_v<T, value_types>)
+		return this->get_if_value<std::remove_cvref_t<T>>() != nullptr;
 
 	return false;
 }
@@ -600,12 +1858,32 @@ bool mctx::is() const
 template<typename T>
 T mctx::get() const
 {
-	if (std::holds_alternative<custom>(this->var) && std::get<custom>(this->var).is<T>())
-		return std::get<custom>(this->var).get<T>();
+	if (const auto* c = this->get_if_value<custom>(); c != nullptr && c->is<T>())
+		return c->get<T>();
+
+	if constexpr (details::is_integer_v<T>)
+	{
+		if (const auto* ptr = std::get_if<int64_t>(&this->var))
+			return static_cast<T>(*ptr);
+
+		return static_cast<T>(std::get<uint64_t>(this->var));
+	}
+	else if constexpr (details::is_in_variant_v<T, value_types>)
+	{
+		if constexpr (std::is_same_v<T, array>)
+			if (const auto* p = this->get_if_value<packed>())
+				return p->mirror();
+
+		if constexpr (std::is_same_v<T, string>)
+			if (const auto* sl = this->get_if_value<slice>())
+				return string(sl->view());
+
+		const auto* ptr = this->get_if_value<T>();
+		if (ptr == nullptr)
+			throw std::bad_variant_access();
 
-	using U = details::possible_integral_alternative<T>;
-	if constexpr (details::is_in_variant_v<U, decltype(this->var)>)
-		return static_cast<T>(std::get<U>(this->var));
+		return static_cast<T>(*ptr);
+	}
 
 	return T();
 }
@@ -613,15 +1891,32 @@ T mctx::get() const
 template<typename T>
 T mctx::get(T default_value) const
 {
-	if (std::holds_alternative<custom>(this->var) && std::get<custom>(this->var).is<T>())
-		return std::get<custom>(this->var).get<T>();
+	if (const auto* c = this->get_if_value<custom>(); c != nullptr && c->is<T>())
+		return c->get<T>();
+
+	if constexpr (details::is_integer_v<T>)
+	{
+		if (const auto* ptr = std::get_if<int64_t>(&this->var))
+			return static_cast<T>(*ptr);
+
+		if (const auto* ptr = std::get_if<uint64_t>(&this->var))
+			return static_cast<T>(*ptr);
 
-	using U = details::possible_integral_alternative<T>;
-	if constexpr (!details::is_in_variant_v<U, decltype(this->var)>)
+		return default_value;
+	}
+	else if constexpr (!details::is_in_variant_v<T, value_types>)
 		return default_value;
 	else
 	{
-		const auto* ptr = std::get_if<details::possible_integral_alternative<T>>(&this->var);
+		if constexpr (std::is_same_v<T, array>)
+			if (const auto* p = this->get_if_value<packed>())
+				return p->mirror();
+
+		if constexpr (std::is_same_v<T, string>)
+			if (const auto* sl = this->get_if_value<slice>())
+				return string(sl->view());
+
+		const auto* ptr = this->get_if_value<T>();
 		if (ptr == nullptr)
 			return default_value;
 
@@ -632,43 +1927,71 @@ T mctx::get(T default_value) const
 template<typename T>
 const details::as_res<T>::type& mctx::as() const
 {
-	if (std::holds_alternative<custom>(this->var) && std::get<custom>(this->var).is<T>())
-		return std::get<custom>(this->var).as<T>();
+	if (const auto* c = this->get_if_value<custom>(); c != nullptr && c->is<T>())
+		return c->as<T>();
+
+	if constexpr (details::is_integer_v<T>)
+	{
+		if (const auto* ptr = std::get_if<int64_t>(&this->var))
+			return *reinterpret_cast<const T*>(ptr);
+
+		if (const auto* ptr = std::get_if<uint64_t>(&this->var))
+			return *reinterpret_cast<const T*>(ptr);
 
-	using U = details::possible_integral_alternative<T>;
-	if constexpr (!details::is_in_variant_v<U, decltype(this->var)>)
+		throw std::runtime_error("Bad as<T> const call");
+	}
+	else if constexpr (!details::is_in_variant_v<T, value_types>)
 		throw std::runtime_error("Bad as<T> const call ");
 	else
 	{
-		const auto* ptr = std::get_if<typename details::as_res<T>::U>(&this->var);
+		if constexpr (std::is_same_v<T, array>)
+			if (const auto* p = this->get_if_value<packed>())
+				return p->mirror();
+
+		if constexpr (std::is_same_v<T, string>)
+			if (const auto* sl = this->get_if_value<slice>())
+				return sl->str();
+
+		const auto* ptr = this->get_if_value<T>();
 		if (ptr == nullptr)
 			throw std::runtime_error("Bad as<T> const call");
 
-		if constexpr (details::as_res<T>::enable_type_punning)
-			return *reinterpret_cast<const T*>(ptr);
-		else
-			return *ptr;
+		return *ptr;
 	}
 }
 
 template<typename T>
 details::as_res<T>::type& mctx::as()
 {
-	if (std::holds_alternative<custom>(this->var) && std::get<custom>(this->var).is<T>())
-		return std::get<custom>(this->var).as<T>();
+	if (auto* c = this->get_if_value<custom>(); c != nullptr && c->is<T>())
+		return c->as<T>();
+
+	if constexpr (details::is_integer_v<T>)
+	{
+		if (auto* ptr = std::get_if<int64_t>(&this->var))
+			return *reinterpret_cast<T*>(ptr);
+
+		if (auto* ptr = std::get_if<uint64_t>(&this->var))
+			return *reinterpret_cast<T*>(ptr);
 
-	if constexpr (!details::is_in_variant_v<typename details::as_res<T>::U, decltype(this->var)>)
+		throw std::runtime_error("Bad as<T> call");
+	}
+	else if constexpr (!details::is_in_variant_v<T, value_types>)
 		throw std::runtime_error("Bad as<T> call");
 	else
 	{
-		auto* ptr = std::get_if<typename details::as_res<T>::U>(&this->var);
+		// Elements of a packed array can't be referenced, it has to be unpacked first
+		if constexpr (std::is_same_v<T, array>)
+			this->unpack();
+
+		if constexpr (std::is_same_v<T, string>)
+			this->unslice();
+
+		auto* ptr = this->get_if_value<T>();
 		if (ptr == nullptr)
 			throw std::runtime_error("Bad as<T> call");
 
-		if constexpr (details::as_res<T>::enable_type_punning)
-			return *reinterpret_cast<T*>(ptr);
-		else
-			return *ptr;
+		return *ptr;
 	}
 }
 
@@ -677,12 +2000,14 @@ T mctx::get_as(T default_value) const
 {
 	T value{ std::move(default_value) };
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&](float v) { value = static_cast<T>(v); },
 		[&](double v) { value = static_cast<T>(v); },
+		[&](int64_t v) { value = static_cast<T>(v); },
 		[&](uint64_t v) { value = static_cast<T>(v); },
 		[&](bool v) { value = static_cast<T>(v ? 1 : 0); },
 		[&](const custom& c) { value = c.get<T>(default_value); },
+		[&](const slice& v) { value = mctx(string(v.view())).get_as<T>(std::move(value)); },
 		[&](const string& v)
 		{
 			if constexpr (std::is_floating_point_v<T>)
@@ -707,29 +2032,57 @@ T mctx::get_as(T default_value) const
 				value = v;
 		},
 		[](const auto&) { /* Do nothing for empty or unsupported types */ }
-	}, this->var);
+	});
 
 	return value;
 }
 
 template <typename T>
-T mctx::get(const std::string& key, T default_value) const
+T mctx::get(std::string_view key, T default_value) const
+{
+	const auto* object_ptr = this->get_if_value<object>();
+	if (object_ptr == nullptr)
+		return default_value;
+
+	auto iter = object_ptr->find(key);
+	if (iter == object_ptr->end())
+		return default_value;
+
+	return iter->second.template get<T>(std::move(default_value));
+}
+
+template <typename T>
+T mctx::get_as(std::string_view key, T default_value) const
+{
+	const auto* object_ptr = this->get_if_value<object>();
+	if (object_ptr == nullptr)
+		return default_value;
+
+	auto iter = object_ptr->find(key);
+	if (iter == object_ptr->end())
+		return default_value;
+
+	return iter->second.template get_as<T>(std::move(default_value));
+}
+
+template <typename T>
+T mctx::get(const mctx_path& path, T default_value) const
 {
-	auto iter = this->find(key);
-	if (iter == this->end())
+	const auto* node = this->resolve(path);
+	if (node == nullptr)
 		return default_value;
 
-	return this->get<T>(default_value);
+	return node->template get<T>(std::move(default_value));
 }
 
 template <typename T>
-T mctx::get_as(const std::string& key, T default_value) const
+T mctx::get_as(const mctx_path& path, T default_value) const
 {
-	auto iter = this->find(key);
-	if (iter == this->end())
+	const auto* node = this->resolve(path);
+	if (node == nullptr)
 		return default_value;
 
-	return this->get_as<T>(default_value);
+	return node->template get_as<T>(std::move(default_value));
 }
 
 template<>
@@ -751,7 +2104,7 @@ mctx::value_iter& mctx::value_iter::__erase(T& target) requires std::is_same_v<T
 
 template <typename T>
 mctx::value_iter& mctx::value_iter::__erase(T& target, const value_iter& end)
-	requires std::is_same_v<T, std::vector<mctx>> || std::is_same_v<T, std::map<std::string, mctx>>
+	requires std::is_same_v<T, array> || std::is_same_v<T, object>
 {
 	value_iter new_self;
 
@@ -764,5 +2117,13 @@ mctx::value_iter& mctx::value_iter::__erase(T& target, const value_iter& end)
 	return *this = std::move(new_self);
 }
 
-
 }
+
+template<>
+struct std::hash<dixelu::mctx>
+{
+	size_t operator()(const dixelu::mctx& value) const
+	{
+		return value.hash();
+	}
+};
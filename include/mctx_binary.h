@@ -0,0 +1,84 @@
+#pragma once
+
+#include "mctx.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <typeinfo>
+#include <vector>
+
+namespace dixelu::mctx_binary
+{
+
+/* MessagePack encoding of mctx trees, written and read straight from the
+ * nodes. Unlike JSON text it keeps every kind apart:
+ *   float and double        float 32 and float 64
+ *   int64_t                 fixint and int 8 to 64, even when not negative
+ *   uint64_t                uint 8 to 64
+ *   blob                    bin 8 to 32
+ *   registered custom types ext with the code they were registered with
+ * Packed arrays are written like generic ones and read back as generic
+ * arrays. Decoding reads fixints as int64_t, so documents written by other
+ * MessagePack encoders may come back with unsigned numbers where they had
+ * small positive ones.
+ */
+
+// Raw bytes, stored as a custom value of mctx
+struct blob
+{
+	std::vector<std::byte> bytes;
+
+	bool operator==(const blob& other) const = default;
+};
+
+/* Codecs of custom types, each under its own ext code (0 to 127, negative
+ * codes are reserved by MessagePack). Custom values without a codec, and
+ * ext codes nobody registered, throw std::runtime_error.
+ */
+class type_registry
+{
+public:
+	using encoder = void (*)(const details::custom_head& value, std::vector<std::byte>& out);
+	using decoder = mctx (*)(std::span<const std::byte> payload);
+
+	struct codec
+	{
+		const std::type_info* type;
+		int8_t code;
+		encoder encode;
+		decoder decode;
+	};
+
+	// Encode appends the payload of the value, decode reads it back from the whole payload
+	template<typename T, void (*Encode)(const T&, std::vector<std::byte>&), T (*Decode)(std::span<const std::byte>)>
+	type_registry& add(int8_t code);
+
+	[[nodiscard]] const codec* find(const std::type_info& type) const noexcept;
+	[[nodiscard]] const codec* find(int8_t code) const noexcept;
+
+private:
+	std::vector<codec> codecs;
+
+	type_registry& add(codec entry);
+};
+
+template<typename T, void (*Encode)(const T&, std::vector<std::byte>&), T (*Decode)(std::span<const std::byte>)>
+type_registry& type_registry::add(int8_t code)
+{
+	return this->add(codec{
+		&typeid(T),
+		code,
+		[](const details::custom_head& value, std::vector<std::byte>& out) { Encode(value.as<T>(), out); },
+		[](std::span<const std::byte> payload) { return mctx(Decode(payload)); }
+	});
+}
+
+// Appends to out
+void encode(const mctx& value, std::vector<std::byte>& out, const type_registry& types = {});
+[[nodiscard]] std::vector<std::byte> encode(const mctx& value, const type_registry& types = {});
+
+// The data must hold exactly one value, throws std::runtime_error on malformed input
+[[nodiscard]] mctx decode(std::span<const std::byte> data, const type_registry& types = {});
+
+} // namespace dixelu::mctx_binary
@@ -3,7 +3,13 @@
 #include "mctx.h"
 
 #include <nlohmann/json.hpp>
+#include <memory>
+#include <ostream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace dixelu::mctx_json
 {
@@ -13,9 +19,168 @@ using json = nlohmann::json;
 json serialize_mctx(const mctx& value);
 mctx deserialize_mctx(const json& j);
 
+/* Native writer, walks the tree and writes the text straight to the output
+ * without building a json DOM first. Indent below zero writes compact text,
+ * otherwise every element goes on its own line (same layout as json::dump).
+ * Object keys are written in insertion order, json::dump sorts them.
+ */
+struct write_options
+{
+	int indent = -1;
+	char indent_char = ' ';
+	bool ensure_ascii = false;
+};
+
+// Appends to the string
+void write(const mctx& value, std::string& out, const write_options& options = {});
+
+// Streams through a fixed size buffer, memory use doesn't depend on the document size
+void write(const mctx& value, std::ostream& out, const write_options& options = {});
+void write(const mctx& value, int fd, const write_options& options = {});
+
+namespace details
+{
+
+// Output of one container in the text kept by serialize_cache
+struct cached_span
+{
+	uint64_t key;	// of the contents, see serialize_cache
+	size_t offset;
+	size_t size;
+	size_t depth;
+
+	// Checked along with the key, so a key collision needs these to match too
+	mctx::value_kind kind;
+	size_t elements;
+};
+
+// Empty slot of the serialize_cache index
+inline constexpr size_t no_span = static_cast<size_t>(-1);
+
+}
+
+/* Incremental writer: keeps the text it wrote last time and copies the
+ * output of containers that didn't change since from it instead of writing
+ * them again. Pays off for big documents that change a little between
+ * writes. Containers with less than min_span_size bytes of output are
+ * always written anew.
+ * Containers that were never given out for mutable access are matched by
+ * their node. The cache keeps a copy of them, so the first change after a
+ * write clones the container instead of changing it in place. A write goes
+ * through the containers on the paths to the changes and costs about their
+ * size, not the size of the document.
+ * Leaked containers (see details::boxed), such as the ones built with
+ * operator[], can change in place. They're matched by a 64-bit key of
+ * their contents along with their kind and number of elements, which every
+ * write computes by walking all of them: cheaper than formatting them, but
+ * still linear in their size. A copy of the tree has no leaked nodes, and
+ * neither has the result of mctx_snapshot::update.
+ */
+class serialize_cache
+{
+public:
+	explicit serialize_cache(write_options options = {}, size_t min_span_size = 32);
+
+	// Text of the value, valid until the next call
+	const std::string& write(const mctx& value);
+
+	[[nodiscard]] const write_options& options() const noexcept;
+	void clear() noexcept;
+
+private:
+	write_options settings;
+	size_t min_span_size;
+
+	std::string text;
+	std::vector<details::cached_span> spans;	// by offset
+	std::vector<size_t> index;					// positions in spans by key
+	std::vector<mctx> kept;						// the nodes keyed by address
+};
+
 std::string serialize(const mctx& value);
 std::string serialize_pretty(const mctx& value);
 
+/* Native parser, builds the tree straight from the text without a json DOM.
+ * Throws std::runtime_error on malformed input.
+ */
+mctx parse(std::string_view text);
+
+/* Same, but the text is kept alive with the tree: strings without escapes
+ * become slices of it (mctx_string_slice) instead of copies.
+ */
+mctx parse_shared(std::shared_ptr<const std::string> text);
+mctx parse_shared(std::string text);
+
+/* Same as parse_shared, but only the root is built: arrays and objects below
+ * it become lazy nodes (mctx_lazy) that are parsed when first accessed, one
+ * level at a time. Reading a few fields of a big document only parses the
+ * containers on the way to them. The text is checked for matching brackets
+ * and terminated strings up front; any other error throws on first access.
+ */
+mctx parse_lazy(std::shared_ptr<const std::string> text);
+mctx parse_lazy(std::string text);
+
+namespace details
+{
+
+// Step of a projection: positions of the child nodes by key and by array index
+struct projection_node
+{
+	bool keep_all = false;
+	std::vector<std::pair<mctx_key, size_t>> keys;
+	std::vector<std::pair<size_t, size_t>> indices;
+};
+
+}
+
+/* Paths of the values to keep when parsing, merged into a tree. The value
+ * at the end of a path is kept whole; on the way, key segments also apply
+ * to every element of an array, index segments pick single elements. An
+ * element picked by index only keeps what the paths through its index
+ * name. An empty path keeps the whole document.
+ */
+class projection
+{
+public:
+	projection();
+	projection(std::initializer_list<mctx_path> paths);
+
+	projection& add(const mctx_path& path);
+
+	[[nodiscard]] const std::vector<details::projection_node>& nodes() const noexcept;
+
+private:
+	std::vector<details::projection_node> tree;	// root first
+};
+
+/* Builds only the parts of the document the projection keeps. Everything
+ * else is skipped by a scanner that only looks at brackets and string
+ * boundaries and allocates nothing, so malformed text in skipped parts
+ * goes unnoticed. Objects keep the matching members in document order,
+ * arrays the matching elements; scalars found where the projection expects
+ * a container are dropped.
+ */
+mctx parse(std::string_view text, const projection& keep);
+
 mctx deserialize(const std::string& json_str);
+mctx deserialize(const std::string& json_str, const projection& keep);
+
+namespace details
+{
+
+/* String scanning shared by the reader and the writer, vectorized with AVX2
+ * or SSE2 when the CPU has them (picked once at runtime).
+ */
+
+// Offset of the first '"', '\\' or control character (size of the text if there is none),
+// non_ascii is set if a byte above 0x7F comes before it
+size_t scan_string(std::string_view text, bool& non_ascii) noexcept;
+
+bool validate_utf8(std::string_view text) noexcept;
+
+// Appends the UTF-8 encoding of a code point, surrogates are expected to be combined already
+void append_utf8(std::string& out, uint32_t code_point);
+
+}
 
 } // namespace dixelu::mctx_json
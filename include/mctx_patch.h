@@ -0,0 +1,28 @@
+#pragma once
+
+#include "mctx.h"
+
+namespace dixelu
+{
+
+/* JSON Patch (RFC 6902) between mctx trees. A patch is an mctx array of
+ * operation objects, e.g. {"op": "replace", "path": "/items/0", "value": 1},
+ * so it is serialized and shipped like any other document.
+ */
+
+/* Edit script turning from into to, made of add, remove and replace
+ * operations. Subtrees shared by both trees (copy-on-write copies) are
+ * skipped without descending into them; arrays are matched by their common
+ * head and tail, so a single insertion or removal gives a single operation.
+ */
+[[nodiscard]] mctx mctx_diff(const mctx& from, const mctx& to);
+
+/* Applies every operation (add, remove, replace, move, copy, test) or none
+ * of them: the operations run on a copy-on-write copy of the target, which
+ * only clones the nodes on the patched paths, and replace the target at the
+ * end. Values are moved out of the patch. Throws std::runtime_error for a
+ * malformed patch or a failing operation.
+ */
+void apply_patch(mctx& target, mctx patch);
+
+} // namespace dixelu
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "mctx.h"
+
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace dixelu
+{
+
+namespace details
+{
+struct query_program;
+}
+
+/* JSONPath-style selector compiled once into a list of steps, then run over
+ * any number of documents. Supported syntax:
+ *   $                      root
+ *   .name  ['name']        child by key, ['a','b'] selects several
+ *   [n]                    element, negative n counts from the end
+ *   [start:end:step]       array slice, any part may be left out
+ *   .*  [*]                all children
+ *   ..                     recursive descent, followed by any of the above
+ *   [?(expression)]        children for which the expression holds
+ * Filter expressions combine comparisons (== != < <= > >=) of singular
+ * paths (@.a.b, @['a'][0], $.x) and literals (numbers, 'text', true, false,
+ * null) with &&, || and !. A path alone tests for existence.
+ *
+ * Matches are references into the queried tree: they stay valid while the
+ * tree is alive and unmodified. Elements of packed arrays are served from
+ * their mirror. Malformed expressions throw std::runtime_error.
+ */
+class mctx_query
+{
+public:
+	explicit mctx_query(std::string_view expression);
+
+	[[nodiscard]] std::string_view expression() const noexcept;
+
+	[[nodiscard]] std::vector<const mctx*> select(const mctx& root) const;
+	[[nodiscard]] const mctx* first(const mctx& root) const;
+	[[nodiscard]] size_t count(const mctx& root) const;
+
+	// Calls f(const mctx&) for every match in document order, stops early once f returns false
+	template<typename F>
+	void for_each(const mctx& root, F&& f) const;
+
+private:
+	using sink = bool(*)(void* context, const mctx& match);
+
+	std::shared_ptr<const details::query_program> program;
+
+	void run(const mctx& root, sink callback, void* context) const;
+};
+
+template<typename F>
+void mctx_query::for_each(const mctx& root, F&& f) const
+{
+	using callable = std::remove_reference_t<F>;
+
+	this->run(root, [](void* context, const mctx& match) -> bool
+	{
+		auto& callback = *static_cast<callable*>(context);
+
+		if constexpr (std::is_void_v<std::invoke_result_t<callable&, const mctx&>>)
+		{
+			callback(match);
+			return true;
+		}
+		else
+			return static_cast<bool>(callback(match));
+	}, const_cast<void*>(static_cast<const void*>(std::addressof(f))));
+}
+
+} // namespace dixelu
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "mctx.h"
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+
+namespace dixelu
+{
+
+/* Immutable mctx tree. Updates return a new snapshot that shares every
+ * unchanged subtree with the old one (path copying on top of copy-on-write
+ * nodes), so a snapshot can be read from any number of threads without
+ * locking. Only const access is given out.
+ */
+class mctx_snapshot
+{
+	std::shared_ptr<const mctx> root;
+
+	explicit mctx_snapshot(std::shared_ptr<const mctx> root) noexcept;
+
+	friend class mctx_store;
+
+public:
+	mctx_snapshot();
+	explicit mctx_snapshot(mctx value);
+
+	[[nodiscard]] const mctx& get() const noexcept;
+
+	const mctx& operator*() const noexcept;
+	const mctx* operator->() const noexcept;
+
+	// Value at the path, or nullptr if some key on the way is missing
+	[[nodiscard]] const mctx* find(std::initializer_list<std::string_view> path) const;
+
+	// Objects missing on the way are created
+	[[nodiscard]] mctx_snapshot set(std::initializer_list<std::string_view> path, mctx value) const;
+	[[nodiscard]] mctx_snapshot erase(std::initializer_list<std::string_view> path) const;
+
+	/* Applies f(mctx&) to a copy of the tree, only the nodes it mutates are
+	 * cloned. References taken inside of f are only good until it returns:
+	 * the new snapshot shares its nodes with later updates.
+	 */
+	template<typename F>
+	[[nodiscard]] mctx_snapshot update(F&& f) const;
+
+	bool operator==(const mctx_snapshot& other) const;
+};
+
+/* Publication point for the current snapshot, writers replace it with
+ * compare-and-swap. load() goes through std::atomic<std::shared_ptr>, which
+ * is not lock-free in libstdc++ (a spin lock bit in the control word), so
+ * concurrent loads contend on one cache line and may briefly wait on each
+ * other. Threads reading often keep a reader instead, which only reads the
+ * generation counter while nothing new was published.
+ */
+class mctx_store
+{
+	std::atomic<std::shared_ptr<const mctx>> current;
+	std::atomic<uint64_t> generation = 0;	// bumped after every publication
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+public:
+	/* Per-thread cache of the current snapshot. load() is a plain atomic
+	 * read of the store's generation counter while it didn't change, and
+	 * only goes through mctx_store::load() after a publication. A new
+	 * snapshot is seen once the store() or update() publishing it returned.
+	 * A reader itself is not thread-safe, each thread keeps its own.
+	 */
+	class reader
+	{
+		const mctx_store* store;
+		uint64_t generation;
+		mctx_snapshot cached;
+
+	public:
+		explicit reader(const mctx_store& store);
+
+		// Valid until the next call
+		const mctx_snapshot& load();
+	};
+
+	explicit mctx_store(mctx value = mctx());
+	explicit mctx_store(mctx_snapshot snapshot);
+
+	mctx_store(const mctx_store&) = delete;
+	mctx_store& operator=(const mctx_store&) = delete;
+
+	[[nodiscard]] mctx_snapshot load() const;
+	void store(mctx_snapshot snapshot);
+
+	// Publishes f applied to the current snapshot, retries if another writer got first
+	template<typename F>
+	mctx_snapshot update(F&& f);
+};
+
+template<typename F>
+mctx_snapshot mctx_snapshot::update(F&& f) const
+{
+	mctx copy = *this->root;
+	f(copy);
+	copy.seal();
+
+	return mctx_snapshot(std::move(copy));
+}
+
+template<typename F>
+mctx_snapshot mctx_store::update(F&& f)
+{
+	auto expected = this->current.load(std::memory_order_acquire);
+
+	while (true)
+	{
+		auto next = mctx_snapshot(expected).update(f);
+
+		if (this->current.compare_exchange_weak(expected, next.root, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			this->generation.fetch_add(1, std::memory_order_release);
+			return next;
+		}
+	}
+}
+
+} // namespace dixelu
@@ -1,6 +1,10 @@
 #include "mctx.h"
 
+#include <bit>
+#include <cstring>
 #include <format>
+#include <mutex>
+#include <unordered_map>
 
 namespace dixelu
 {
@@ -8,15 +12,24 @@ namespace dixelu
 namespace details
 {
 
-template<>
-size_t mfunc<std::nullptr_t>(void*, void*, adj_mf_ops)
+static thread_local std::pmr::memory_resource* current_resource = nullptr;
+
+std::pmr::memory_resource* current_memory_resource() noexcept
+{
+	if (current_resource == nullptr)
+		return std::pmr::new_delete_resource();
+
+	return current_resource;
+}
+
+void set_current_memory_resource(std::pmr::memory_resource* resource) noexcept
 {
-	return typeid(std::nullptr_t).hash_code();
+	current_resource = resource;
 }
 
 custom_head::custom_head():
-	data(nullptr),
-	mf(mfunc<std::nullptr_t>)
+	storage{ { nullptr, nullptr } },
+	ops(&custom_ops_for<std::nullptr_t>)
 {}
 
 custom_head::~custom_head()
@@ -25,31 +38,25 @@ custom_head::~custom_head()
 }
 
 custom_head::custom_head(const custom_head& lhs):
-	data(nullptr),
-	mf(lhs.mf)
+	storage{ { nullptr, nullptr } },
+	ops(&custom_ops_for<std::nullptr_t>)
 {
-	lhs.mf(reinterpret_cast<void*>(&this->data), nullptr, ALLOCATE);
-	lhs.mf(lhs.data, this->data, EMPLACE_COPY);
+	lhs.ops->copy(lhs.storage, this->storage);
+	this->ops = lhs.ops;
 }
 
 custom_head::custom_head(custom_head&& lhs) noexcept:
-	data(lhs.data),
-	mf(lhs.mf)
+	storage{ { nullptr, nullptr } },
+	ops(lhs.ops)
 {
-	lhs.data = nullptr;
-	lhs.mf = mfunc<std::nullptr_t>;
+	lhs.ops->move(lhs.storage, this->storage);
+	lhs.ops = &custom_ops_for<std::nullptr_t>;
 }
 
-void custom_head::reset(mf_sig new_mf_sig)
+void custom_head::reset()
 {
-	if (this->data != nullptr)
-	{
-		this->mf(this->data, nullptr, DESTROY);
-		this->mf(this->data, nullptr, DEALLOCATE);
-		this->data = nullptr;
-	}
-
-	this->mf = new_mf_sig;
+	this->ops->destroy(this->storage);
+	this->ops = &custom_ops_for<std::nullptr_t>;
 }
 
 custom_head& custom_head::operator=(const custom_head& lhs)
@@ -57,43 +64,46 @@ custom_head& custom_head::operator=(const custom_head& lhs)
 	if (&lhs == this)
 		return *this;
 
-	this->reset(lhs.mf);
-
-	lhs.mf(reinterpret_cast<void*>(&this->data), nullptr, ALLOCATE);
-	lhs.mf(lhs.data, this->data, EMPLACE_COPY);
-
-	return *this;
+	custom_head copy(lhs);
+	return *this = std::move(copy);
 }
 
 void custom_head::swap(custom_head& lhs) noexcept
 {
-	std::swap(lhs.data, this->data);
-	std::swap(lhs.mf, this->mf);
+	if (&lhs == this)
+		return;
+
+	custom_head tmp(std::move(lhs));
+	lhs = std::move(*this);
+	*this = std::move(tmp);
 }
 
 custom_head& custom_head::operator=(custom_head&& lhs) noexcept
 {
-	this->reset(lhs.mf);
-	this->swap(lhs);
+	if (&lhs == this)
+		return *this;
+
+	this->reset();
+
+	lhs.ops->move(lhs.storage, this->storage);
+	this->ops = lhs.ops;
+	lhs.ops = &custom_ops_for<std::nullptr_t>;
 
 	return *this;
 }
 
 bool custom_head::empty() const
 {
-	return data == nullptr;
+	return this->ops == &custom_ops_for<std::nullptr_t>;
 }
 
 
 bool custom_head::operator==(const custom_head& lhs) const
 {
-	auto this_hash = this->mf(nullptr, nullptr, NONE);
-	auto lhs_hash = lhs.mf(nullptr, nullptr, NONE);
-
-	if (this_hash != lhs_hash)
+	if (this->ops != lhs.ops)
 		return false;
 
-	return this->mf(this->data, lhs.data, COMPARE) != 0;
+	return this->ops->compare(this->storage, lhs.storage);
 }
 
 bool custom_head::operator!=(const custom_head& lhs) const
@@ -103,41 +113,1041 @@ bool custom_head::operator!=(const custom_head& lhs) const
 
 }
 
+mctx_resource_scope::mctx_resource_scope(std::pmr::memory_resource* resource) noexcept :
+	previous(details::current_memory_resource())
+{
+	details::set_current_memory_resource(resource);
+}
+
+mctx_resource_scope::~mctx_resource_scope()
+{
+	details::set_current_memory_resource(this->previous);
+}
+
+mctx_arena::mctx_arena(size_t initial_size) :
+	resource(initial_size),
+	scope(&this->resource)
+{}
+
+mctx_arena::mctx_arena(std::pmr::memory_resource* upstream, size_t initial_size) :
+	resource(initial_size, upstream),
+	scope(&this->resource)
+{}
+
+std::pmr::memory_resource* mctx_arena::get_resource() noexcept
+{
+	return &this->resource;
+}
+
+namespace details
+{
+
+namespace
+{
+
+struct key_table_shard
+{
+	struct entry_hash
+	{
+		size_t operator()(const std::pair<uint64_t, std::string_view>& key) const noexcept { return static_cast<size_t>(key.first); }
+	};
+
+	std::mutex lock;
+	std::unordered_map<std::pair<uint64_t, std::string_view>, key_atom*, entry_hash> atoms;
+};
+
+constexpr size_t key_table_shard_count = 64;
+
+key_table_shard& key_table_shard_for(uint64_t hash)
+{
+	// Never destroyed: keys of static mctx trees may be released after the end of main
+	static auto* shards = new key_table_shard[key_table_shard_count];
+	return shards[(hash >> 58) % key_table_shard_count];
+}
+
+}
+
+const key_atom* intern_key(std::string_view text, uint64_t hash)
+{
+	auto& shard = key_table_shard_for(hash);
+	std::lock_guard lock(shard.lock);
+
+	if (auto iter = shard.atoms.find({ hash, text }); iter != shard.atoms.end())
+	{
+		iter->second->references.fetch_add(1, std::memory_order_relaxed);
+		return iter->second;
+	}
+
+	auto memory = ::operator new(sizeof(key_atom) + text.size() + 1);
+	auto atom = new (memory) key_atom{ 1, hash, static_cast<uint32_t>(text.size()) };
+
+	auto chars = reinterpret_cast<char*>(atom + 1);
+	std::memcpy(chars, text.data(), text.size());
+	chars[text.size()] = '\0';
+
+	try
+	{
+		shard.atoms.emplace(std::pair{ hash, std::string_view(chars, text.size()) }, atom);
+	}
+	catch (...)
+	{
+		atom->~key_atom();
+		::operator delete(memory);
+		throw;
+	}
+
+	return atom;
+}
+
+void release_key(const key_atom* atom) noexcept
+{
+	auto references = atom->references.load(std::memory_order_relaxed);
+	while (references > 1)
+		if (atom->references.compare_exchange_weak(references, references - 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+			return;
+
+	// Possibly the last reference: the drop to zero happens under the lock, so interning can't revive a dying atom
+	auto& shard = key_table_shard_for(atom->hash);
+	std::lock_guard lock(shard.lock);
+
+	if (atom->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	shard.atoms.erase({ atom->hash, std::string_view(atom->data(), atom->size) });
+	atom->~key_atom();
+	::operator delete(const_cast<key_atom*>(atom));
+}
+
+}
+
+mctx_key::mctx_key() noexcept :
+	atom(nullptr) {}
+
+mctx_key::mctx_key(std::string_view text) :
+	atom(text.empty() ? nullptr : details::intern_key(text, details::key_hash(text))) {}
+
+mctx_key::~mctx_key()
+{
+	if (this->atom != nullptr)
+		details::release_key(this->atom);
+}
+
+mctx_key::mctx_key(const mctx_key& other) noexcept :
+	atom(other.atom)
+{
+	if (this->atom != nullptr)
+		this->atom->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+mctx_key::mctx_key(mctx_key&& other) noexcept :
+	atom(std::exchange(other.atom, nullptr)) {}
+
+mctx_key& mctx_key::operator=(const mctx_key& other) noexcept
+{
+	mctx_key copy(other);
+	return *this = std::move(copy);
+}
+
+mctx_key& mctx_key::operator=(mctx_key&& other) noexcept
+{
+	if (this != &other)
+	{
+		if (this->atom != nullptr)
+			details::release_key(this->atom);
+
+		this->atom = std::exchange(other.atom, nullptr);
+	}
+
+	return *this;
+}
+
+std::string_view mctx_key::view() const noexcept
+{
+	return this->atom == nullptr ? std::string_view() : std::string_view(this->atom->data(), this->atom->size);
+}
+
+std::string mctx_key::str() const { return std::string(this->view()); }
+
+const char* mctx_key::data() const noexcept { return this->atom == nullptr ? "" : this->atom->data(); }
+size_t mctx_key::size() const noexcept { return this->atom == nullptr ? 0 : this->atom->size; }
+bool mctx_key::empty() const noexcept { return this->atom == nullptr; }
+
+uint64_t mctx_key::hash() const noexcept
+{
+	return this->atom == nullptr ? details::key_hash({}) : this->atom->hash;
+}
+
+size_t mctx_key::find(std::string_view text, size_t position) const noexcept
+{
+	return this->view().find(text, position);
+}
+
+mctx_key::operator std::string_view() const noexcept { return this->view(); }
+
+mctx_path::segment::segment(mctx_key key) noexcept : step(std::move(key)) {}
+mctx_path::segment::segment(std::string_view key) : step(mctx_key(key)) {}
+mctx_path::segment::segment(const char* key) : step(mctx_key(key)) {}
+mctx_path::segment::segment(const std::string& key) : step(mctx_key(key)) {}
+mctx_path::segment::segment(size_t index) noexcept : step(index) {}
+
+mctx_path::segment::segment(int index) :
+	step(static_cast<size_t>(index))
+{
+	if (index < 0)
+		throw std::out_of_range("mctx_path: negative index");
+}
+
+const mctx_key* mctx_path::segment::key() const noexcept { return std::get_if<mctx_key>(&this->step); }
+const size_t* mctx_path::segment::index() const noexcept { return std::get_if<size_t>(&this->step); }
+
+mctx_path::mctx_path(std::initializer_list<segment> segments) : steps(segments) {}
+mctx_path::mctx_path(std::vector<segment> segments) noexcept : steps(std::move(segments)) {}
+
+const std::vector<mctx_path::segment>& mctx_path::segments() const noexcept { return this->steps; }
+size_t mctx_path::size() const noexcept { return this->steps.size(); }
+bool mctx_path::empty() const noexcept { return this->steps.empty(); }
+
+mctx_path& mctx_path::append(segment next)
+{
+	this->steps.push_back(std::move(next));
+	return *this;
+}
+
+namespace
+{
+
+constexpr size_t npos = static_cast<size_t>(-1);
+
+size_t index_slot(uint64_t hash, uint32_t capacity)
+{
+	return static_cast<size_t>(hash ^ (hash >> 32)) & (capacity - 1);
+}
+
+}
+
+mctx_object::mctx_object() :
+	index(nullptr),
+	index_capacity(0)
+{}
+
+mctx_object::~mctx_object()
+{
+	this->release_index();
+}
+
+mctx_object::mctx_object(const mctx_object& other) :
+	items(other.items),
+	index(nullptr),
+	index_capacity(0)
+{
+	if (other.index == nullptr)
+		return;
+
+	details::mctx_allocator<uint32_t> index_allocator(this->items.get_allocator());
+	this->index = index_allocator.allocate(other.index_capacity);
+	this->index_capacity = other.index_capacity;
+	std::memcpy(this->index, other.index, sizeof(uint32_t) * other.index_capacity);
+}
+
+mctx_object::mctx_object(mctx_object&& other) noexcept :
+	items(std::move(other.items)),
+	index(other.index),
+	index_capacity(other.index_capacity)
+{
+	other.index = nullptr;
+	other.index_capacity = 0;
+}
+
+mctx_object& mctx_object::operator=(const mctx_object& other)
+{
+	if (&other == this)
+		return *this;
+
+	mctx_object copy(other);
+	return *this = std::move(copy);
+}
+
+mctx_object& mctx_object::operator=(mctx_object&& other) noexcept(nothrow_move_assignment)
+{
+	if (&other == this)
+		return *this;
+
+	this->release_index();
+
+	const bool same_resource = this->items.get_allocator() == other.items.get_allocator();
+	this->items = std::move(other.items);
+
+	if (same_resource)
+	{
+		this->index = other.index;
+		this->index_capacity = other.index_capacity;
+		other.index = nullptr;
+		other.index_capacity = 0;
+	}
+	else
+	{
+		other.clear();
+		if (this->items.size() > linear_threshold)
+			this->rebuild_index();
+	}
+
+	return *this;
+}
+
+mctx_object::iterator mctx_object::find(std::string_view key)
+{
+	auto position = this->lookup(key);
+	return position == npos ? this->items.end() : this->items.begin() + position;
+}
+
+mctx_object::const_iterator mctx_object::find(std::string_view key) const
+{
+	auto position = this->lookup(key);
+	return position == npos ? this->items.end() : this->items.begin() + position;
+}
+
+bool mctx_object::contains(std::string_view key) const
+{
+	return this->lookup(key) != npos;
+}
+
+mctx_object::iterator mctx_object::find(const mctx_key& key)
+{
+	auto position = this->lookup(key);
+	return position == npos ? this->items.end() : this->items.begin() + position;
+}
+
+mctx_object::const_iterator mctx_object::find(const mctx_key& key) const
+{
+	auto position = this->lookup(key);
+	return position == npos ? this->items.end() : this->items.begin() + position;
+}
+
+bool mctx_object::contains(const mctx_key& key) const
+{
+	return this->lookup(key) != npos;
+}
+
+mctx& mctx_object::operator[](std::string_view key)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+		return this->items[position].second;
+
+	return this->append(mctx_key(key), mctx{})->second;
+}
+
+mctx& mctx_object::operator[](std::string&& key)
+{
+	return (*this)[std::string_view(key)];
+}
+
+mctx& mctx_object::operator[](const char* key)
+{
+	return (*this)[std::string_view(key)];
+}
+
+mctx& mctx_object::operator[](const mctx_key& key)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+		return this->items[position].second;
+
+	return this->append(key, mctx{})->second;
+}
+
+mctx& mctx_object::at(std::string_view key)
+{
+	auto position = this->lookup(key);
+	if (position == npos)
+		throw std::out_of_range("mctx_object::at: no such key");
+
+	return this->items[position].second;
+}
+
+const mctx& mctx_object::at(std::string_view key) const
+{
+	auto position = this->lookup(key);
+	if (position == npos)
+		throw std::out_of_range("mctx_object::at: no such key");
+
+	return this->items[position].second;
+}
+
+std::pair<mctx_object::iterator, bool> mctx_object::try_emplace(std::string_view key, mctx value)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+		return { this->items.begin() + position, false };
+
+	return { this->append(mctx_key(key), std::move(value)), true };
+}
+
+std::pair<mctx_object::iterator, bool> mctx_object::try_emplace(mctx_key key, mctx value)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+		return { this->items.begin() + position, false };
+
+	return { this->append(std::move(key), std::move(value)), true };
+}
+
+std::pair<mctx_object::iterator, bool> mctx_object::insert_or_assign(std::string_view key, mctx value)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+	{
+		this->items[position].second = std::move(value);
+		return { this->items.begin() + position, false };
+	}
+
+	return { this->append(mctx_key(key), std::move(value)), true };
+}
+
+std::pair<mctx_object::iterator, bool> mctx_object::insert_or_assign(mctx_key key, mctx value)
+{
+	auto position = this->lookup(key);
+	if (position != npos)
+	{
+		this->items[position].second = std::move(value);
+		return { this->items.begin() + position, false };
+	}
+
+	return { this->append(std::move(key), std::move(value)), true };
+}
+
+mctx_object::iterator mctx_object::erase(const_iterator pos)
+{
+	auto position = pos - this->items.cbegin();
+	if (this->index != nullptr)
+		this->index_remove(static_cast<size_type>(position));
+
+	this->items.erase(pos);
+	if (this->items.size() <= linear_threshold)
+		this->release_index();
+
+	return this->items.begin() + position;
+}
+
+mctx_object::iterator mctx_object::erase(const_iterator first, const_iterator last)
+{
+	auto position = first - this->items.cbegin();
+	this->items.erase(first, last);
+	this->reindex();
+
+	return this->items.begin() + position;
+}
+
+mctx_object::size_type mctx_object::erase(std::string_view key)
+{
+	auto position = this->lookup(key);
+	if (position == npos)
+		return 0;
+
+	this->erase(this->items.cbegin() + position);
+	return 1;
+}
+
+mctx_object::iterator mctx_object::begin() noexcept { return this->items.begin(); }
+mctx_object::iterator mctx_object::end() noexcept { return this->items.end(); }
+mctx_object::const_iterator mctx_object::begin() const noexcept { return this->items.begin(); }
+mctx_object::const_iterator mctx_object::end() const noexcept { return this->items.end(); }
+mctx_object::const_iterator mctx_object::cbegin() const noexcept { return this->items.cbegin(); }
+mctx_object::const_iterator mctx_object::cend() const noexcept { return this->items.cend(); }
+
+mctx_object::reverse_iterator mctx_object::rbegin() noexcept { return this->items.rbegin(); }
+mctx_object::reverse_iterator mctx_object::rend() noexcept { return this->items.rend(); }
+mctx_object::const_reverse_iterator mctx_object::rbegin() const noexcept { return this->items.rbegin(); }
+mctx_object::const_reverse_iterator mctx_object::rend() const noexcept { return this->items.rend(); }
+
+mctx_object::size_type mctx_object::size() const noexcept { return this->items.size(); }
+bool mctx_object::empty() const noexcept { return this->items.empty(); }
+
+void mctx_object::clear() noexcept
+{
+	this->items.clear();
+	this->release_index();
+}
+
+void mctx_object::reserve(size_type capacity) { this->items.reserve(capacity); }
+
+mctx_object::allocator_type mctx_object::get_allocator() const noexcept { return this->items.get_allocator(); }
+
+bool mctx_object::operator==(const mctx_object& other) const
+{
+	if (this->items.size() != other.items.size())
+		return false;
+
+	for (const auto& [key, value] : this->items)
+	{
+		auto position = other.lookup(key);
+		if (position == npos || !(other.items[position].second == value))
+			return false;
+	}
+
+	return true;
+}
+
+mctx_object::size_type mctx_object::lookup(std::string_view key) const noexcept
+{
+	if (this->index == nullptr)
+	{
+		for (size_type i = 0; i < this->items.size(); ++i)
+			if (this->items[i].first == key)
+				return i;
+
+		return npos;
+	}
+
+	const auto mask = this->index_capacity - 1;
+	const auto hash = details::key_hash(key);
+
+	for (auto slot = index_slot(hash, this->index_capacity);; slot = (slot + 1) & mask)
+	{
+		auto entry = this->index[slot];
+		if (entry == 0)
+			return npos;
+
+		const auto& candidate = this->items[entry - 1].first;
+		if (candidate.hash() == hash && candidate == key)
+			return entry - 1;
+	}
+}
+
+mctx_object::size_type mctx_object::lookup(const mctx_key& key) const noexcept
+{
+	if (this->index == nullptr)
+	{
+		for (size_type i = 0; i < this->items.size(); ++i)
+			if (this->items[i].first == key)
+				return i;
+
+		return npos;
+	}
+
+	const auto mask = this->index_capacity - 1;
+
+	for (auto slot = index_slot(key.hash(), this->index_capacity);; slot = (slot + 1) & mask)
+	{
+		auto entry = this->index[slot];
+		if (entry == 0)
+			return npos;
+
+		if (this->items[entry - 1].first == key)
+			return entry - 1;
+	}
+}
+
+mctx_object::iterator mctx_object::append(mctx_key key, mctx value)
+{
+	this->items.emplace_back(std::move(key), std::move(value));
+	auto position = this->items.size() - 1;
+
+	try
+	{
+		if (this->index != nullptr && this->items.size() * 2 <= this->index_capacity)
+			this->index_insert(position, this->items.back().first.hash());
+		else if (this->items.size() > linear_threshold)
+			this->rebuild_index();
+	}
+	catch (...)
+	{
+		this->items.pop_back();
+		throw;
+	}
+
+	return this->items.begin() + position;
+}
+
+void mctx_object::index_insert(size_type position, uint64_t hash) noexcept
+{
+	const auto mask = this->index_capacity - 1;
+
+	auto slot = index_slot(hash, this->index_capacity);
+	while (this->index[slot] != 0)
+		slot = (slot + 1) & mask;
+
+	this->index[slot] = static_cast<uint32_t>(position + 1);
+}
+
+// Backward shift deletion: entries probed past the freed slot move into it, so lookups need no tombstones
+void mctx_object::index_remove(size_type position) noexcept
+{
+	const auto mask = this->index_capacity - 1;
+	const auto entry = static_cast<uint32_t>(position + 1);
+
+	auto hole = index_slot(this->items[position].first.hash(), this->index_capacity);
+	while (this->index[hole] != entry)
+		hole = (hole + 1) & mask;
+
+	for (auto slot = (hole + 1) & mask; this->index[slot] != 0; slot = (slot + 1) & mask)
+	{
+		// Entries whose home slot lies cyclically after the hole stay where they are
+		const auto home = index_slot(this->items[this->index[slot] - 1].first.hash(), this->index_capacity);
+		if (((slot - home) & mask) >= ((slot - hole) & mask))
+		{
+			this->index[hole] = this->index[slot];
+			hole = slot;
+		}
+	}
+
+	this->index[hole] = 0;
+
+	if (position + 1 == this->items.size())
+		return;
+
+	auto* slots = this->index;
+	for (uint32_t i = 0; i < this->index_capacity; ++i)
+		slots[i] -= slots[i] > entry;
+}
+
+void mctx_object::rebuild_index()
+{
+	const auto required = static_cast<uint32_t>(std::bit_ceil(this->items.size() * 2));
+
+	// Keep the table if it is not too sparse for the current size
+	if (this->index == nullptr || this->index_capacity < required || this->index_capacity > required * 4)
+	{
+		details::mctx_allocator<uint32_t> index_allocator(this->items.get_allocator());
+		auto new_index = index_allocator.allocate(required);
+
+		this->release_index();
+		this->index = new_index;
+		this->index_capacity = required;
+	}
+
+	std::memset(this->index, 0, sizeof(uint32_t) * this->index_capacity);
+
+	for (size_type i = 0; i < this->items.size(); ++i)
+		this->index_insert(i, this->items[i].first.hash());
+}
+
+void mctx_object::reindex()
+{
+	if (this->items.size() > linear_threshold)
+		this->rebuild_index();
+	else
+		this->release_index();
+}
+
+void mctx_object::release_index() noexcept
+{
+	if (this->index == nullptr)
+		return;
+
+	details::mctx_allocator<uint32_t> index_allocator(this->items.get_allocator());
+	index_allocator.deallocate(this->index, this->index_capacity);
+
+	this->index = nullptr;
+	this->index_capacity = 0;
+}
+
+mctx_packed_array::mctx_packed_array(storage values) :
+	items(std::move(values)),
+	mirror_array(nullptr) {}
+
+mctx_packed_array::~mctx_packed_array()
+{
+	this->reset_mirror();
+}
+
+mctx_packed_array::mctx_packed_array(const mctx_packed_array& other) :
+	items(other.items),
+	mirror_array(nullptr) {}
+
+mctx_packed_array::mctx_packed_array(mctx_packed_array&& other) noexcept :
+	items(std::move(other.items)),
+	mirror_array(other.mirror_array.exchange(nullptr)) {}
+
+mctx_packed_array& mctx_packed_array::operator=(const mctx_packed_array& other)
+{
+	if (this == &other)
+		return *this;
+
+	this->reset_mirror();
+	this->items = other.items;
+	return *this;
+}
+
+mctx_packed_array& mctx_packed_array::operator=(mctx_packed_array&& other) noexcept(std::is_nothrow_move_assignable_v<storage>)
+{
+	if (this == &other)
+		return *this;
+
+	this->reset_mirror();
+	this->items = std::move(other.items);
+	this->mirror_array = other.mirror_array.exchange(nullptr);
+	return *this;
+}
+
+size_t mctx_packed_array::size() const noexcept
+{
+	return std::visit([](const auto& v) { return v.size(); }, this->items);
+}
+
+bool mctx_packed_array::empty() const noexcept
+{
+	return this->size() == 0;
+}
+
+const mctx_packed_array::storage& mctx_packed_array::values() const noexcept
+{
+	return this->items;
+}
+
+mctx_packed_array::storage& mctx_packed_array::values() noexcept
+{
+	this->reset_mirror();
+	return this->items;
+}
+
+mctx mctx_packed_array::element(size_t index) const
+{
+	return std::visit([index](const auto& v) { return mctx(v.at(index)); }, this->items);
+}
+
+bool mctx_packed_array::try_push_back(const mctx& value)
+{
+	return std::visit([&](auto& v)
+	{
+		using element_type = typename std::remove_cvref_t<decltype(v)>::value_type;
+
+		const auto* ptr = value.get_if_value<element_type>();
+		if (ptr == nullptr)
+			return false;
+
+		this->reset_mirror();
+		v.push_back(*ptr);
+		return true;
+	}, this->items);
+}
+
+const mctx_array& mctx_packed_array::mirror() const
+{
+	if (const auto* built = this->mirror_array.load(std::memory_order_acquire))
+		return *built;
+
+	std::lock_guard lock(this->mirror_lock);
+
+	auto* built = this->mirror_array.load(std::memory_order_relaxed);
+	if (built == nullptr)
+	{
+		// Mirror lives on the same resource as the packed elements, not on the one current at the time of the call
+		auto resource = std::visit([](const auto& v) { return v.get_allocator().get_resource(); }, this->items);
+
+		auto generic = std::make_unique<mctx_array>(details::mctx_allocator<mctx>(resource));
+		generic->reserve(this->size());
+
+		std::visit([&generic](const auto& v)
+		{
+			for (auto element : v)
+				generic->emplace_back(element);
+		}, this->items);
+
+		built = generic.release();
+		this->mirror_array.store(built, std::memory_order_release);
+	}
+
+	return *built;
+}
+
+mctx_array mctx_packed_array::release_array()
+{
+	std::unique_ptr<mctx_array> built(this->mirror_array.exchange(nullptr));
+	if (built == nullptr)
+	{
+		(void)this->mirror();
+		built.reset(this->mirror_array.exchange(nullptr));
+	}
+
+	return std::move(*built);
+}
+
+bool mctx_packed_array::operator==(const mctx_packed_array& other) const
+{
+	if (this->items.index() == other.items.index())
+		return this->items == other.items;
+
+	// Integers of different signedness are equal if they hold the same numbers, same as scalars
+	const auto same_numbers = [](const vector<int64_t>& signed_values, const vector<uint64_t>& unsigned_values)
+	{
+		return std::ranges::equal(signed_values, unsigned_values, [](int64_t lhs, uint64_t rhs)
+		{
+			return lhs >= 0 && static_cast<uint64_t>(lhs) == rhs;
+		});
+	};
+
+	if (const auto* signed_values = std::get_if<vector<int64_t>>(&this->items))
+		if (const auto* unsigned_values = std::get_if<vector<uint64_t>>(&other.items))
+			return same_numbers(*signed_values, *unsigned_values);
+
+	if (const auto* signed_values = std::get_if<vector<int64_t>>(&other.items))
+		if (const auto* unsigned_values = std::get_if<vector<uint64_t>>(&this->items))
+			return same_numbers(*signed_values, *unsigned_values);
+
+	return false;
+}
+
+void mctx_packed_array::reset_mirror() noexcept
+{
+	delete this->mirror_array.exchange(nullptr);
+}
+
+mctx_string_slice::mctx_string_slice(std::shared_ptr<const void> owner, std::string_view text) noexcept :
+	buffer(std::move(owner)),
+	text(text),
+	copy(nullptr) {}
+
+mctx_string_slice::~mctx_string_slice()
+{
+	delete this->copy.load(std::memory_order_relaxed);
+}
+
+mctx_string_slice::mctx_string_slice(const mctx_string_slice& other) noexcept :
+	buffer(other.buffer),
+	text(other.text),
+	copy(nullptr) {}
+
+mctx_string_slice::mctx_string_slice(mctx_string_slice&& other) noexcept :
+	buffer(std::move(other.buffer)),
+	text(std::exchange(other.text, {})),
+	copy(other.copy.exchange(nullptr)) {}
+
+mctx_string_slice& mctx_string_slice::operator=(const mctx_string_slice& other) noexcept
+{
+	if (this != &other)
+	{
+		delete this->copy.exchange(nullptr);
+		this->buffer = other.buffer;
+		this->text = other.text;
+	}
+
+	return *this;
+}
+
+mctx_string_slice& mctx_string_slice::operator=(mctx_string_slice&& other) noexcept
+{
+	if (this != &other)
+	{
+		delete this->copy.exchange(other.copy.exchange(nullptr));
+		this->buffer = std::move(other.buffer);
+		this->text = std::exchange(other.text, {});
+	}
+
+	return *this;
+}
+
+std::string_view mctx_string_slice::view() const noexcept { return this->text; }
+const std::shared_ptr<const void>& mctx_string_slice::owner() const noexcept { return this->buffer; }
+
+const std::string& mctx_string_slice::str() const
+{
+	if (const auto* existing = this->copy.load(std::memory_order_acquire))
+		return *existing;
+
+	// Racing readers may both make a copy, only the first one to publish it is kept
+	auto made = std::make_unique<std::string>(this->text);
+	std::string* expected = nullptr;
+
+	if (this->copy.compare_exchange_strong(expected, made.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+		return *made.release();
+
+	return *expected;
+}
+
+bool mctx_string_slice::operator==(const mctx_string_slice& other) const noexcept
+{
+	return this->text == other.text;
+}
+
+mctx_lazy::mctx_lazy(std::shared_ptr<const void> owner, std::string_view text, builder build) noexcept :
+	buffer(std::move(owner)),
+	range(text),
+	build(build),
+	resource(details::current_memory_resource()),
+	node(nullptr) {}
+
+mctx_lazy::~mctx_lazy()
+{
+	delete this->node.load(std::memory_order_relaxed);
+}
+
+mctx_lazy::mctx_lazy(const mctx_lazy& other) noexcept :
+	buffer(other.buffer),
+	range(other.range),
+	build(other.build),
+	resource(details::current_memory_resource()),
+	node(nullptr) {}
+
+mctx_lazy::mctx_lazy(mctx_lazy&& other) noexcept :
+	buffer(std::move(other.buffer)),
+	range(std::exchange(other.range, {})),
+	build(other.build),
+	resource(other.resource),
+	node(other.node.exchange(nullptr)) {}
+
+mctx_lazy& mctx_lazy::operator=(const mctx_lazy& other) noexcept
+{
+	if (this != &other)
+	{
+		delete this->node.exchange(nullptr);
+		this->buffer = other.buffer;
+		this->range = other.range;
+		this->build = other.build;
+		this->resource = details::current_memory_resource();
+	}
+
+	return *this;
+}
+
+mctx_lazy& mctx_lazy::operator=(mctx_lazy&& other) noexcept
+{
+	if (this != &other)
+	{
+		delete this->node.exchange(other.node.exchange(nullptr));
+		this->buffer = std::move(other.buffer);
+		this->range = std::exchange(other.range, {});
+		this->build = other.build;
+		this->resource = other.resource;
+	}
+
+	return *this;
+}
+
+std::string_view mctx_lazy::text() const noexcept { return this->range; }
+const std::shared_ptr<const void>& mctx_lazy::owner() const noexcept { return this->buffer; }
+
+bool mctx_lazy::is_built() const noexcept
+{
+	return this->node.load(std::memory_order_acquire) != nullptr;
+}
+
+const mctx& mctx_lazy::get() const
+{
+	if (const auto* built = this->node.load(std::memory_order_acquire))
+		return *built;
+
+	std::lock_guard lock(this->build_lock);
+
+	auto* built = this->node.load(std::memory_order_relaxed);
+	if (built == nullptr)
+	{
+		// Built nodes belong to the tree the lazy node is in, not to the scope of the first reader
+		mctx_resource_scope scope(this->resource);
+
+		built = new mctx(this->build(this->buffer, this->range));
+		this->node.store(built, std::memory_order_release);
+	}
+
+	return *built;
+}
+
+bool mctx_lazy::operator==(const mctx_lazy& other) const
+{
+	return this->get() == other.get();
+}
+
 mctx::mctx() = default;
 
-mctx::mctx(bool v) : var(v) {}
-mctx::mctx(double v) : var(v) {}
-mctx::mctx(float v) : var(v) {}
+mctx::mctx(std::nullptr_t) : var() {}
+mctx::mctx(bool v) : var(v) {}
+mctx::mctx(double v) : var(v) {}
+mctx::mctx(float v) : var(v) {}
+
+mctx::mctx(const char* v) : var(details::make_boxed<string>(v)) {}
+
+mctx::mctx(std::string v) : var(details::make_boxed<string>(std::move(v))) {}
+
+mctx::mctx(mctx_string_slice v) : var(details::make_boxed<slice>(std::move(v))) {}
+
+mctx::mctx(mctx_lazy v) : var(details::make_boxed<lazy>(std::move(v))) {}
+
+mctx::mctx(array v)
+{
+	const bool holds_leaked = std::ranges::any_of(v, [](const mctx& value) { return value.is_leaked(); });
+
+	auto elements = details::make_boxed<array>(std::move(v));
+	if (holds_leaked)
+		elements.leak();
+
+	this->var = std::move(elements);
+}
+
+mctx::mctx(object v)
+{
+	const bool holds_leaked = std::ranges::any_of(v, [](const auto& member) { return member.second.is_leaked(); });
+
+	auto members = details::make_boxed<object>(std::move(v));
+	if (holds_leaked)
+		members.leak();
+
+	this->var = std::move(members);
+}
+
+mctx::mctx(const mctx& v) = default;
+
+// Moved-from nodes are left empty rather than holding an empty box
+mctx::mctx(mctx&& v) noexcept :
+	var(std::move(v.var))
+{
+	v.var.emplace<std::monostate>();
+}
+
+mctx& mctx::operator=(const mctx& v) = default;
 
-mctx::mctx(const char* v) : var(string(v)) {}
+mctx& mctx::operator=(mctx&& v) noexcept
+{
+	if (&v == this)
+		return *this;
 
-mctx::mctx(std::string v) : var(std::move(v)) {}
+	this->var = std::move(v.var);
+	v.var.emplace<std::monostate>();
 
-mctx::mctx(const mctx& v) = default;
-mctx::mctx(mctx&& v) noexcept = default;
+	return *this;
+}
 
-mctx& mctx::operator=(const mctx& v) = default;
-mctx& mctx::operator=(mctx&& v) noexcept = default;
+mctx::mctx(custom v) : var(details::make_boxed<custom>(std::move(v))) {}
 
-mctx::mctx(custom v) : var(std::move(v)) {}
+static_assert(sizeof(mctx) <= 16, "mctx is expected to be a 16 byte tagged cell");
+static_assert(sizeof(details::custom_head) + 4 * sizeof(void*) == details::custom_box_size, "boxed custom heads are expected to fill one cache line");
 
 template<>
 bool mctx::is<mctx::custom>() const
 {
-	return std::holds_alternative<custom>(var);
+	return this->get_if_value<custom>() != nullptr;
 }
 
 bool mctx::empty() const
 {
-	return this->var.index() == 0 ||
-		(std::holds_alternative<array>(this->var) && std::get<array>(this->var).empty()) ||
-		(std::holds_alternative<string>(this->var) && std::get<string>(this->var).empty()) ||
-		(std::holds_alternative<object>(this->var) && std::get<object>(this->var).empty()) ||
-		(std::holds_alternative<custom>(this->var) && std::get<custom>(this->var).empty());
+	bool is_empty = false;
+
+	this->visit(details::overloaded{
+		[&](const std::monostate&) { is_empty = true; },
+		[&](const array& a) { is_empty = a.empty(); },
+		[&](const string& str) { is_empty = str.empty(); },
+		[&](const object& o) { is_empty = o.empty(); },
+		[&](const packed& p) { is_empty = p.empty(); },
+		[&](const slice& sl) { is_empty = sl.view().empty(); },
+		[&](const custom& c) { is_empty = c.empty(); },
+		[](const auto&) {}
+	});
+
+	return is_empty;
+}
+
+mctx::value_kind mctx::kind() const
+{
+	if (const auto* target = this->lazy_target())
+		return target->kind();
+
+	return static_cast<value_kind>(this->var.index());
 }
 
 bool mctx::is_none() const
 {
+	if (const auto* target = this->lazy_target())
+		return target->is_none();
+
 	return this->var.index() == 0;
 }
 
@@ -148,23 +1158,24 @@ bool mctx::is_scalar() const
 
 bool mctx::is_array() const
 {
-	return std::holds_alternative<array>(this->var);
+	return this->get_if_value<array>() != nullptr || this->is_packed();
 }
 
 bool mctx::is_object() const
 {
-	return std::holds_alternative<object>(this->var);
+	return this->get_if_value<object>() != nullptr;
 }
 
 mctx::value_iter mctx::begin()
 {
 	value_iter it;
+	this->unpack();
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](array& a) { it = value_iter{a.begin()}; },
 		[&it](object& o) { it = value_iter{o.begin()}; },
 		[](const auto &) -> void { }
-	}, this->var);
+	});
 
 	return it;
 }
@@ -172,12 +1183,13 @@ mctx::value_iter mctx::begin()
 mctx::value_iter mctx::end()
 {
 	value_iter it;
+	this->unpack();
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](array& a) { it = value_iter{a.end()}; },
 		[&it](object& o) { it = value_iter{o.end()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -196,11 +1208,12 @@ mctx::value_iter mctx::cbegin() const
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](const array& a) { it = value_iter{a.begin()}; },
 		[&it](const object& o) { it = value_iter{o.begin()}; },
+		[&it](const packed& p) { it = value_iter{p.mirror().begin()}; },
 		[](const auto &) -> void { }
-	}, this->var);
+	});
 
 	return it;
 }
@@ -209,11 +1222,12 @@ mctx::value_iter mctx::cend() const
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](const array& a) { it = value_iter{a.end()}; },
 		[&it](const object& o) { it = value_iter{o.end()}; },
+		[&it](const packed& p) { it = value_iter{p.mirror().end()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -222,11 +1236,12 @@ mctx::value_iter mctx::rbegin() const
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](const array& a) { it = value_iter{a.rbegin()}; },
 		[&it](const object& o) { it = value_iter{o.rbegin()}; },
+		[&it](const packed& p) { it = value_iter{p.mirror().rbegin()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -235,63 +1250,68 @@ mctx::value_iter mctx::rend() const
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&it](const array& a) { it = value_iter{a.rend()}; },
 		[&it](const object& o) { it = value_iter{o.rend()}; },
+		[&it](const packed& p) { it = value_iter{p.mirror().rend()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
 
-mctx::value_iter mctx::find(const std::string &str)
+mctx::value_iter mctx::find(std::string_view str)
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](array&) { throw std::runtime_error("find is not defined for array"); },
+		[](packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](object& o) { it = value_iter{o.find(str)}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
 
-mctx::value_iter mctx::find(const std::string& str) const
+mctx::value_iter mctx::find(std::string_view str) const
 {
 	value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](const array&) { throw std::runtime_error("find is not defined for array"); },
+		[](const packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](const object& o) { it = value_iter{o.find(str)}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
 
-mctx::key_value_iter mctx::kvfind(const std::string& str)
+mctx::key_value_iter mctx::kvfind(std::string_view str)
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](const array&) { throw std::runtime_error("find is not defined for array"); },
+		[](const packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](object& o) { it = key_value_iter{o.find(str)}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
 
-mctx::key_value_iter mctx::kvfind(const std::string &str) const
+mctx::key_value_iter mctx::kvfind(std::string_view str) const
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](const array&) { throw std::runtime_error("find is not defined for array"); },
+		[](const packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](const object& o) { it = key_value_iter{o.find(str)}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -300,11 +1320,12 @@ mctx::key_value_iter mctx::kvbegin() const
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](const array&) { throw std::runtime_error("find is not defined for array"); },
+		[](const packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](const object& o) { it = key_value_iter{o.begin()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -313,11 +1334,12 @@ mctx::key_value_iter mctx::kvend() const
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](const array&) { throw std::runtime_error("find is not defined for array"); },
+		[](const packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](const object& o) { it = key_value_iter{o.end()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -326,11 +1348,12 @@ mctx::key_value_iter mctx::kvbegin()
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](array&) { throw std::runtime_error("find is not defined for array"); },
+		[](packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](object& o) { it = key_value_iter{o.begin()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -339,11 +1362,12 @@ mctx::key_value_iter mctx::kvend()
 {
 	key_value_iter it;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[](array&) { throw std::runtime_error("find is not defined for array"); },
+		[](packed&) { throw std::runtime_error("find is not defined for array"); },
 		[&](object& o) { it = key_value_iter{o.end()}; },
 		[](const auto&) -> void {}
-	}, this->var);
+	});
 
 	return it;
 }
@@ -351,13 +1375,14 @@ mctx::key_value_iter mctx::kvend()
 mctx::value_iter mctx::erase(value_iter iter)
 {
 	value_iter after;
+	this->unpack();
 
 	auto array_erase = [&](array& a) { after = iter.__erase(a); };
 	auto object_erase = [&](object& o) { after = iter.__erase(o); };
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		 array_erase, object_erase,
-		[](const auto&) -> void {} }, this->var);
+		[](const auto&) -> void {} });
 
 	return after;
 }
@@ -368,17 +1393,17 @@ mctx::key_value_iter mctx::erase(key_value_iter iter)
 
 	auto object_erase = [&](object& o) { after = iter.__erase(o); };
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		object_erase,
-		[](const auto&) -> void {}}, this->var);
+		[](const auto&) -> void {}});
 
 	return after;
 }
 
-mctx& mctx::operator[](const std::string& key)
+mctx& mctx::operator[](std::string_view key)
 {
 	if (this->is_none())
-		this->var = object{};
+		this->var = details::make_boxed<object>();
 
 	return this->as<object>()[key];
 }
@@ -386,55 +1411,72 @@ mctx& mctx::operator[](const std::string& key)
 mctx& mctx::operator[](size_t index) { return this->as<array>()[index]; }
 const mctx& mctx::operator[](size_t index) const { return this->as<array>()[index]; }
 
-const mctx& mctx::at(const std::string& key) const { return this->as<object>().at(key); }
+const mctx& mctx::at(std::string_view key) const { return this->as<object>().at(key); }
 const mctx& mctx::at(size_t index) const { return this->as<array>().at(index); }
 
-mctx& mctx::at(const std::string& key) { return this->as<object>().at(key); }
+mctx& mctx::at(std::string_view key) { return this->as<object>().at(key); }
 mctx& mctx::at(size_t index) { return this->as<array>().at(index); }
 
 void mctx::push_back(mctx val_t)
 {
 	if (this->is_none())
-		this->var = array{};
+		this->var = details::make_boxed<array>();
+
+	if (auto* p = this->edit_if_value<packed>(); p != nullptr && p->try_push_back(val_t))
+		return;
+
+	// References into a leaked element stay good, so the array can't be shared anymore
+	if (val_t.is_leaked())
+	{
+		this->as<array>().push_back(std::move(val_t));
+		return;
+	}
+
+	this->unpack();
+	auto* a = this->edit_if_value<array>();
+	if (a == nullptr)
+		throw std::runtime_error("Bad as<T> call");
 
-	this->as<array>().push_back(std::move(val_t));
+	a->push_back(std::move(val_t));
 }
 
 size_t mctx::size() const
 {
 	size_t size = 0;
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&size](const array& a) { size = a.size(); },
 		[&size](const object& o) { size = o.size(); },
+		[&size](const packed& p) { size = p.size(); },
 		[](const std::monostate&) {},
 		[](const auto&) -> void { throw std::runtime_error("size is not defined for scalars"); }
-	}, this->var);
+	});
 
 	return size;
 }
 
 void mctx::clear() { this->var = std::monostate{}; }
 
-void mctx::erase(const std::string& str)
+void mctx::erase(std::string_view str)
 {
-	auto iter = this->find(str);
-	if (iter == this->end())
-		return;
+	if (this->is_array())
+		throw std::runtime_error("find is not defined for array");
 
-	this->erase(iter);
+	if (auto* o = this->edit_if_value<object>())
+		o->erase(str);
 }
 
 mctx::value_iter mctx::erase(const value_iter& begin, const value_iter& end)
 {
 	auto after = begin;
+	this->unpack();
 
 	auto array_erase = [&](array& a) { after.__erase(a, end); };
 	auto object_erase = [&](object& o) { after.__erase(o, end); };
 
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		 array_erase, object_erase,
-		[](const auto&) -> void {} }, this->var);
+		[](const auto&) -> void {} });
 
 	return after;
 }
@@ -445,15 +1487,502 @@ mctx::key_value_iter mctx::erase(const key_value_iter& begin, const key_value_it
 
 	auto object_erase = [&](object& o) { after.__erase(o, end); };
 
-	std::visit(details::overloaded{object_erase, [](const auto&) -> void {} }, this->var);
+	this->visit(details::overloaded{object_erase, [](const auto&) -> void {} });
 
 	return after;
 }
 
-mctx mctx::make_array() { mctx m; m.var = array{}; return m; }
-mctx mctx::make_object() { mctx m; m.var = object{}; return m; }
+mctx mctx::make_array() { mctx m; m.var = details::make_boxed<array>(); return m; }
+mctx mctx::make_object() { mctx m; m.var = details::make_boxed<object>(); return m; }
+
+const mctx::array* mctx::if_array() const
+{
+	if (const auto* p = this->get_if_value<packed>())
+		return &p->mirror();
+
+	return this->get_if_value<array>();
+}
+
+const mctx::object* mctx::if_object() const { return this->get_if_value<object>(); }
+const mctx::string* mctx::if_string() const
+{
+	if (const auto* sl = this->get_if_value<slice>())
+		return &sl->str();
+
+	return this->get_if_value<string>();
+}
+
+mctx::array* mctx::if_array()
+{
+	this->unpack();
+	return this->get_if_value<array>();
+}
+
+mctx::object* mctx::if_object() { return this->get_if_value<object>(); }
+mctx::string* mctx::if_string()
+{
+	this->unslice();
+	return this->get_if_value<string>();
+}
+
+mctx::erase_batch::erase_batch(mctx& target) :
+	target(target)
+{
+	if (!target.is_array() && !target.is_object())
+		throw std::runtime_error("Bad erase_batch target: not an array or an object");
+}
+
+mctx::erase_batch::~erase_batch()
+{
+	this->commit();
+}
+
+bool mctx::erase_batch::erase(size_t index)
+{
+	if (index >= this->target.size())
+		throw std::out_of_range("erase_batch::erase: index out of range");
+
+	if (index >= this->tombstones.size())
+		this->tombstones.resize(this->target.size());
+
+	if (this->tombstones[index])
+		return false;
+
+	this->tombstones[index] = true;
+	++this->marked;
+
+	return true;
+}
+
+bool mctx::erase_batch::erase(std::string_view key)
+{
+	const auto* o = std::as_const(this->target).if_object();
+	if (o == nullptr)
+		throw std::runtime_error("erase_batch::erase: keys are only erased from objects");
+
+	auto iter = o->find(key);
+	if (iter == o->end())
+		return false;
+
+	return this->erase(static_cast<size_t>(iter - o->begin()));
+}
+
+bool mctx::erase_batch::erased(size_t index) const noexcept
+{
+	return index < this->tombstones.size() && this->tombstones[index];
+}
+
+size_t mctx::erase_batch::pending() const noexcept { return this->marked; }
+
+size_t mctx::erase_batch::commit()
+{
+	if (this->marked == 0)
+		return 0;
+
+	size_t position = 0;
+	const auto removed = this->target.erase_if([this, &position](const mctx&) { return this->erased(position++); });
+
+	this->tombstones.clear();
+	this->marked = 0;
+
+	return removed;
+}
+
+mctx::const_array_view mctx::elements() const
+{
+	if (const auto* a = this->if_array())
+		return *a;
+
+	return {};
+}
+
+mctx::const_object_view mctx::members() const
+{
+	if (const auto* o = this->if_object())
+		return { o->begin(), o->end() };
+
+	return {};
+}
+
+mctx::array_view mctx::elements()
+{
+	if (auto* a = this->if_array())
+		return *a;
+
+	return {};
+}
+
+mctx::object_view mctx::members()
+{
+	if (auto* o = this->if_object())
+		return { o->begin(), o->end() };
+
+	return {};
+}
+
+const mctx* mctx::resolve(const mctx_path& path) const
+{
+	const mctx* node = this;
+
+	for (const auto& step : path.segments())
+	{
+		if (const auto* key = step.key())
+		{
+			const auto* o = node->get_if_value<object>();
+			if (o == nullptr)
+				return nullptr;
+
+			auto iter = o->find(*key);
+			if (iter == o->end())
+				return nullptr;
+
+			node = &iter->second;
+			continue;
+		}
+
+		const auto* a = node->if_array();
+		const auto index = *step.index();
+		if (a == nullptr || index >= a->size())
+			return nullptr;
+
+		node = &(*a)[index];
+	}
+
+	return node;
+}
+
+mctx* mctx::resolve(const mctx_path& path)
+{
+	// Don't unshare anything unless the whole path is there
+	if (std::as_const(*this).resolve(path) == nullptr)
+		return nullptr;
+
+	mctx* node = this;
+
+	for (const auto& step : path.segments())
+	{
+		if (const auto* key = step.key())
+			node = &node->get_if_value<object>()->find(*key)->second;
+		else
+			node = &(*node->if_array())[*step.index()];
+	}
+
+	return node;
+}
+
+bool mctx::is_packed() const
+{
+	return this->get_if_value<packed>() != nullptr;
+}
+
+bool mctx::try_pack()
+{
+	const auto* a = std::as_const(*this).get_if_value<array>();
+	if (a == nullptr || a->empty())
+		return false;
+
+	const auto front_index = a->front().var.index();
+	for (const auto& element : *a)
+		if (element.var.index() != front_index)
+			return false;
+
+	auto pack_as = [&]<typename T>(std::type_identity<T>)
+	{
+		packed::vector<T> values;
+		values.reserve(a->size());
+
+		for (const auto& element : *a)
+			values.push_back(std::get<T>(element.var));
+
+		this->var = details::make_boxed<packed>(packed::storage(std::move(values)));
+		return true;
+	};
+
+	switch (static_cast<value_kind>(front_index))
+	{
+		case value_kind::boolean: return pack_as(std::type_identity<bool>{});
+		case value_kind::signed_integer: return pack_as(std::type_identity<int64_t>{});
+		case value_kind::unsigned_integer: return pack_as(std::type_identity<uint64_t>{});
+		case value_kind::float32: return pack_as(std::type_identity<float>{});
+		case value_kind::float64: return pack_as(std::type_identity<double>{});
+		default: return false;
+	}
+}
+
+bool mctx::is_slice() const
+{
+	return this->get_if_value<slice>() != nullptr;
+}
+
+bool mctx::is_lazy() const noexcept
+{
+	return std::holds_alternative<stored_t<lazy>>(this->var);
+}
+
+void mctx::materialize()
+{
+	if (const auto* l = std::get_if<stored_t<lazy>>(&this->var))
+	{
+		// Shares the built nodes, which the lazy one gives up right after
+		mctx built = (*l)->get();
+		*this = std::move(built);
+	}
+}
+
+const void* mctx::stable_node() const noexcept
+{
+	return std::visit([](const auto& v) -> const void*
+	{
+		if constexpr (details::is_boxed_v<decltype(v)> && !std::is_same_v<std::remove_cvref_t<decltype(v)>, stored_t<lazy>>)
+			return v.stable_node();
+		else
+			return nullptr;
+	}, this->var);
+}
+
+bool mctx::is_leaked() const noexcept
+{
+	return std::visit([](const auto& v)
+	{
+		if constexpr (details::is_boxed_v<decltype(v)>)
+			return v.is_leaked();
+		else
+			return false;
+	}, this->var);
+}
+
+void mctx::seal() noexcept
+{
+	std::visit([](auto& v)
+	{
+		// Nodes that aren't leaked hold no leaked ones
+		if constexpr (details::is_boxed_v<decltype(v)>)
+		{
+			if (!v.is_leaked())
+				return;
+
+			auto& value = v.seal();
+			if constexpr (std::is_same_v<std::remove_cvref_t<decltype(value)>, array>)
+			{
+				for (auto& element : value)
+					element.seal();
+			}
+			else if constexpr (std::is_same_v<std::remove_cvref_t<decltype(value)>, object>)
+			{
+				for (auto& entry : value)
+					entry.second.seal();
+			}
+		}
+	}, this->var);
+}
+
+const mctx* mctx::lazy_target() const
+{
+	if (const auto* l = std::get_if<stored_t<lazy>>(&this->var))
+		return &(*l)->get();
+
+	return nullptr;
+}
+
+std::string_view mctx::as_string_view() const
+{
+	if (const auto* sl = this->get_if_value<slice>())
+		return sl->view();
+
+	if (const auto* str = this->get_if_value<string>())
+		return *str;
+
+	throw std::runtime_error("Bad as_string_view call");
+}
+
+void mctx::unslice()
+{
+	if (const auto* sl = std::as_const(*this).get_if_value<slice>())
+		this->var = details::make_boxed<string>(sl->view());
+}
+
+void mctx::unpack()
+{
+	if (auto* p = this->edit_if_value<packed>())
+		this->var = details::make_boxed<array>(p->release_array());
+}
+
+namespace
+{
+
+// Per-kind seeds, kinds that compare equal to each other share one
+enum hash_seed : uint64_t
+{
+	hash_none = 0x6a09e667f3bcc908ull,
+	hash_boolean = 0xbb67ae8584caa73bull,
+	hash_integer = 0x3c6ef372fe94f82bull,
+	hash_float32 = 0xa54ff53a5f1d36f1ull,
+	hash_float64 = 0x510e527fade682d1ull,
+	hash_string = 0x9b05688c2b3e6c1full,
+	hash_custom = 0x1f83d9abfb41bd6bull,
+	hash_array = 0x5be0cd19137e2179ull,
+	hash_object = 0xcbbb9d5dc1059ed8ull
+};
+
+// splitmix64 finalizer
+constexpr uint64_t mix_hash(uint64_t x) noexcept
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+constexpr uint64_t combine_hash(uint64_t seed, uint64_t value) noexcept
+{
+	return mix_hash(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+uint64_t hash_scalar(bool value) noexcept { return mix_hash(hash_boolean ^ value); }
+
+// Signed and unsigned integers holding the same number are equal
+uint64_t hash_scalar(int64_t value) noexcept { return mix_hash(hash_integer ^ static_cast<uint64_t>(value)); }
+uint64_t hash_scalar(uint64_t value) noexcept { return mix_hash(hash_integer ^ value); }
+
+// Zeroes of both signs are equal
+uint64_t hash_scalar(float value) noexcept { return mix_hash(hash_float32 ^ std::bit_cast<uint32_t>(value == 0 ? 0.0f : value)); }
+uint64_t hash_scalar(double value) noexcept { return mix_hash(hash_float64 ^ std::bit_cast<uint64_t>(value == 0 ? 0.0 : value)); }
+
+uint64_t hash_text(std::string_view text) noexcept { return mix_hash(hash_string ^ std::hash<std::string_view>()(text)); }
+
+uint64_t hash_value(std::monostate) noexcept { return mix_hash(hash_none); }
+uint64_t hash_value(bool value) noexcept { return hash_scalar(value); }
+uint64_t hash_value(int64_t value) noexcept { return hash_scalar(value); }
+uint64_t hash_value(uint64_t value) noexcept { return hash_scalar(value); }
+uint64_t hash_value(float value) noexcept { return hash_scalar(value); }
+uint64_t hash_value(double value) noexcept { return hash_scalar(value); }
+uint64_t hash_value(const std::string& value) noexcept { return hash_text(value); }
+uint64_t hash_value(const mctx_string_slice& value) noexcept { return hash_text(value.view()); }
+uint64_t hash_value(const mctx_lazy& value) { return value.get().hash(); }
+
+// Custom values are only compared through their type's operator==, so only the type takes part
+uint64_t hash_value(const details::custom_head& value) noexcept
+{
+	return mix_hash(hash_custom ^ std::hash<std::string_view>()(value.get_type_name()));
+}
+
+// Packed elements hash as the scalar nodes they stand for
+uint64_t hash_value(const mctx_array& value)
+{
+	uint64_t hash = hash_array;
+	for (const auto& element : value)
+		hash = combine_hash(hash, element.hash());
+
+	return combine_hash(hash, value.size());
+}
+
+uint64_t hash_value(const mctx_packed_array& value)
+{
+	return std::visit([](const auto& values)
+	{
+		uint64_t hash = hash_array;
+		for (const auto element : values)
+			hash = combine_hash(hash, hash_scalar(static_cast<typename std::remove_cvref_t<decltype(values)>::value_type>(element)));
+
+		return combine_hash(hash, values.size());
+	}, value.values());
+}
+
+// Entries are summed, key order doesn't matter
+uint64_t hash_value(const mctx_object& value)
+{
+	uint64_t sum = 0;
+	for (const auto& [key, element] : value)
+		sum += combine_hash(key.hash(), element.hash());
+
+	return combine_hash(hash_object ^ sum, value.size());
+}
+
+}
+
+size_t mctx::hash() const
+{
+	return std::visit([](const auto& v) -> uint64_t
+	{
+		if constexpr (details::is_boxed_v<decltype(v)>)
+		{
+			if (const auto cached = v.cached_hash(); cached != 0)
+				return cached;
+
+			const auto hash = std::max<uint64_t>(hash_value(*v), 1);
+			v.cache_hash(hash);
+
+			return hash;
+		}
+		else
+			return hash_value(v);
+	}, this->var);
+}
+
+bool mctx::operator==(const mctx& v) const
+{
+	if (const auto* target = this->lazy_target())
+		return *target == v;
+
+	if (const auto* target = v.lazy_target())
+		return *this == *target;
+
+	if (this->var.index() != v.var.index())
+	{
+		// Integers of different signedness are equal if they hold the same number
+		const auto* this_signed = std::get_if<int64_t>(&this->var);
+		const auto* this_unsigned = std::get_if<uint64_t>(&this->var);
+		const auto* v_signed = std::get_if<int64_t>(&v.var);
+		const auto* v_unsigned = std::get_if<uint64_t>(&v.var);
+
+		if (this_signed != nullptr && v_unsigned != nullptr)
+			return *this_signed >= 0 && static_cast<uint64_t>(*this_signed) == *v_unsigned;
 
-bool mctx::operator==(const mctx& v) const { return v.var == this->var; }
+		if (this_unsigned != nullptr && v_signed != nullptr)
+			return *v_signed >= 0 && static_cast<uint64_t>(*v_signed) == *this_unsigned;
+
+		// Slicing is a storage detail as well, only the text is compared
+		if (this->is<string>() && v.is<string>())
+			return this->as_string_view() == v.as_string_view();
+
+		// Packing is a storage detail, a packed array equals the generic array of the same elements
+		const auto* this_packed = this->get_if_value<packed>();
+		const auto* v_packed = v.get_if_value<packed>();
+		const auto* generic = this_packed != nullptr ? v.get_if_value<array>() : this->get_if_value<array>();
+		const auto* packed_side = this_packed != nullptr ? this_packed : v_packed;
+
+		if (packed_side == nullptr || generic == nullptr || packed_side->size() != generic->size())
+			return false;
+
+		for (size_t i = 0; i < generic->size(); ++i)
+			if (!(packed_side->element(i) == (*generic)[i]))
+				return false;
+
+		return true;
+	}
+
+	return std::visit([&v](const auto& lhs)
+	{
+		using T = std::remove_cvref_t<decltype(lhs)>;
+		const auto& rhs = std::get<T>(v.var);
+
+		if constexpr (details::is_boxed_v<T>)
+		{
+			if (lhs.same_node(rhs))
+				return true;
+
+			const auto lhs_hash = lhs.cached_hash();
+			const auto rhs_hash = rhs.cached_hash();
+			if (lhs_hash != 0 && rhs_hash != 0 && lhs_hash != rhs_hash)
+				return false;
+		}
+
+		return details::unbox(lhs) == details::unbox(rhs);
+	}, this->var);
+}
 
 mctx::value_iter::value_iter() = default;
 mctx::value_iter::value_iter(const value_iter&) = default;
@@ -576,13 +2105,15 @@ bool mctx::key_value_iter::operator!=(const key_value_iter& lhs) const { return
 template<>
 std::string mctx::get_as<std::string>(std::string result) const
 {
-	std::visit(details::overloaded{
+	this->visit(details::overloaded{
 		[&](const std::monostate&) { /* default_value */ },
 		[&](bool v) { result = v ? "true" : "false"; },
+		[&](int64_t v) { result = std::to_string(v); },
 		[&](uint64_t v) { result = std::to_string(v); },
 		[&](float v) { result = std::format("{}", v); },
 		[&](double v) { result = std::format("{}", v); },
 		[&](const std::string& v) { result = v; },
+		[&](const slice& v) { result = v.view(); },
 		[&](const custom& c)
 		{
 			if (c.is<std::string>())
@@ -591,8 +2122,9 @@ std::string mctx::get_as<std::string>(std::string result) const
 				result = c.get_type_name();
 		},
 		[&](const array& a) { result = "[array]"; },
+		[&](const packed&) { result = "[array]"; },
 		[&](const object& o) { result = "{object}"; }
-	}, this->var);
+	});
 
 	return result;
 }
@@ -0,0 +1,414 @@
+#include "mctx_binary.h"
+
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace dixelu::mctx_binary
+{
+
+namespace
+{
+
+[[noreturn]] void fail(const std::string& what)
+{
+	throw std::runtime_error("mctx_binary: " + what);
+}
+
+// Unsigned integer holding the bits of a number on the wire
+template<typename T>
+using wire_t = std::make_unsigned_t<std::conditional_t<std::is_floating_point_v<T>, std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>, T>>;
+
+template<typename T>
+T to_big_endian(T value) noexcept
+{
+	if constexpr (std::endian::native == std::endian::little && sizeof(T) > 1)
+		return std::byteswap(value);
+	else
+		return value;
+}
+
+class writer
+{
+	std::vector<std::byte>& out;
+	const type_registry& types;
+
+	// Payloads of custom values are encoded here first, their header holds the size
+	std::vector<std::byte> payload;
+
+	void put(uint8_t tag)
+	{
+		this->out.push_back(static_cast<std::byte>(tag));
+	}
+
+	// Tag followed by the big endian bytes of the value
+	template<typename T>
+	void put(uint8_t tag, T value)
+	{
+		const auto bits = to_big_endian(std::bit_cast<wire_t<T>>(value));
+
+		const size_t at = this->out.size();
+		this->out.resize(at + 1 + sizeof(bits));
+		this->out[at] = static_cast<std::byte>(tag);
+		std::memcpy(this->out.data() + at + 1, &bits, sizeof(bits));
+	}
+
+	void put_bytes(const void* data, size_t size)
+	{
+		const auto* first = static_cast<const std::byte*>(data);
+		this->out.insert(this->out.end(), first, first + size);
+	}
+
+	// Header of a length prefixed item, fix is the tag of the short form (0 if there is none)
+	void put_length(size_t length, uint8_t fix, size_t fix_limit, uint8_t tag8, uint8_t tag16, uint8_t tag32)
+	{
+		if (fix != 0 && length < fix_limit)
+			this->put(static_cast<uint8_t>(fix | length));
+		else if (tag8 != 0 && length <= std::numeric_limits<uint8_t>::max())
+			this->put(tag8, static_cast<uint8_t>(length));
+		else if (length <= std::numeric_limits<uint16_t>::max())
+			this->put(tag16, static_cast<uint16_t>(length));
+		else if (length <= std::numeric_limits<uint32_t>::max())
+			this->put(tag32, static_cast<uint32_t>(length));
+		else
+			fail("item is too long");
+	}
+
+	void write_signed(int64_t v)
+	{
+		if (v >= -32 && v <= 127)
+			this->put(static_cast<uint8_t>(v));
+		else if (v >= std::numeric_limits<int8_t>::min() && v <= std::numeric_limits<int8_t>::max())
+			this->put(0xd0, static_cast<int8_t>(v));
+		else if (v >= std::numeric_limits<int16_t>::min() && v <= std::numeric_limits<int16_t>::max())
+			this->put(0xd1, static_cast<int16_t>(v));
+		else if (v >= std::numeric_limits<int32_t>::min() && v <= std::numeric_limits<int32_t>::max())
+			this->put(0xd2, static_cast<int32_t>(v));
+		else
+			this->put(0xd3, v);
+	}
+
+	// No fixint form, decoding reads those as signed
+	void write_unsigned(uint64_t v)
+	{
+		if (v <= std::numeric_limits<uint8_t>::max())
+			this->put(0xcc, static_cast<uint8_t>(v));
+		else if (v <= std::numeric_limits<uint16_t>::max())
+			this->put(0xcd, static_cast<uint16_t>(v));
+		else if (v <= std::numeric_limits<uint32_t>::max())
+			this->put(0xce, static_cast<uint32_t>(v));
+		else
+			this->put(0xcf, v);
+	}
+
+	void write_string(std::string_view v)
+	{
+		this->put_length(v.size(), 0xa0, 32, 0xd9, 0xda, 0xdb);
+		this->put_bytes(v.data(), v.size());
+	}
+
+	void write_custom(const details::custom_head& c)
+	{
+		if (c.empty())
+			return this->put(0xc0);
+
+		if (c.is<blob>())
+		{
+			const auto& bytes = c.as<blob>().bytes;
+			this->put_length(bytes.size(), 0, 0, 0xc4, 0xc5, 0xc6);
+			return this->put_bytes(bytes.data(), bytes.size());
+		}
+
+		const auto* codec = this->types.find(c.get_type());
+		if (codec == nullptr)
+			fail(std::string("no codec for custom type ") + c.get_type_name());
+
+		this->payload.clear();
+		codec->encode(c, this->payload);
+
+		const size_t size = this->payload.size();
+		switch (size)
+		{
+			case 1: this->put(0xd4); break;
+			case 2: this->put(0xd5); break;
+			case 4: this->put(0xd6); break;
+			case 8: this->put(0xd7); break;
+			case 16: this->put(0xd8); break;
+			default: this->put_length(size, 0, 0, 0xc7, 0xc8, 0xc9); break;
+		}
+
+		this->put(static_cast<uint8_t>(codec->code));
+		this->put_bytes(this->payload.data(), size);
+	}
+
+public:
+	writer(std::vector<std::byte>& out, const type_registry& types) noexcept :
+		out(out),
+		types(types) {}
+
+	void write(const mctx& value)
+	{
+		value.visit(dixelu::details::overloaded{
+			[this](const std::monostate&) { this->put(0xc0); },
+			[this](bool v) { this->put(v ? 0xc3 : 0xc2); },
+			[this](int64_t v) { this->write_signed(v); },
+			[this](uint64_t v) { this->write_unsigned(v); },
+			[this](float v) { this->put(0xca, v); },
+			[this](double v) { this->put(0xcb, v); },
+			[this](const std::string& v) { this->write_string(v); },
+			[this](const mctx_string_slice& v) { this->write_string(v.view()); },
+			[this](const mctx_array& a)
+			{
+				this->put_length(a.size(), 0x90, 16, 0, 0xdc, 0xdd);
+				for (const auto& item : a)
+					this->write(item);
+			},
+			[this](const mctx_packed_array& p)
+			{
+				std::visit([this](const auto& values)
+				{
+					this->put_length(values.size(), 0x90, 16, 0, 0xdc, 0xdd);
+					for (auto item : values)
+					{
+						if constexpr (std::is_same_v<decltype(item), bool>)
+							this->put(item ? 0xc3 : 0xc2);
+						else if constexpr (std::is_same_v<decltype(item), int64_t>)
+							this->write_signed(item);
+						else if constexpr (std::is_same_v<decltype(item), uint64_t>)
+							this->write_unsigned(item);
+						else
+							this->put(std::is_same_v<decltype(item), float> ? 0xca : 0xcb, item);
+					}
+				}, p.values());
+			},
+			[this](const mctx_object& o)
+			{
+				this->put_length(o.size(), 0x80, 16, 0, 0xde, 0xdf);
+				for (const auto& [key, item] : o)
+				{
+					this->write_string(key.view());
+					this->write(item);
+				}
+			},
+			[this](const details::custom_head& c) { this->write_custom(c); }
+		});
+	}
+};
+
+class reader
+{
+	std::span<const std::byte> data;
+	const type_registry& types;
+	size_t position = 0;
+
+	[[noreturn]] void fail(const char* what) const
+	{
+		mctx_binary::fail(std::string(what) + " at offset " + std::to_string(this->position));
+	}
+
+	std::span<const std::byte> take(size_t size)
+	{
+		if (size > this->data.size() - this->position)
+			this->fail("unexpected end of data");
+
+		auto bytes = this->data.subspan(this->position, size);
+		this->position += size;
+
+		return bytes;
+	}
+
+	template<typename T>
+	T take()
+	{
+		wire_t<T> bits;
+
+		std::memcpy(&bits, this->take(sizeof(bits)).data(), sizeof(bits));
+		return std::bit_cast<T>(to_big_endian(bits));
+	}
+
+	std::string_view take_string(size_t size)
+	{
+		const auto bytes = this->take(size);
+		return { reinterpret_cast<const char*>(bytes.data()), bytes.size() };
+	}
+
+	mctx read_array(size_t size)
+	{
+		mctx_array items;
+
+		// Every element takes at least a byte, so a corrupt size can't reserve much
+		items.reserve(std::min(size, this->data.size() - this->position));
+
+		for (size_t i = 0; i < size; ++i)
+			items.push_back(this->read());
+
+		return mctx(std::move(items));
+	}
+
+	mctx read_object(size_t size)
+	{
+		mctx_object items;
+		items.reserve(std::min(size, (this->data.size() - this->position) / 2));
+
+		for (size_t i = 0; i < size; ++i)
+		{
+			const auto tag = std::to_integer<uint8_t>(this->take(1)[0]);
+
+			size_t length = 0;
+			if ((tag & 0xe0) == 0xa0)
+				length = tag & 0x1f;
+			else if (tag == 0xd9)
+				length = this->take<uint8_t>();
+			else if (tag == 0xda)
+				length = this->take<uint16_t>();
+			else if (tag == 0xdb)
+				length = this->take<uint32_t>();
+			else
+				this->fail("object key is not a string");
+
+			mctx_key key(this->take_string(length));
+			items.insert_or_assign(std::move(key), this->read());
+		}
+
+		return mctx(std::move(items));
+	}
+
+	mctx read_blob(size_t size)
+	{
+		const auto bytes = this->take(size);
+		return mctx(blob{ { bytes.begin(), bytes.end() } });
+	}
+
+	mctx read_ext(size_t size)
+	{
+		const auto code = this->take<int8_t>();
+		const auto payload = this->take(size);
+
+		const auto* codec = this->types.find(code);
+		if (codec == nullptr)
+			this->fail("unknown ext code");
+
+		return codec->decode(payload);
+	}
+
+public:
+	reader(std::span<const std::byte> data, const type_registry& types) noexcept :
+		data(data),
+		types(types) {}
+
+	mctx read()
+	{
+		const auto tag = std::to_integer<uint8_t>(this->take(1)[0]);
+
+		if (tag <= 0x7f)
+			return mctx(static_cast<int64_t>(tag));
+		if (tag >= 0xe0)
+			return mctx(static_cast<int64_t>(static_cast<int8_t>(tag)));
+		if ((tag & 0xe0) == 0xa0)
+			return mctx(std::string(this->take_string(tag & 0x1f)));
+		if ((tag & 0xf0) == 0x90)
+			return this->read_array(tag & 0x0f);
+		if ((tag & 0xf0) == 0x80)
+			return this->read_object(tag & 0x0f);
+
+		switch (tag)
+		{
+			case 0xc0: return mctx(nullptr);
+			case 0xc2: return mctx(false);
+			case 0xc3: return mctx(true);
+			case 0xc4: return this->read_blob(this->take<uint8_t>());
+			case 0xc5: return this->read_blob(this->take<uint16_t>());
+			case 0xc6: return this->read_blob(this->take<uint32_t>());
+			case 0xc7: return this->read_ext(this->take<uint8_t>());
+			case 0xc8: return this->read_ext(this->take<uint16_t>());
+			case 0xc9: return this->read_ext(this->take<uint32_t>());
+			case 0xca: return mctx(this->take<float>());
+			case 0xcb: return mctx(this->take<double>());
+			case 0xcc: return mctx(static_cast<uint64_t>(this->take<uint8_t>()));
+			case 0xcd: return mctx(static_cast<uint64_t>(this->take<uint16_t>()));
+			case 0xce: return mctx(static_cast<uint64_t>(this->take<uint32_t>()));
+			case 0xcf: return mctx(this->take<uint64_t>());
+			case 0xd0: return mctx(static_cast<int64_t>(this->take<int8_t>()));
+			case 0xd1: return mctx(static_cast<int64_t>(this->take<int16_t>()));
+			case 0xd2: return mctx(static_cast<int64_t>(this->take<int32_t>()));
+			case 0xd3: return mctx(this->take<int64_t>());
+			case 0xd4: return this->read_ext(1);
+			case 0xd5: return this->read_ext(2);
+			case 0xd6: return this->read_ext(4);
+			case 0xd7: return this->read_ext(8);
+			case 0xd8: return this->read_ext(16);
+			case 0xd9: return mctx(std::string(this->take_string(this->take<uint8_t>())));
+			case 0xda: return mctx(std::string(this->take_string(this->take<uint16_t>())));
+			case 0xdb: return mctx(std::string(this->take_string(this->take<uint32_t>())));
+			case 0xdc: return this->read_array(this->take<uint16_t>());
+			case 0xdd: return this->read_array(this->take<uint32_t>());
+			case 0xde: return this->read_object(this->take<uint16_t>());
+			case 0xdf: return this->read_object(this->take<uint32_t>());
+			default: this->fail("invalid tag");
+		}
+	}
+
+	mctx read_all()
+	{
+		auto result = this->read();
+
+		if (this->position != this->data.size())
+			this->fail("unexpected trailing data");
+
+		return result;
+	}
+};
+
+} // namespace
+
+const type_registry::codec* type_registry::find(const std::type_info& type) const noexcept
+{
+	for (const auto& entry : this->codecs)
+		if (*entry.type == type)
+			return &entry;
+
+	return nullptr;
+}
+
+const type_registry::codec* type_registry::find(int8_t code) const noexcept
+{
+	for (const auto& entry : this->codecs)
+		if (entry.code == code)
+			return &entry;
+
+	return nullptr;
+}
+
+type_registry& type_registry::add(codec entry)
+{
+	if (entry.code < 0)
+		throw std::runtime_error("mctx_binary: ext codes below zero are reserved");
+
+	if (this->find(entry.code) != nullptr || this->find(*entry.type) != nullptr)
+		throw std::runtime_error("mctx_binary: type or ext code is already registered");
+
+	this->codecs.push_back(entry);
+	return *this;
+}
+
+void encode(const mctx& value, std::vector<std::byte>& out, const type_registry& types)
+{
+	writer(out, types).write(value);
+}
+
+std::vector<std::byte> encode(const mctx& value, const type_registry& types)
+{
+	std::vector<std::byte> out;
+	encode(value, out, types);
+	return out;
+}
+
+mctx decode(std::span<const std::byte> data, const type_registry& types)
+{
+	return reader(data, types).read_all();
+}
+
+} // namespace dixelu::mctx_binary
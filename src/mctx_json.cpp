@@ -1,55 +1,1335 @@
 #include "mctx_json.h"
 
-dixelu::mctx_json::json dixelu::mctx_json::serialize_mctx(const mctx& value)
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace dixelu::mctx_json
+{
+
+namespace
+{
+
+// Output straight into a string
+struct string_output
+{
+	std::string& target;
+
+	void put(char c) { this->target.push_back(c); }
+	void append(const char* data, size_t size) { this->target.append(data, size); }
+};
+
+// Output through a fixed size buffer that is handed to flush_to whenever it fills up
+template<typename Flush>
+class chunked_output
 {
-	if (value.is_none())
+	std::array<char, 16 * 1024> buffer;
+	size_t used = 0;
+	Flush flush_to;
+
+public:
+	explicit chunked_output(Flush flush_to) : flush_to(std::move(flush_to)) {}
+
+	void put(char c)
+	{
+		if (this->used == this->buffer.size())
+			this->flush();
+
+		this->buffer[this->used++] = c;
+	}
+
+	void append(const char* data, size_t size)
+	{
+		if (this->used + size > this->buffer.size())
+		{
+			this->flush();
+
+			if (size > this->buffer.size())
+			{
+				this->flush_to(data, size);
+				return;
+			}
+		}
+
+		std::copy_n(data, size, this->buffer.data() + this->used);
+		this->used += size;
+	}
+
+	void flush()
+	{
+		if (this->used != 0)
+			this->flush_to(this->buffer.data(), this->used);
+
+		this->used = 0;
+	}
+};
+
+// Length of the UTF-8 sequence starting at the position, throws if it's malformed
+size_t utf8_sequence(std::string_view text, size_t position, uint32_t& code_point)
+{
+	const auto lead = static_cast<unsigned char>(text[position]);
+
+	size_t length = 0;
+	uint32_t min_code_point = 0;
+
+	if ((lead & 0xE0) == 0xC0) { length = 2; code_point = lead & 0x1F; min_code_point = 0x80; }
+	else if ((lead & 0xF0) == 0xE0) { length = 3; code_point = lead & 0x0F; min_code_point = 0x800; }
+	else if ((lead & 0xF8) == 0xF0) { length = 4; code_point = lead & 0x07; min_code_point = 0x10000; }
+	else
+		throw std::runtime_error("Invalid UTF-8 byte in string");
+
+	if (position + length > text.size())
+		throw std::runtime_error("Incomplete UTF-8 sequence in string");
+
+	for (size_t i = 1; i < length; ++i)
+	{
+		const auto next = static_cast<unsigned char>(text[position + i]);
+		if ((next & 0xC0) != 0x80)
+			throw std::runtime_error("Invalid UTF-8 byte in string");
+
+		code_point = (code_point << 6) | (next & 0x3F);
+	}
+
+	if (code_point < min_code_point || code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF))
+		throw std::runtime_error("Invalid UTF-8 sequence in string");
+
+	return length;
+}
+
+// splitmix64 finalizer
+constexpr uint64_t mix_key(uint64_t key, uint64_t value) noexcept
+{
+	uint64_t x = key ^ (value + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2));
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+// One serialize_cache::write: looks containers up in the previous text, records them in the new one
+struct cache_pass
+{
+	// Container of the value being written
+	struct subtree
+	{
+		uint64_t key;
+		size_t nested;	// containers inside it recorded by scan
+		mctx::value_kind kind;
+		size_t elements;
+		bool kept;		// scan didn't go into it
+	};
+
+	const std::string& previous;
+	const std::vector<details::cached_span>& previous_spans;
+	const std::vector<size_t>& previous_index;
+	std::vector<details::cached_span>& spans;
+	std::vector<mctx>& kept;
+	size_t min_span_size;
+	bool pretty;
+
+	std::vector<subtree> subtrees;
+	size_t next_subtree = 0;
+	bool listed = true;	// the writer is in the part of the tree scan went through
+
+	/* Keys every container by the text it writes to. Stable nodes (see
+	 * mctx::stable_node) are keyed by their address and kept, so they
+	 * can't change until the next pass and the walk doesn't go into them.
+	 * The others are keyed by their contents: references held since the
+	 * last pass may have changed them.
+	 */
+	void scan(const mctx& value)
+	{
+		this->subtrees.clear();
+		this->next_subtree = 0;
+		this->listed = true;
+		this->key_of(value, true);
+	}
+
+	uint64_t key_of(const mctx& value, bool record)
+	{
+		// Every kind writes differently, so the index of the alternative is mixed in first
+		return value.visit(dixelu::details::overloaded{
+			[](const std::monostate&) { return mix_key(0, 0); },
+			[](bool v) { return mix_key(1, v); },
+			[](int64_t v) { return mix_key(2, static_cast<uint64_t>(v)); },
+			[](uint64_t v) { return mix_key(3, v); },
+			[](float v) { return mix_key(4, std::bit_cast<uint32_t>(v)); },
+			[](double v) { return mix_key(5, std::bit_cast<uint64_t>(v)); },
+			[&value](const std::string&) { return mix_key(6, value.hash()); },
+			[&value](const mctx_string_slice&) { return mix_key(6, value.hash()); },
+			[this, &value, record](const mctx_array& a)
+			{
+				if (const auto node = value.stable_node())
+					return this->keep(value, node, mctx::value_kind::array, a.size(), record);
+
+				const auto slot = this->open_subtree(record);
+
+				uint64_t key = 7;
+				for (const auto& item : a)
+					key = mix_key(key, this->key_of(item, record));
+
+				return this->close_subtree(slot, mix_key(key, a.size()), mctx::value_kind::array, a.size());
+			},
+			[this, &value, record](const mctx_packed_array& p)
+			{
+				if (const auto node = value.stable_node())
+					return this->keep(value, node, mctx::value_kind::packed_array, p.size(), record);
+
+				const auto slot = this->open_subtree(record);
+				const auto key = std::visit([](const auto& values)
+				{
+					using element = typename std::remove_cvref_t<decltype(values)>::value_type;
+
+					uint64_t key = 7;
+					for (const element item : values)
+					{
+						if constexpr (std::is_same_v<element, bool>)
+							key = mix_key(key, mix_key(1, item));
+						else if constexpr (std::is_same_v<element, float>)
+							key = mix_key(key, mix_key(4, std::bit_cast<uint32_t>(item)));
+						else if constexpr (std::is_same_v<element, double>)
+							key = mix_key(key, mix_key(5, std::bit_cast<uint64_t>(item)));
+						else if constexpr (std::is_signed_v<element>)
+							key = mix_key(key, mix_key(2, static_cast<uint64_t>(static_cast<int64_t>(item))));
+						else
+							key = mix_key(key, mix_key(3, static_cast<uint64_t>(item)));
+					}
+
+					return mix_key(key, values.size());
+				}, p.values());
+
+				return this->close_subtree(slot, key, mctx::value_kind::packed_array, p.size());
+			},
+			[this, &value, record](const mctx_object& o)
+			{
+				if (const auto node = value.stable_node())
+					return this->keep(value, node, mctx::value_kind::object, o.size(), record);
+
+				const auto slot = this->open_subtree(record);
+
+				uint64_t key = 8;
+				for (const auto& [name, item] : o)
+					key = mix_key(mix_key(key, name.hash()), this->key_of(item, record));
+
+				return this->close_subtree(slot, mix_key(key, o.size()), mctx::value_kind::object, o.size());
+			},
+			[](const dixelu::details::custom_head& c)
+			{
+				return mix_key(9, std::hash<std::string_view>()(c.get_type_name()));
+			}
+		});
+	}
+
+	/* The address is only reused once the node is freed, and a kept node
+	 * lives until the pass after the one that last met it. By then the
+	 * spans keyed by it are gone.
+	 */
+	uint64_t keep(const mctx& value, const void* node, mctx::value_kind kind, size_t elements, bool record)
+	{
+		const auto key = mix_key(10, reinterpret_cast<uintptr_t>(node));
+		if (record)
+		{
+			this->subtrees.push_back({ key, 0, kind, elements, true });
+			this->kept.push_back(value);
+		}
+
+		return key;
+	}
+
+	size_t open_subtree(bool record)
+	{
+		if (!record)
+			return std::numeric_limits<size_t>::max();
+
+		this->subtrees.push_back({ 0, 0, mctx::value_kind::none, 0, false });
+		return this->subtrees.size() - 1;
+	}
+
+	uint64_t close_subtree(size_t slot, uint64_t key, mctx::value_kind kind, size_t elements)
+	{
+		if (slot != std::numeric_limits<size_t>::max())
+			this->subtrees[slot] = { key, this->subtrees.size() - slot - 1, kind, elements, false };
+
+		return key;
+	}
+
+	/* The writer takes the subtrees in the order scan recorded them. Below
+	 * a kept node they're keyed as they come: the nodes there are stable too
+	 * (unless they're from another memory resource).
+	 */
+	subtree enter(const mctx& value)
+	{
+		if (this->listed)
+			return this->subtrees[this->next_subtree++];
+
+		return { this->key_of(value, false), 0, value.kind(), value.size(), true };
+	}
+
+	void skip(size_t nested) { this->next_subtree += nested; }
+
+	const details::cached_span* find(uint64_t key) const
+	{
+		if (this->previous_index.empty())
+			return nullptr;
+
+		const auto mask = this->previous_index.size() - 1;
+		for (auto slot = key & mask; this->previous_index[slot] != details::no_span; slot = (slot + 1) & mask)
+		{
+			const auto& span = this->previous_spans[this->previous_index[slot]];
+			if (span.key == key)
+				return &span;
+		}
+
 		return nullptr;
+	}
+
+	// Copies the previous output of the node, spans nested in it are carried over
+	bool reuse(const subtree& node, size_t depth, std::string& out)
+	{
+		const auto* span = this->find(node.key);
+		if (span == nullptr || span->kind != node.kind || span->elements != node.elements)
+			return false;
 
-	if (value.is<bool>())
-		return value.get<bool>();
+		if (this->pretty && span->depth != depth)
+			return false;
 
-	if (value.is<uint64_t>())
-		return value.get<uint64_t>();
+		const auto offset = out.size();
+		out.append(this->previous, span->offset, span->size);
 
-	if (value.is<int64_t>())
-		return value.get<int64_t>();
+		const auto end = span->offset + span->size;
+		for (auto nested = span; nested != this->previous_spans.data() + this->previous_spans.size() && nested->offset < end; ++nested)
+		{
+			this->spans.push_back(*nested);
+			this->spans.back().offset = nested->offset - span->offset + offset;
+		}
 
-	if (value.is<double>())
-		return value.get<double>();
+		return true;
+	}
 
-	if (value.is<float>())
-		return value.get<float>();
+	// Spans are opened before the children are written, so they stay ordered by offset
+	size_t open(const subtree& node, size_t offset, size_t depth)
+	{
+		this->spans.push_back({ node.key, offset, 0, depth, node.kind, node.elements });
+		return this->spans.size() - 1;
+	}
 
-	if (value.is<std::string>())
-		return value.get<std::string>();
+	void close(size_t span, size_t end) { this->spans[span].size = end - this->spans[span].offset; }
 
-	if (value.is_array())
+	// Drops the spans too small to be worth a lookup
+	void finish()
 	{
-		json arr = json::array();
-		for (const auto& item : value)
-			arr.push_back(serialize_mctx(item));
-		return arr;
+		std::erase_if(this->spans, [this](const details::cached_span& span) { return span.size < this->min_span_size; });
 	}
+};
 
-	if (value.is_object())
+template<typename Output>
+class json_writer
+{
+	Output& out;
+	const write_options& options;
+	std::string indentation;
+	cache_pass* cache;
+
+	void write_indent(size_t depth)
 	{
-		json obj = json::object();
-		for (auto it = value.kvbegin(); it != value.kvend(); ++it)
-			obj[it->first] = serialize_mctx(it->second);
-		return obj;
+		const auto size = depth * static_cast<size_t>(this->options.indent);
+		if (this->indentation.size() < size)
+			this->indentation.resize(size * 2, this->options.indent_char);
+
+		this->out.put('\n');
+		this->out.append(this->indentation.data(), size);
+	}
+
+	template<typename T>
+	void write_number(T value)
+	{
+		std::array<char, 32> text;
+		auto [end, ec] = std::to_chars(text.data(), text.data() + text.size(), value);
+		this->out.append(text.data(), end - text.data());
+	}
+
+	template<std::floating_point T>
+	void write_number(T value)
+	{
+		if (!std::isfinite(value))
+		{
+			this->out.append("null", 4);
+			return;
+		}
+
+		// Shortest digits that read back as the same value
+		std::array<char, 32> text;
+		auto [end, ec] = std::to_chars(text.data(), text.data() + text.size(), value, std::chars_format::scientific);
+
+		const auto* mark = std::find(text.data(), end, 'e');
+		int exponent = 0;
+		std::from_chars(mark + (mark[1] == '+' ? 2 : 1), end, exponent);
+
+		// Laid out like json::dump: exponent notation below 1e-4 and from 1e15 on, written as to_chars gives it
+		if (exponent < -4 || exponent > 14)
+		{
+			this->out.append(text.data(), end - text.data());
+			return;
+		}
+
+		const auto* first = text.data();
+		if (*first == '-')
+			this->out.put(*first++);
+
+		std::array<char, 32> digits;
+		const auto count = static_cast<size_t>(std::remove_copy(first, mark, digits.data(), '.') - digits.data());
+
+		// Integral values keep a fraction so they read back as floating
+		static constexpr char zeros[] = "00000000000000";
+		const auto point = exponent + 1;
+		if (point <= 0)
+		{
+			this->out.append("0.", 2);
+			this->out.append(zeros, static_cast<size_t>(-point));
+			this->out.append(digits.data(), count);
+		}
+		else if (count <= static_cast<size_t>(point))
+		{
+			this->out.append(digits.data(), count);
+			this->out.append(zeros, static_cast<size_t>(point) - count);
+			this->out.append(".0", 2);
+		}
+		else
+		{
+			this->out.append(digits.data(), static_cast<size_t>(point));
+			this->out.put('.');
+			this->out.append(digits.data() + point, count - static_cast<size_t>(point));
+		}
+	}
+
+	void write_unicode_escape(uint32_t code_unit)
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+		const char text[] = {
+			'\\', 'u',
+			hex[(code_unit >> 12) & 0xF], hex[(code_unit >> 8) & 0xF],
+			hex[(code_unit >> 4) & 0xF], hex[code_unit & 0xF]
+		};
+		this->out.append(text, sizeof(text));
 	}
 
-	// Handle custom types - serialize as string with type info
-	if (value.is<details::custom_head>())
+	void write_string(std::string_view text)
 	{
-		const auto& custom_val = value.as<details::custom_head>();
-		return json::object({
-			{"__custom_type", custom_val.get_type_name()},
-			{"value", "[unserializable]"} // Custom types need special handling
+		this->out.put('"');
+
+		// Bytes that don't need escaping are written in runs
+		size_t run_begin = 0;
+		size_t position = 0;
+
+		auto flush_run = [&]()
+		{
+			this->out.append(text.data() + run_begin, position - run_begin);
+		};
+
+		while (position < text.size())
+		{
+			bool non_ascii = false;
+			const auto run_end = position + details::scan_string(text.substr(position), non_ascii);
+
+			if (non_ascii && !this->options.ensure_ascii)
+			{
+				if (!details::validate_utf8(text.substr(position, run_end - position)))
+					throw std::runtime_error("Invalid UTF-8 sequence in string");
+			}
+			else if (non_ascii)
+			{
+				// Escaping non-ASCII goes code point by code point
+				while (position < run_end)
+				{
+					const auto c = static_cast<unsigned char>(text[position]);
+					if (c < 0x80)
+					{
+						++position;
+						continue;
+					}
+
+					flush_run();
+
+					uint32_t code_point = 0;
+					const auto length = utf8_sequence(text, position, code_point);
+
+					if (code_point <= 0xFFFF)
+						this->write_unicode_escape(code_point);
+					else
+					{
+						code_point -= 0x10000;
+						this->write_unicode_escape(0xD800 + (code_point >> 10));
+						this->write_unicode_escape(0xDC00 + (code_point & 0x3FF));
+					}
+
+					position += length;
+					run_begin = position;
+				}
+			}
+
+			position = run_end;
+			if (position == text.size())
+				break;
+
+			flush_run();
+
+			switch (const auto c = static_cast<unsigned char>(text[position]))
+			{
+				case '"': this->out.append("\\\"", 2); break;
+				case '\\': this->out.append("\\\\", 2); break;
+				case '\b': this->out.append("\\b", 2); break;
+				case '\f': this->out.append("\\f", 2); break;
+				case '\n': this->out.append("\\n", 2); break;
+				case '\r': this->out.append("\\r", 2); break;
+				case '\t': this->out.append("\\t", 2); break;
+				default: this->write_unicode_escape(c); break;
+			}
+
+			++position;
+			run_begin = position;
+		}
+
+		flush_run();
+		this->out.put('"');
+	}
+
+	template<typename Range, typename F>
+	void write_sequence(char open, char close, const Range& range, size_t depth, F&& write_item)
+	{
+		this->out.put(open);
+
+		if (std::begin(range) == std::end(range))
+		{
+			this->out.put(close);
+			return;
+		}
+
+		bool first = true;
+		for (const auto& item : range)
+		{
+			if (!first)
+				this->out.put(',');
+
+			if (this->options.indent >= 0)
+				this->write_indent(depth + 1);
+
+			write_item(item);
+			first = false;
+		}
+
+		if (this->options.indent >= 0)
+			this->write_indent(depth);
+
+		this->out.put(close);
+	}
+
+	void write_key(std::string_view key)
+	{
+		this->write_string(key);
+
+		if (this->options.indent >= 0)
+			this->out.append(": ", 2);
+		else
+			this->out.put(':');
+	}
+
+public:
+	json_writer(Output& out, const write_options& options, cache_pass* cache = nullptr) :
+		out(out),
+		options(options),
+		cache(cache) {}
+
+	void write(const mctx& value, size_t depth = 0)
+	{
+		if constexpr (std::is_same_v<Output, string_output>)
+		{
+			if (this->cache != nullptr && (value.is_array() || value.is_object()))
+			{
+				const auto subtree = this->cache->enter(value);
+				if (this->cache->reuse(subtree, depth, this->out.target))
+				{
+					this->cache->skip(subtree.nested);
+					return;
+				}
+
+				const auto listed = this->cache->listed;
+				this->cache->listed = listed && !subtree.kept;
+
+				const auto span = this->cache->open(subtree, this->out.target.size(), depth);
+				this->write_value(value, depth);
+				this->cache->close(span, this->out.target.size());
+
+				this->cache->listed = listed;
+
+				return;
+			}
+		}
+
+		this->write_value(value, depth);
+	}
+
+	void write_value(const mctx& value, size_t depth)
+	{
+		value.visit(dixelu::details::overloaded{
+			[this](const std::monostate&) { this->out.append("null", 4); },
+			[this](bool v) { v ? this->out.append("true", 4) : this->out.append("false", 5); },
+			[this](int64_t v) { this->write_number(v); },
+			[this](uint64_t v) { this->write_number(v); },
+			[this](float v) { this->write_number(v); },
+			[this](double v) { this->write_number(v); },
+			[this](const std::string& v) { this->write_string(v); },
+			[this](const mctx_string_slice& v) { this->write_string(v.view()); },
+			[this, depth](const mctx_array& a)
+			{
+				this->write_sequence('[', ']', a, depth, [&](const mctx& item) { this->write(item, depth + 1); });
+			},
+			[this, depth](const mctx_packed_array& p)
+			{
+				std::visit([&](const auto& values)
+				{
+					this->write_sequence('[', ']', values, depth, [&](auto item)
+					{
+						if constexpr (std::is_same_v<decltype(item), bool>)
+							item ? this->out.append("true", 4) : this->out.append("false", 5);
+						else
+							this->write_number(item);
+					});
+				}, p.values());
+			},
+			[this, depth](const mctx_object& o)
+			{
+				this->write_sequence('{', '}', o, depth, [&](const mctx_object::value_type& item)
+				{
+					this->write_key(item.first);
+					this->write(item.second, depth + 1);
+				});
+			},
+			[this, depth](const dixelu::details::custom_head& c)
+			{
+				// Same shape as serialize_mctx gives to custom values
+				const std::array<std::pair<std::string_view, std::string_view>, 2> marker = {{
+					{ "__custom_type", c.get_type_name() },
+					{ "value", "[unserializable]" }
+				}};
+
+				this->write_sequence('{', '}', marker, depth, [&](const auto& item)
+				{
+					this->write_key(item.first);
+					this->write_string(item.second);
+				});
+			}
 		});
 	}
+};
+
+/* Recursive descent parser building mctx nodes straight from the text.
+ * Elements of the containers being parsed are collected on shared scratch
+ * stacks, so every array and object is allocated once with its final size.
+ */
+class json_reader
+{
+	// Strings shorter than that are copied even if slices are allowed, they would fit into std::string itself
+	static constexpr size_t slice_min_length = 16;
+
+	// Containers with less text than that are built right away, a lazy node wouldn't be smaller
+	static constexpr size_t lazy_min_length = 64;
+
+	std::string_view text;
+	std::shared_ptr<const void> owner;
+	size_t position = 0;
+
+	// Containers below the root become lazy nodes when set
+	bool lazy = false;
+	size_t depth = 0;
+
+	std::vector<mctx> elements;
+	std::vector<std::pair<mctx_key, mctx>> members;
+	std::string key_buffer;
+
+	[[noreturn]] void fail(const char* what) const
+	{
+		throw std::runtime_error("JSON parse error at offset " + std::to_string(this->position) + ": " + what);
+	}
+
+	void skip_whitespace() noexcept
+	{
+		while (this->position < this->text.size())
+		{
+			const char c = this->text[this->position];
+			if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+				break;
+
+			++this->position;
+		}
+	}
+
+	[[nodiscard]] char peek() const noexcept
+	{
+		return this->position < this->text.size() ? this->text[this->position] : '\0';
+	}
+
+	void expect_literal(std::string_view literal)
+	{
+		if (this->text.substr(this->position, literal.size()) != literal)
+			this->fail("invalid literal");
+
+		this->position += literal.size();
+	}
+
+	mctx parse_number()
+	{
+		const size_t begin = this->position;
+		bool is_integer = true;
+
+		auto skip_digits = [this]()
+		{
+			const size_t first = this->position;
+			while (this->position < this->text.size() && this->text[this->position] >= '0' && this->text[this->position] <= '9')
+				++this->position;
+
+			return this->position - first;
+		};
+
+		if (this->peek() == '-')
+			++this->position;
+
+		if (this->peek() == '0')
+			++this->position;
+		else if (skip_digits() == 0)
+			this->fail("invalid number");
+
+		if (this->peek() == '.')
+		{
+			++this->position;
+			is_integer = false;
+
+			if (skip_digits() == 0)
+				this->fail("invalid number");
+		}
+
+		if (this->peek() == 'e' || this->peek() == 'E')
+		{
+			++this->position;
+			is_integer = false;
+
+			if (this->peek() == '+' || this->peek() == '-')
+				++this->position;
+
+			if (skip_digits() == 0)
+				this->fail("invalid number");
+		}
+
+		const char* first = this->text.data() + begin;
+		const char* last = this->text.data() + this->position;
+
+		// Integers that don't fit into 64 bits are read as doubles, same as json::parse does
+		if (is_integer)
+		{
+			if (*first == '-')
+			{
+				int64_t value = 0;
+				if (auto [ptr, ec] = std::from_chars(first, last, value); ec == std::errc{})
+					return mctx(value);
+			}
+			else
+			{
+				uint64_t value = 0;
+				if (auto [ptr, ec] = std::from_chars(first, last, value); ec == std::errc{})
+					return mctx(value);
+			}
+		}
+
+		double value = 0;
+		auto [ptr, ec] = std::from_chars(first, last, value);
+		if (ec != std::errc{} || !std::isfinite(value))
+			this->fail("number overflow");
+
+		return mctx(value);
+	}
+
+	uint32_t parse_hex4()
+	{
+		if (this->position + 4 > this->text.size())
+			this->fail("incomplete unicode escape");
+
+		uint32_t value = 0;
+		auto [ptr, ec] = std::from_chars(this->text.data() + this->position, this->text.data() + this->position + 4, value, 16);
+		if (ec != std::errc{} || ptr != this->text.data() + this->position + 4)
+			this->fail("invalid unicode escape");
+
+		this->position += 4;
+		return value;
+	}
+
+	void parse_escape(std::string& out)
+	{
+		if (++this->position >= this->text.size())
+			this->fail("unterminated string");
+
+		const char c = this->text[this->position++];
+		switch (c)
+		{
+			case '"': out.push_back('"'); return;
+			case '\\': out.push_back('\\'); return;
+			case '/': out.push_back('/'); return;
+			case 'b': out.push_back('\b'); return;
+			case 'f': out.push_back('\f'); return;
+			case 'n': out.push_back('\n'); return;
+			case 'r': out.push_back('\r'); return;
+			case 't': out.push_back('\t'); return;
+			case 'u': break;
+			default: this->fail("invalid escape");
+		}
+
+		uint32_t code_point = this->parse_hex4();
+
+		if (code_point >= 0xDC00 && code_point <= 0xDFFF)
+			this->fail("unpaired surrogate");
+
+		if (code_point >= 0xD800 && code_point <= 0xDBFF)
+		{
+			if (this->text.substr(this->position, 2) != "\\u")
+				this->fail("unpaired surrogate");
+
+			this->position += 2;
+			const uint32_t low = this->parse_hex4();
+			if (low < 0xDC00 || low > 0xDFFF)
+				this->fail("unpaired surrogate");
+
+			code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+		}
+
+		details::append_utf8(out, code_point);
+	}
+
+	std::string parse_string()
+	{
+		std::string result;
+		this->parse_string(result);
+		return result;
+	}
+
+	// Keys without escapes are viewed straight in the text, the others are decoded into key_buffer
+	std::string_view read_key()
+	{
+		const size_t begin = this->position + 1;
+
+		bool non_ascii = false;
+		const auto end = begin + details::scan_string(this->text.substr(begin), non_ascii);
+
+		if (end < this->text.size() && this->text[end] == '"')
+		{
+			if (non_ascii && !details::validate_utf8(this->text.substr(begin, end - begin)))
+				this->fail("invalid UTF-8 in string");
+
+			this->position = end + 1;
+			return this->text.substr(begin, end - begin);
+		}
+
+		this->key_buffer.clear();
+		this->parse_string(this->key_buffer);
+		return this->key_buffer;
+	}
+
+	mctx_key parse_key()
+	{
+		return mctx_key(this->read_key());
+	}
+
+	void parse_string(std::string& result)
+	{
+		++this->position;
+
+		size_t run_begin = this->position;
+
+		while (true)
+		{
+			if (this->position >= this->text.size())
+				this->fail("unterminated string");
+
+			bool non_ascii = false;
+			const auto run_end = this->position + details::scan_string(this->text.substr(this->position), non_ascii);
+
+			if (non_ascii && !details::validate_utf8(this->text.substr(this->position, run_end - this->position)))
+				this->fail("invalid UTF-8 in string");
+
+			this->position = run_end;
+			if (this->position >= this->text.size())
+				this->fail("unterminated string");
+
+			const char c = this->text[this->position];
+
+			if (c == '"')
+			{
+				result.append(this->text.data() + run_begin, this->position - run_begin);
+				++this->position;
+				return;
+			}
+
+			if (c != '\\')
+				this->fail("control character in string");
+
+			result.append(this->text.data() + run_begin, this->position - run_begin);
+			this->parse_escape(result);
+			run_begin = this->position;
+		}
+	}
+
+	// Strings without escapes become slices of the text when it has an owner
+	mctx parse_string_value()
+	{
+		if (this->owner != nullptr)
+		{
+			const size_t begin = this->position + 1;
+
+			bool non_ascii = false;
+			const auto end = begin + details::scan_string(this->text.substr(begin), non_ascii);
+
+			if (end < this->text.size() && this->text[end] == '"' && end - begin >= slice_min_length)
+			{
+				if (non_ascii && !details::validate_utf8(this->text.substr(begin, end - begin)))
+					this->fail("invalid UTF-8 in string");
+
+				this->position = end + 1;
+				return mctx(mctx_string_slice(this->owner, this->text.substr(begin, end - begin)));
+			}
+		}
+
+		return mctx(this->parse_string());
+	}
+
+	mctx parse_array()
+	{
+		++this->position;
+		const size_t base = this->elements.size();
+
+		this->skip_whitespace();
+		if (this->peek() == ']')
+			++this->position;
+		else
+		{
+			while (true)
+			{
+				this->elements.push_back(this->parse_value());
+
+				this->skip_whitespace();
+				const char c = this->peek();
+				++this->position;
+
+				if (c == ']')
+					break;
+
+				if (c != ',')
+					this->fail("expected ',' or ']'");
+			}
+		}
+
+		mctx_array items;
+		items.reserve(this->elements.size() - base);
+
+		auto first = this->elements.begin() + static_cast<ptrdiff_t>(base);
+		items.insert(items.end(), std::make_move_iterator(first), std::make_move_iterator(this->elements.end()));
+		this->elements.erase(first, this->elements.end());
+
+		return mctx(std::move(items));
+	}
+
+	mctx parse_object()
+	{
+		++this->position;
+		const size_t base = this->members.size();
+
+		this->skip_whitespace();
+		if (this->peek() == '}')
+			++this->position;
+		else
+		{
+			while (true)
+			{
+				this->skip_whitespace();
+				if (this->peek() != '"')
+					this->fail("expected object key");
+
+				auto key = this->parse_key();
+
+				this->skip_whitespace();
+				if (this->peek() != ':')
+					this->fail("expected ':'");
+				++this->position;
+
+				this->members.emplace_back(std::move(key), this->parse_value());
+
+				this->skip_whitespace();
+				const char c = this->peek();
+				++this->position;
+
+				if (c == '}')
+					break;
+
+				if (c != ',')
+					this->fail("expected ',' or '}'");
+			}
+		}
+
+		auto first = this->members.begin() + static_cast<ptrdiff_t>(base);
+
+		// Custom values can't be read back, see serialize_mctx
+		const bool is_custom = std::any_of(first, this->members.end(), [](const auto& member) { return member.first == "__custom_type"; });
+
+		mctx result;
+		if (!is_custom)
+		{
+			mctx_object items;
+			items.reserve(this->members.size() - base);
+
+			// Last duplicate wins
+			for (auto member = first; member != this->members.end(); ++member)
+				items.insert_or_assign(std::move(member->first), std::move(member->second));
+
+			result = mctx(std::move(items));
+		}
+
+		this->members.erase(first, this->members.end());
+		return result;
+	}
+
+	// Moves past the string at the current position without decoding it
+	void skip_string()
+	{
+		++this->position;
+
+		while (true)
+		{
+			bool non_ascii = false;
+			this->position += details::scan_string(this->text.substr(this->position), non_ascii);
+
+			if (this->position >= this->text.size())
+				this->fail("unterminated string");
+
+			const char end = this->text[this->position++];
+			if (end == '"')
+				return;
+
+			if (end != '\\')
+				this->fail("control character in string");
+
+			// The escaped character can't be the end of the text
+			if (this->position >= this->text.size())
+				this->fail("unterminated string");
+
+			++this->position;
+		}
+	}
+
+	/* Moves past the container at the current position, only looking at
+	 * brackets and string boundaries. The rest is checked when the text is
+	 * parsed for real.
+	 */
+	void skip_container()
+	{
+		size_t nesting = 0;
+
+		while (this->position < this->text.size())
+		{
+			const char c = this->text[this->position];
+
+			if (c == '"')
+			{
+				this->skip_string();
+				continue;
+			}
+
+			++this->position;
+
+			if (c == '{' || c == '[')
+				++nesting;
+			else if (c == '}' || c == ']')
+			{
+				if (--nesting == 0)
+					return;
+			}
+		}
+
+		this->fail("unterminated container");
+	}
+
+	// Moves past any value, scalars other than strings end at the next delimiter
+	void skip_value()
+	{
+		this->skip_whitespace();
+
+		switch (this->peek())
+		{
+			case '{':
+			case '[':
+				return this->skip_container();
+			case '"':
+				return this->skip_string();
+			case ',':
+			case '}':
+			case ']':
+			case '\0':
+				this->fail("unexpected character");
+			default:
+				break;
+		}
+
+		while (this->position < this->text.size())
+		{
+			const char c = this->text[this->position];
+			if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\n' || c == '\r' || c == '\t')
+				break;
+
+			++this->position;
+		}
+	}
+
+	/* Builds the parts of the value the projection node keeps. Members and
+	 * elements that don't match are skipped without being built, as are
+	 * scalars where the projection expects a container. Index steps are
+	 * ignored for arrays reached by applying keys to elements.
+	 */
+	mctx parse_projected(const projection& keep, size_t node_index, bool keys_only = false)
+	{
+		const auto& node = keep.nodes()[node_index];
+		if (node.keep_all)
+			return this->parse_value();
+
+		this->skip_whitespace();
+		const char open = this->peek();
+
+		if (open != '{' && open != '[')
+		{
+			this->skip_value();
+			return mctx();
+		}
+
+		const char close = open == '{' ? '}' : ']';
+		mctx_object members;
+		mctx_array elements;
+		++this->position;
+
+		this->skip_whitespace();
+		if (this->peek() == close)
+		{
+			++this->position;
+			return open == '{' ? mctx::make_object() : mctx::make_array();
+		}
+
+		for (size_t index = 0; ; ++index)
+		{
+			const size_t* child = nullptr;
+			const mctx_key* key = nullptr;
+
+			if (open == '{')
+			{
+				this->skip_whitespace();
+				if (this->peek() != '"')
+					this->fail("expected object key");
+
+				const auto name = this->read_key();
+				for (const auto& [child_key, child_index] : node.keys)
+				{
+					if (child_key.view() == name)
+					{
+						key = &child_key;
+						child = &child_index;
+						break;
+					}
+				}
+
+				this->skip_whitespace();
+				if (this->peek() != ':')
+					this->fail("expected ':'");
+				++this->position;
+			}
+			else
+			{
+				for (const auto& [child_position, child_index] : node.indices)
+				{
+					if (!keys_only && child_position == index)
+					{
+						child = &child_index;
+						break;
+					}
+				}
+
+				// Keys apply to every element of an array on their way
+				if (child == nullptr && !node.keys.empty())
+					child = &node_index;
+			}
+
+			this->skip_whitespace();
+			const char c = this->peek();
+
+			if (child == nullptr || (!keep.nodes()[*child].keep_all && c != '{' && c != '['))
+				this->skip_value();
+			else if (key != nullptr)
+				members.insert_or_assign(*key, this->parse_projected(keep, *child));
+			else
+				elements.push_back(this->parse_projected(keep, *child, child == &node_index));
+
+			this->skip_whitespace();
+			const char next = this->peek();
+			++this->position;
+
+			if (next == close)
+				break;
+
+			if (next != ',')
+				this->fail(open == '{' ? "expected ',' or '}'" : "expected ',' or ']'");
+		}
+
+		return open == '{' ? mctx(std::move(members)) : mctx(std::move(elements));
+	}
+
+	static mctx build_lazy(const std::shared_ptr<const void>& owner, std::string_view text)
+	{
+		return json_reader(text, owner, true).parse();
+	}
+
+	mctx parse_container()
+	{
+		const size_t begin = this->position;
+
+		if (this->lazy && this->depth > 0)
+		{
+			this->skip_container();
+
+			if (this->position - begin >= lazy_min_length)
+				return mctx(mctx_lazy(this->owner, this->text.substr(begin, this->position - begin), &json_reader::build_lazy));
+
+			this->position = begin;
+		}
+
+		++this->depth;
+		auto result = this->peek() == '{' ? this->parse_object() : this->parse_array();
+		--this->depth;
+
+		return result;
+	}
+
+	mctx parse_value()
+	{
+		this->skip_whitespace();
+
+		switch (this->peek())
+		{
+			case '{':
+			case '[':
+				return this->parse_container();
+			case '"': return this->parse_string_value();
+			case 't': this->expect_literal("true"); return mctx(true);
+			case 'f': this->expect_literal("false"); return mctx(false);
+			case 'n': this->expect_literal("null"); return mctx(nullptr);
+			case '-':
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
+				return this->parse_number();
+			default:
+				this->fail("unexpected character");
+		}
+	}
+
+public:
+	explicit json_reader(std::string_view text, std::shared_ptr<const void> owner = nullptr, bool lazy = false) :
+		text(text),
+		owner(std::move(owner)),
+		lazy(lazy) {}
+
+	mctx parse(const projection& keep)
+	{
+		auto result = this->parse_projected(keep, 0);
+
+		this->skip_whitespace();
+		if (this->position != this->text.size())
+			this->fail("unexpected trailing characters");
+
+		return result;
+	}
+
+	mctx parse()
+	{
+		auto result = this->parse_value();
+
+		this->skip_whitespace();
+		if (this->position != this->text.size())
+			this->fail("unexpected trailing characters");
+
+		return result;
+	}
+};
+
+template<typename Flush>
+void write_chunked(const mctx& value, const write_options& options, Flush flush_to)
+{
+	chunked_output<Flush> out(std::move(flush_to));
+	json_writer<chunked_output<Flush>>(out, options).write(value);
+	out.flush();
+}
 
-	throw std::runtime_error("Unsupported type for JSON serialization");
+}
+
+} // namespace dixelu::mctx_json
+
+dixelu::mctx_json::json dixelu::mctx_json::serialize_mctx(const mctx& value)
+{
+	return value.visit(dixelu::details::overloaded{
+		[](const std::monostate&) -> json { return nullptr; },
+		[](bool v) -> json { return v; },
+		[](int64_t v) -> json { return v; },
+		[](uint64_t v) -> json { return v; },
+		[](float v) -> json { return v; },
+		[](double v) -> json { return v; },
+		[](const std::string& v) -> json { return v; },
+		[](const mctx_string_slice& v) -> json { return v.view(); },
+		[](const mctx_array& a) -> json
+		{
+			json arr = json::array();
+			for (const auto& item : a)
+				arr.push_back(serialize_mctx(item));
+			return arr;
+		},
+		[](const mctx_packed_array& p) -> json
+		{
+			json arr = json::array();
+			std::visit([&arr](const auto& values)
+			{
+				for (auto item : values)
+					arr.push_back(item);
+			}, p.values());
+			return arr;
+		},
+		[](const mctx_object& o) -> json
+		{
+			json obj = json::object();
+			for (const auto& [key, item] : o)
+				obj[key.str()] = serialize_mctx(item);
+			return obj;
+		},
+		// Handle custom types - serialize as string with type info
+		[](const dixelu::details::custom_head& c) -> json
+		{
+			return json::object({
+				{"__custom_type", c.get_type_name()},
+				{"value", "[unserializable]"} // Custom types need special handling
+			});
+		}
+	});
 }
 
 dixelu::mctx dixelu::mctx_json::deserialize_mctx(const json& j)
@@ -107,17 +1387,218 @@ dixelu::mctx dixelu::mctx_json::deserialize_mctx(const json& j)
 	throw std::runtime_error("Unknown JSON type during deserialization");
 }
 
+void dixelu::mctx_json::write(const mctx& value, std::string& out, const write_options& options)
+{
+	string_output output{ out };
+	json_writer<string_output>(output, options).write(value);
+}
+
+void dixelu::mctx_json::write(const mctx& value, std::ostream& out, const write_options& options)
+{
+	write_chunked(value, options, [&out](const char* data, size_t size)
+	{
+		out.write(data, static_cast<std::streamsize>(size));
+	});
+}
+
+void dixelu::mctx_json::write(const mctx& value, int fd, const write_options& options)
+{
+	write_chunked(value, options, [fd](const char* data, size_t size)
+	{
+		while (size != 0)
+		{
+#ifdef _WIN32
+			auto written = ::_write(fd, data, static_cast<unsigned>(size));
+#else
+			auto written = ::write(fd, data, size);
+#endif
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				throw std::runtime_error("Failed to write json to file descriptor");
+			}
+
+			data += written;
+			size -= static_cast<size_t>(written);
+		}
+	});
+}
+
+dixelu::mctx_json::serialize_cache::serialize_cache(write_options options, size_t min_span_size) :
+	settings(options),
+	min_span_size(min_span_size) {}
+
+const std::string& dixelu::mctx_json::serialize_cache::write(const mctx& value)
+{
+	std::string next;
+	next.reserve(this->text.size());
+
+	std::vector<details::cached_span> next_spans;
+	next_spans.reserve(this->spans.size());
+
+	// The nodes kept by the last pass stay alive until this one is done
+	std::vector<mctx> next_kept;
+	next_kept.reserve(this->kept.size());
+
+	cache_pass pass{
+		.previous = this->text,
+		.previous_spans = this->spans,
+		.previous_index = this->index,
+		.spans = next_spans,
+		.kept = next_kept,
+		.min_span_size = this->min_span_size,
+		.pretty = this->settings.indent >= 0,
+		.subtrees = {},
+		.next_subtree = 0,
+		.listed = true
+	};
+	pass.scan(value);
+
+	string_output output{ next };
+	json_writer<string_output>(output, this->settings, &pass).write(value);
+	pass.finish();
+
+	// Open addressing on the low bits of the keys, at most half full. Spans with a key that's in already stay out
+	this->index.assign(std::bit_ceil(next_spans.size() * 2 + 1), details::no_span);
+	const auto mask = this->index.size() - 1;
+	for (size_t i = 0; i < next_spans.size(); ++i)
+	{
+		auto slot = next_spans[i].key & mask;
+		while (this->index[slot] != details::no_span && next_spans[this->index[slot]].key != next_spans[i].key)
+			slot = (slot + 1) & mask;
+
+		if (this->index[slot] == details::no_span)
+			this->index[slot] = i;
+	}
+
+	this->text = std::move(next);
+	this->spans = std::move(next_spans);
+	this->kept = std::move(next_kept);
+
+	return this->text;
+}
+
+const dixelu::mctx_json::write_options& dixelu::mctx_json::serialize_cache::options() const noexcept
+{
+	return this->settings;
+}
+
+void dixelu::mctx_json::serialize_cache::clear() noexcept
+{
+	this->text.clear();
+	this->spans.clear();
+	this->index.clear();
+	this->kept.clear();
+}
+
 std::string dixelu::mctx_json::serialize(const mctx& value)
 {
-	return serialize_mctx(value).dump();
+	std::string result;
+	write(value, result);
+	return result;
 }
 
 std::string dixelu::mctx_json::serialize_pretty(const mctx& value)
 {
-	return serialize_mctx(value).dump(1, '\t', true);
+	std::string result;
+	write(value, result, write_options{ 1, '\t', true });
+	return result;
+}
+
+dixelu::mctx dixelu::mctx_json::parse(std::string_view text)
+{
+	return json_reader(text).parse();
+}
+
+dixelu::mctx dixelu::mctx_json::parse(std::string_view text, const projection& keep)
+{
+	return json_reader(text).parse(keep);
+}
+
+dixelu::mctx dixelu::mctx_json::parse_shared(std::shared_ptr<const std::string> text)
+{
+	const std::string_view view = *text;
+	return json_reader(view, std::move(text)).parse();
+}
+
+dixelu::mctx dixelu::mctx_json::parse_shared(std::string text)
+{
+	return parse_shared(std::make_shared<const std::string>(std::move(text)));
+}
+
+dixelu::mctx dixelu::mctx_json::parse_lazy(std::shared_ptr<const std::string> text)
+{
+	const std::string_view view = *text;
+	return json_reader(view, std::move(text), true).parse();
+}
+
+dixelu::mctx dixelu::mctx_json::parse_lazy(std::string text)
+{
+	return parse_lazy(std::make_shared<const std::string>(std::move(text)));
 }
 
 dixelu::mctx dixelu::mctx_json::deserialize(const std::string& json_str)
 {
-	return deserialize_mctx(json::parse(json_str));
+	return parse(json_str);
+}
+
+dixelu::mctx dixelu::mctx_json::deserialize(const std::string& json_str, const projection& keep)
+{
+	return parse(json_str, keep);
+}
+
+dixelu::mctx_json::projection::projection() :
+	tree(1) {}
+
+dixelu::mctx_json::projection::projection(std::initializer_list<mctx_path> paths) :
+	projection()
+{
+	for (const auto& path : paths)
+		this->add(path);
+}
+
+dixelu::mctx_json::projection& dixelu::mctx_json::projection::add(const mctx_path& path)
+{
+	size_t current = 0;
+
+	for (const auto& segment : path.segments())
+	{
+		if (this->tree[current].keep_all)
+			return *this;
+
+		// Found or appended child, tree may be reallocated by the append
+		auto descend = [this](auto& children, const auto& step)
+		{
+			for (const auto& [existing, child] : children)
+				if (existing == step)
+					return child;
+
+			const size_t child = this->tree.size();
+			children.emplace_back(step, child);
+			this->tree.emplace_back();
+
+			return child;
+		};
+
+		auto& node = this->tree[current];
+		if (const auto* key = segment.key())
+			current = descend(node.keys, *key);
+		else
+			current = descend(node.indices, *segment.index());
+	}
+
+	// Everything below is kept, the narrower paths added before don't matter anymore
+	auto& node = this->tree[current];
+	node.keep_all = true;
+	node.keys.clear();
+	node.indices.clear();
+
+	return *this;
+}
+
+const std::vector<dixelu::mctx_json::details::projection_node>& dixelu::mctx_json::projection::nodes() const noexcept
+{
+	return this->tree;
 }
@@ -0,0 +1,365 @@
+#include "mctx_json.h"
+
+#include <bit>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MCTX_JSON_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(MCTX_JSON_X86) && (defined(__GNUC__) || defined(__clang__))
+#define MCTX_JSON_AVX2 1
+#endif
+
+namespace dixelu::mctx_json::details
+{
+
+namespace
+{
+
+bool is_string_special(unsigned char c) noexcept
+{
+	return c == '"' || c == '\\' || c < 0x20;
+}
+
+size_t scan_string_scalar(const char* data, size_t size, bool& non_ascii) noexcept
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		const auto c = static_cast<unsigned char>(data[i]);
+
+		if (is_string_special(c))
+			return i;
+
+		non_ascii |= c >= 0x80;
+	}
+
+	return size;
+}
+
+bool validate_utf8_scalar(const char* data, size_t size) noexcept
+{
+	size_t position = 0;
+
+	while (position < size)
+	{
+		const auto lead = static_cast<unsigned char>(data[position]);
+		if (lead < 0x80)
+		{
+			++position;
+			continue;
+		}
+
+		size_t length = 0;
+		uint32_t code_point = 0;
+		uint32_t min_code_point = 0;
+
+		if ((lead & 0xE0) == 0xC0) { length = 2; code_point = lead & 0x1F; min_code_point = 0x80; }
+		else if ((lead & 0xF0) == 0xE0) { length = 3; code_point = lead & 0x0F; min_code_point = 0x800; }
+		else if ((lead & 0xF8) == 0xF0) { length = 4; code_point = lead & 0x07; min_code_point = 0x10000; }
+		else
+			return false;
+
+		if (position + length > size)
+			return false;
+
+		for (size_t i = 1; i < length; ++i)
+		{
+			const auto next = static_cast<unsigned char>(data[position + i]);
+			if ((next & 0xC0) != 0x80)
+				return false;
+
+			code_point = (code_point << 6) | (next & 0x3F);
+		}
+
+		if (code_point < min_code_point || code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF))
+			return false;
+
+		position += length;
+	}
+
+	return true;
+}
+
+#ifdef MCTX_JSON_X86
+
+// SSE2 is part of x86-64, no dispatch needed
+size_t scan_string_sse2(const char* data, size_t size, bool& non_ascii) noexcept
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control_max = _mm_set1_epi8(0x1F);
+
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+		// unsigned c <= 0x1F is max(c, 0x1F) == 0x1F
+		const __m128i special = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(block, control_max), control_max));
+
+		const auto special_mask = static_cast<uint32_t>(_mm_movemask_epi8(special));
+		const auto high_mask = static_cast<uint32_t>(_mm_movemask_epi8(block));
+
+		if (special_mask != 0)
+		{
+			const auto offset = std::countr_zero(special_mask);
+			non_ascii |= (high_mask & ((1u << offset) - 1)) != 0;
+			return i + offset;
+		}
+
+		non_ascii |= high_mask != 0;
+	}
+
+	return i + scan_string_scalar(data + i, size - i, non_ascii);
+}
+
+#endif
+
+#ifdef MCTX_JSON_AVX2
+
+__attribute__((target("avx2")))
+size_t scan_string_avx2(const char* data, size_t size, bool& non_ascii) noexcept
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i control_max = _mm256_set1_epi8(0x1F);
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+
+		const __m256i special = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)),
+			_mm256_cmpeq_epi8(_mm256_max_epu8(block, control_max), control_max));
+
+		const auto special_mask = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+		const auto high_mask = static_cast<uint32_t>(_mm256_movemask_epi8(block));
+
+		if (special_mask != 0)
+		{
+			const auto offset = std::countr_zero(special_mask);
+			non_ascii |= (high_mask & ((uint32_t(1) << offset) - 1)) != 0;
+			return i + offset;
+		}
+
+		non_ascii |= high_mask != 0;
+	}
+
+	return i + scan_string_sse2(data + i, size - i, non_ascii);
+}
+
+/* UTF-8 validation by lookup tables (Keiser & Lemire, "Validating UTF-8 In
+ * Less Than One Instruction Per Byte"): every byte pair is classified by
+ * three nibble lookups whose intersection flags an error, continuation
+ * bytes of 3 and 4 byte sequences are checked against the leads 2 and 3
+ * bytes back.
+ */
+namespace utf8_lookup
+{
+
+constexpr uint8_t too_short = 1 << 0;
+constexpr uint8_t too_long = 1 << 1;
+constexpr uint8_t overlong_3 = 1 << 2;
+constexpr uint8_t too_large = 1 << 3;
+constexpr uint8_t surrogate = 1 << 4;
+constexpr uint8_t overlong_2 = 1 << 5;
+constexpr uint8_t too_large_1000 = 1 << 6;
+constexpr uint8_t overlong_4 = 1 << 6;
+constexpr uint8_t two_continuations = 1 << 7;
+constexpr uint8_t carry = too_short | too_long | two_continuations;
+
+__attribute__((target("avx2")))
+inline __m256i table(
+	uint8_t t0, uint8_t t1, uint8_t t2, uint8_t t3, uint8_t t4, uint8_t t5, uint8_t t6, uint8_t t7,
+	uint8_t t8, uint8_t t9, uint8_t t10, uint8_t t11, uint8_t t12, uint8_t t13, uint8_t t14, uint8_t t15)
+{
+	return _mm256_setr_epi8(
+		t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+		t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15);
+}
+
+__attribute__((target("avx2")))
+inline __m256i high_nibbles(__m256i v)
+{
+	return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+// Bytes of input shifted by N, the missing ones taken from the end of previous
+template<int N>
+__attribute__((target("avx2")))
+inline __m256i prev(__m256i input, __m256i previous)
+{
+	return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+struct state
+{
+	__m256i error;
+	__m256i previous;
+	__m256i previous_incomplete;
+};
+
+__attribute__((target("avx2")))
+inline void check_block(state& s, __m256i input)
+{
+	// All-ASCII block: only a sequence left incomplete by the previous one can be wrong
+	if (_mm256_movemask_epi8(input) == 0)
+	{
+		s.error = _mm256_or_si256(s.error, s.previous_incomplete);
+		s.previous = input;
+		s.previous_incomplete = _mm256_setzero_si256();
+		return;
+	}
+
+	const __m256i byte_1_high_table = table(
+		too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+		two_continuations, two_continuations, two_continuations, two_continuations,
+		too_short | overlong_2,
+		too_short,
+		too_short | overlong_3 | surrogate,
+		too_short | too_large | too_large_1000 | overlong_4);
+
+	const __m256i byte_1_low_table = table(
+		carry | overlong_3 | overlong_2 | overlong_4,
+		carry | overlong_2,
+		carry,
+		carry,
+		carry | too_large,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000 | surrogate,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000);
+
+	const __m256i byte_2_high_table = table(
+		too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+		too_long | overlong_2 | two_continuations | overlong_3 | too_large_1000 | overlong_4,
+		too_long | overlong_2 | two_continuations | overlong_3 | too_large,
+		too_long | overlong_2 | two_continuations | surrogate | too_large,
+		too_long | overlong_2 | two_continuations | surrogate | too_large,
+		too_short, too_short, too_short, too_short);
+
+	const __m256i prev1 = prev<1>(input, s.previous);
+
+	const __m256i special_cases = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high_table, high_nibbles(prev1)),
+			_mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+		_mm256_shuffle_epi8(byte_2_high_table, high_nibbles(input)));
+
+	// Only leads of 3 and 4 byte sequences get the high bit after the subtraction
+	const __m256i third_byte = _mm256_subs_epu8(prev<2>(input, s.previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	const __m256i fourth_byte = _mm256_subs_epu8(prev<3>(input, s.previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	const __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(third_byte, fourth_byte), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+	s.error = _mm256_or_si256(s.error, _mm256_xor_si256(must_be_continuation, special_cases));
+
+	// Leads in the last 3 bytes that need more bytes than the block has left
+	const __m256i max_complete = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+
+	s.previous_incomplete = _mm256_subs_epu8(input, max_complete);
+	s.previous = input;
+}
+
+}
+
+__attribute__((target("avx2")))
+bool validate_utf8_avx2(const char* data, size_t size) noexcept
+{
+	utf8_lookup::state s{ _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+		utf8_lookup::check_block(s, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+
+	if (i < size)
+	{
+		// Zero padding is ASCII, a sequence cut by the end of the text shows up as too short
+		alignas(32) char tail[32] = {};
+		std::copy(data + i, data + size, tail);
+		utf8_lookup::check_block(s, _mm256_load_si256(reinterpret_cast<const __m256i*>(tail)));
+	}
+
+	s.error = _mm256_or_si256(s.error, s.previous_incomplete);
+	return _mm256_testz_si256(s.error, s.error) != 0;
+}
+
+#endif
+
+struct scan_functions
+{
+	size_t (*scan_string)(const char*, size_t, bool&) noexcept;
+	bool (*validate_utf8)(const char*, size_t) noexcept;
+};
+
+scan_functions select_scan_functions() noexcept
+{
+#ifdef MCTX_JSON_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return { scan_string_avx2, validate_utf8_avx2 };
+#endif
+
+#ifdef MCTX_JSON_X86
+	return { scan_string_sse2, validate_utf8_scalar };
+#else
+	return { scan_string_scalar, validate_utf8_scalar };
+#endif
+}
+
+const scan_functions& active_scan_functions() noexcept
+{
+	static const scan_functions functions = select_scan_functions();
+	return functions;
+}
+
+}
+
+size_t scan_string(std::string_view text, bool& non_ascii) noexcept
+{
+	return active_scan_functions().scan_string(text.data(), text.size(), non_ascii);
+}
+
+bool validate_utf8(std::string_view text) noexcept
+{
+	return active_scan_functions().validate_utf8(text.data(), text.size());
+}
+
+void append_utf8(std::string& out, uint32_t code_point)
+{
+	if (code_point < 0x80)
+		out.push_back(static_cast<char>(code_point));
+	else if (code_point < 0x800)
+	{
+		out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+	}
+	else if (code_point < 0x10000)
+	{
+		out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+		out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+	}
+	else
+	{
+		out.push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+		out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+	}
+}
+
+} // namespace dixelu::mctx_json::details
@@ -0,0 +1,430 @@
+#include "mctx_patch.h"
+
+#include <charconv>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dixelu
+{
+
+namespace
+{
+
+[[noreturn]] void fail(const std::string& what)
+{
+	throw std::runtime_error("apply_patch: " + what);
+}
+
+// Writes the JSON pointer of a diff location, one token per nesting level
+class pointer_builder
+{
+	std::string path;
+
+public:
+	void push(std::string_view token)
+	{
+		this->path.push_back('/');
+
+		for (char c : token)
+		{
+			if (c == '~')
+				this->path += "~0";
+			else if (c == '/')
+				this->path += "~1";
+			else
+				this->path.push_back(c);
+		}
+	}
+
+	void push(size_t index)
+	{
+		this->path.push_back('/');
+		this->path += std::to_string(index);
+	}
+
+	void pop()
+	{
+		this->path.erase(this->path.rfind('/'));
+	}
+
+	[[nodiscard]] const std::string& str() const noexcept { return this->path; }
+};
+
+class differ
+{
+	mctx& patch;
+	pointer_builder path;
+
+	void emit(std::string_view op, const mctx* value)
+	{
+		mctx operation = mctx::make_object();
+		operation["op"] = std::string(op);
+		operation["path"] = this->path.str();
+
+		if (value != nullptr)
+			operation["value"] = *value;
+
+		this->patch.push_back(std::move(operation));
+	}
+
+	void diff_objects(const mctx_object& from, const mctx_object& to)
+	{
+		for (const auto& [key, value] : from)
+		{
+			this->path.push(key.view());
+
+			auto iter = to.find(key);
+			if (iter == to.end())
+				this->emit("remove", nullptr);
+			else
+				this->diff(value, iter->second);
+
+			this->path.pop();
+		}
+
+		for (const auto& [key, value] : to)
+		{
+			if (from.contains(key))
+				continue;
+
+			this->path.push(key.view());
+			this->emit("add", &value);
+			this->path.pop();
+		}
+	}
+
+	void diff_arrays(const mctx_array& from, const mctx_array& to)
+	{
+		const size_t common = std::min(from.size(), to.size());
+
+		size_t head = 0;
+		while (head < common && from[head] == to[head])
+			++head;
+
+		size_t tail = 0;
+		while (tail < common - head && from[from.size() - 1 - tail] == to[to.size() - 1 - tail])
+			++tail;
+
+		const size_t from_end = from.size() - tail;
+		const size_t to_end = to.size() - tail;
+		const size_t paired = std::min(from_end, to_end);
+
+		for (size_t i = head; i < paired; ++i)
+		{
+			this->path.push(i);
+			this->diff(from[i], to[i]);
+			this->path.pop();
+		}
+
+		// Removals go back to front, so each pointer is valid when its operation runs
+		for (size_t i = from_end; i > paired; --i)
+		{
+			this->path.push(i - 1);
+			this->emit("remove", nullptr);
+			this->path.pop();
+		}
+
+		for (size_t i = paired; i < to_end; ++i)
+		{
+			this->path.push(i);
+			this->emit("add", &to[i]);
+			this->path.pop();
+		}
+	}
+
+public:
+	explicit differ(mctx& patch) noexcept :
+		patch(patch) {}
+
+	void diff(const mctx& from, const mctx& to)
+	{
+		// Subtrees shared by both sides are the same container, equal ones only give no operations below
+		const auto* from_object = from.if_object();
+		const auto* to_object = to.if_object();
+
+		if (from_object != nullptr && to_object != nullptr)
+		{
+			if (from_object != to_object)
+				this->diff_objects(*from_object, *to_object);
+
+			return;
+		}
+
+		const auto* from_array = from.if_array();
+		const auto* to_array = to.if_array();
+
+		if (from_array != nullptr && to_array != nullptr)
+		{
+			if (from_array != to_array)
+				this->diff_arrays(*from_array, *to_array);
+
+			return;
+		}
+
+		if (!(from == to))
+			this->emit("replace", &to);
+	}
+};
+
+std::vector<std::string> parse_pointer(std::string_view pointer)
+{
+	std::vector<std::string> tokens;
+	if (pointer.empty())
+		return tokens;
+
+	if (pointer.front() != '/')
+		fail("path must start with '/': " + std::string(pointer));
+
+	size_t position = 1;
+	while (true)
+	{
+		auto end = pointer.find('/', position);
+		auto raw = pointer.substr(position, end == std::string_view::npos ? std::string_view::npos : end - position);
+
+		std::string& token = tokens.emplace_back();
+		for (size_t i = 0; i < raw.size(); ++i)
+		{
+			if (raw[i] != '~')
+			{
+				token.push_back(raw[i]);
+				continue;
+			}
+
+			if (i + 1 == raw.size() || (raw[i + 1] != '0' && raw[i + 1] != '1'))
+				fail("invalid escape in path: " + std::string(pointer));
+
+			token.push_back(raw[++i] == '0' ? '~' : '/');
+		}
+
+		if (end == std::string_view::npos)
+			return tokens;
+
+		position = end + 1;
+	}
+}
+
+// Array position of a token, size is only accepted (as "-" or a number) when appending
+size_t parse_index(const std::string& token, size_t size, bool append)
+{
+	if (append && token == "-")
+		return size;
+
+	size_t index = 0;
+	auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), index);
+
+	if (error != std::errc() || end != token.data() + token.size() || (token.size() > 1 && token.front() == '0'))
+		fail("invalid array index: " + token);
+
+	if (index > size || (index == size && !append))
+		fail("array index out of range: " + token);
+
+	return index;
+}
+
+class patcher
+{
+	mctx& root;
+
+	// Container holding the last token of the path
+	mctx& parent(const std::vector<std::string>& tokens)
+	{
+		mctx* node = &this->root;
+
+		for (size_t i = 0; i + 1 < tokens.size(); ++i)
+			node = &this->child(*node, tokens[i]);
+
+		return *node;
+	}
+
+	mctx& child(mctx& node, const std::string& token)
+	{
+		if (auto* o = node.if_object())
+		{
+			auto iter = o->find(token);
+			if (iter == o->end())
+				fail("no such key: " + token);
+
+			return iter->second;
+		}
+
+		if (auto* a = node.if_array())
+			return (*a)[parse_index(token, a->size(), false)];
+
+		fail("path goes through a scalar at " + token);
+	}
+
+	[[nodiscard]] const mctx& locate(const std::vector<std::string>& tokens) const
+	{
+		const mctx* node = &this->root;
+
+		for (const auto& token : tokens)
+		{
+			if (const auto* o = node->if_object())
+			{
+				auto iter = o->find(token);
+				if (iter == o->end())
+					fail("no such key: " + token);
+
+				node = &iter->second;
+			}
+			else if (const auto* a = node->if_array())
+				node = &(*a)[parse_index(token, a->size(), false)];
+			else
+				fail("path goes through a scalar at " + token);
+		}
+
+		return *node;
+	}
+
+	void add(const std::vector<std::string>& tokens, mctx value)
+	{
+		if (tokens.empty())
+		{
+			this->root = std::move(value);
+			return;
+		}
+
+		mctx& node = this->parent(tokens);
+		const auto& token = tokens.back();
+
+		if (auto* o = node.if_object())
+			o->insert_or_assign(token, std::move(value));
+		else if (auto* a = node.if_array())
+			a->insert(a->begin() + static_cast<ptrdiff_t>(parse_index(token, a->size(), true)), std::move(value));
+		else
+			fail("can't add to a scalar at " + token);
+	}
+
+	mctx remove(const std::vector<std::string>& tokens)
+	{
+		if (tokens.empty())
+			fail("can't remove the root");
+
+		mctx& node = this->parent(tokens);
+		const auto& token = tokens.back();
+		mctx removed;
+
+		if (auto* o = node.if_object())
+		{
+			auto iter = o->find(token);
+			if (iter == o->end())
+				fail("no such key: " + token);
+
+			removed = std::move(iter->second);
+			o->erase(iter);
+		}
+		else if (auto* a = node.if_array())
+		{
+			auto iter = a->begin() + static_cast<ptrdiff_t>(parse_index(token, a->size(), false));
+			removed = std::move(*iter);
+			a->erase(iter);
+		}
+		else
+			fail("can't remove from a scalar at " + token);
+
+		return removed;
+	}
+
+	void replace(const std::vector<std::string>& tokens, mctx value)
+	{
+		if (tokens.empty())
+		{
+			this->root = std::move(value);
+			return;
+		}
+
+		this->child(this->parent(tokens), tokens.back()) = std::move(value);
+	}
+
+	static mctx& member(mctx& operation, std::string_view name)
+	{
+		auto* o = operation.if_object();
+		auto iter = o->find(name);
+		if (iter == o->end())
+			fail("operation misses \"" + std::string(name) + "\"");
+
+		return iter->second;
+	}
+
+	static std::string_view text(mctx& operation, std::string_view name)
+	{
+		const mctx& value = member(operation, name);
+		if (!value.is<std::string>())
+			fail("\"" + std::string(name) + "\" must be a string");
+
+		return value.as_string_view();
+	}
+
+public:
+	explicit patcher(mctx& root) noexcept :
+		root(root) {}
+
+	void apply(mctx& operation)
+	{
+		if (!operation.is_object())
+			fail("operation must be an object");
+
+		const auto op = text(operation, "op");
+		const auto path = parse_pointer(text(operation, "path"));
+
+		if (op == "add")
+			this->add(path, std::move(member(operation, "value")));
+		else if (op == "remove")
+			this->remove(path);
+		else if (op == "replace")
+			this->replace(path, std::move(member(operation, "value")));
+		else if (op == "move" || op == "copy")
+		{
+			const auto from_pointer = text(operation, "from");
+			const auto from = parse_pointer(from_pointer);
+
+			if (op == "copy")
+				this->add(path, this->locate(from));
+			else
+			{
+				const auto to_pointer = text(operation, "path");
+				if (to_pointer.starts_with(from_pointer) && to_pointer.size() > from_pointer.size() && to_pointer[from_pointer.size()] == '/')
+					fail("can't move a value into itself");
+
+				this->add(path, this->remove(from));
+			}
+		}
+		else if (op == "test")
+		{
+			if (!(this->locate(path) == member(operation, "value")))
+				fail("test failed at " + std::string(text(operation, "path")));
+		}
+		else
+			fail("unknown operation " + std::string(op));
+	}
+};
+
+} // namespace
+
+mctx mctx_diff(const mctx& from, const mctx& to)
+{
+	mctx patch = mctx::make_array();
+	differ(patch).diff(from, to);
+
+	return patch;
+}
+
+void apply_patch(mctx& target, mctx patch)
+{
+	if (!patch.is_array())
+		throw std::runtime_error("apply_patch: patch must be an array");
+
+	// Shares every node with the target until an operation touches it
+	mctx result = target;
+	patcher applier(result);
+
+	for (auto& operation : patch.elements())
+		applier.apply(operation);
+
+	target = std::move(result);
+}
+
+} // namespace dixelu
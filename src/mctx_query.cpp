@@ -0,0 +1,864 @@
+#include "mctx_query.h"
+#include "mctx_json.h"
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <variant>
+
+namespace dixelu
+{
+
+namespace details
+{
+
+struct query_slice
+{
+	std::optional<int64_t> start;
+	std::optional<int64_t> end;
+	int64_t step = 1;
+};
+
+using query_selector = std::variant<mctx_key, int64_t, query_slice>;
+
+// Filter operand: a singular path from the current node or the root, or a literal
+struct query_operand
+{
+	enum class origin : uint8_t
+	{
+		current,
+		root,
+		literal
+	};
+
+	origin from = origin::literal;
+	mctx_path path;
+	mctx value;
+};
+
+struct query_expression
+{
+	enum class op : uint8_t
+	{
+		exists,
+		equal,
+		not_equal,
+		less,
+		less_equal,
+		greater,
+		greater_equal,
+		all,
+		any,
+		negate
+	};
+
+	op code = op::exists;
+	query_operand left;
+	query_operand right;
+	std::unique_ptr<query_expression> first;
+	std::unique_ptr<query_expression> second;
+};
+
+struct query_step
+{
+	enum class kind : uint8_t
+	{
+		select,
+		wildcard,
+		filter
+	};
+
+	kind type = kind::select;
+	bool descendant = false;	// applied to the node and everything below it
+	std::vector<query_selector> selectors;
+	std::unique_ptr<query_expression> filter;
+};
+
+struct query_program
+{
+	std::string source;
+	std::vector<query_step> steps;
+};
+
+} // namespace details
+
+namespace
+{
+
+using details::query_expression;
+using details::query_operand;
+using details::query_program;
+using details::query_selector;
+using details::query_slice;
+using details::query_step;
+
+bool is_name_char(char c) noexcept
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		c == '_' || c == '-' || c == '$' || static_cast<unsigned char>(c) >= 0x80;
+}
+
+// Recursive descent over the expression text, produces the step list
+class query_compiler
+{
+	std::string_view text;
+	size_t position = 0;
+
+	[[noreturn]] void fail(const char* what) const
+	{
+		throw std::runtime_error("JSONPath error at offset " + std::to_string(this->position) + ": " + what);
+	}
+
+	[[nodiscard]] bool at_end() const noexcept { return this->position >= this->text.size(); }
+	[[nodiscard]] char peek() const noexcept { return this->at_end() ? '\0' : this->text[this->position]; }
+
+	void skip_whitespace() noexcept
+	{
+		while (!this->at_end())
+		{
+			const char c = this->text[this->position];
+			if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+				break;
+
+			++this->position;
+		}
+	}
+
+	bool consume(char c) noexcept
+	{
+		if (this->peek() != c)
+			return false;
+
+		++this->position;
+		return true;
+	}
+
+	bool consume(std::string_view token) noexcept
+	{
+		if (this->text.substr(this->position, token.size()) != token)
+			return false;
+
+		this->position += token.size();
+		return true;
+	}
+
+	void expect(char c, const char* what)
+	{
+		this->skip_whitespace();
+		if (!this->consume(c))
+			this->fail(what);
+	}
+
+	std::string_view parse_name()
+	{
+		const size_t begin = this->position;
+		while (!this->at_end() && is_name_char(this->text[this->position]))
+			++this->position;
+
+		if (begin == this->position)
+			this->fail("expected a member name");
+
+		return this->text.substr(begin, this->position - begin);
+	}
+
+	uint32_t parse_hex4()
+	{
+		if (this->position + 4 > this->text.size())
+			this->fail("incomplete \\u escape");
+
+		uint32_t code = 0;
+		auto [end, error] = std::from_chars(this->text.data() + this->position, this->text.data() + this->position + 4, code, 16);
+		if (error != std::errc() || end != this->text.data() + this->position + 4)
+			this->fail("invalid \\u escape");
+
+		this->position += 4;
+		return code;
+	}
+
+	std::string parse_quoted()
+	{
+		const char quote = this->text[this->position++];
+		std::string out;
+
+		while (true)
+		{
+			if (this->at_end())
+				this->fail("unterminated string");
+
+			const char c = this->text[this->position++];
+			if (c == quote)
+				return out;
+
+			if (c != '\\')
+			{
+				out.push_back(c);
+				continue;
+			}
+
+			if (this->at_end())
+				this->fail("unterminated string");
+
+			switch (const char e = this->text[this->position++])
+			{
+			case 'b': out.push_back('\b'); break;
+			case 'f': out.push_back('\f'); break;
+			case 'n': out.push_back('\n'); break;
+			case 'r': out.push_back('\r'); break;
+			case 't': out.push_back('\t'); break;
+			case 'u':
+			{
+				uint32_t code = this->parse_hex4();
+				if (code >= 0xD800 && code < 0xDC00)
+				{
+					if (!this->consume("\\u"))
+						this->fail("unpaired surrogate");
+
+					const uint32_t low = this->parse_hex4();
+					if (low < 0xDC00 || low >= 0xE000)
+						this->fail("unpaired surrogate");
+
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else if (code >= 0xDC00 && code < 0xE000)
+					this->fail("unpaired surrogate");
+
+				mctx_json::details::append_utf8(out, code);
+				break;
+			}
+			default:
+				if (e != '\\' && e != '/' && e != '\'' && e != '"')
+					this->fail("invalid escape");
+
+				out.push_back(e);
+			}
+		}
+	}
+
+	std::optional<int64_t> parse_integer()
+	{
+		int64_t value = 0;
+		auto [end, error] = std::from_chars(this->text.data() + this->position, this->text.data() + this->text.size(), value);
+		if (error == std::errc::invalid_argument)
+			return std::nullopt;
+		if (error != std::errc())
+			this->fail("integer out of range");
+
+		this->position = static_cast<size_t>(end - this->text.data());
+		return value;
+	}
+
+	query_selector parse_selector()
+	{
+		this->skip_whitespace();
+
+		const char c = this->peek();
+		if (c == '\'' || c == '"')
+			return mctx_key(this->parse_quoted());
+
+		auto start = this->parse_integer();
+		this->skip_whitespace();
+
+		if (this->peek() != ':')
+		{
+			if (!start)
+				this->fail("expected a key, an index or a slice");
+
+			return *start;
+		}
+
+		query_slice slice;
+		slice.start = start;
+
+		++this->position;
+		this->skip_whitespace();
+		slice.end = this->parse_integer();
+		this->skip_whitespace();
+
+		if (this->consume(':'))
+		{
+			this->skip_whitespace();
+			if (auto step = this->parse_integer())
+				slice.step = *step;
+		}
+
+		return slice;
+	}
+
+	void parse_bracket(query_step& step)
+	{
+		++this->position;
+		this->skip_whitespace();
+
+		if (this->consume('*'))
+			step.type = query_step::kind::wildcard;
+		else if (this->consume('?'))
+		{
+			step.type = query_step::kind::filter;
+			step.filter = this->parse_or();
+		}
+		else
+		{
+			do
+				step.selectors.push_back(this->parse_selector());
+			while (this->skip_whitespace(), this->consume(','));
+		}
+
+		this->expect(']', "expected ']'");
+	}
+
+	// Singular path after @ or $, compiled into an mctx_path
+	mctx_path parse_singular_path()
+	{
+		mctx_path path;
+
+		while (true)
+		{
+			if (this->peek() == '.' && this->text.substr(this->position, 2) != "..")
+			{
+				++this->position;
+				path.append(mctx_key(this->parse_name()));
+			}
+			else if (this->peek() == '[')
+			{
+				++this->position;
+				this->skip_whitespace();
+
+				const char c = this->peek();
+				if (c == '\'' || c == '"')
+					path.append(mctx_key(this->parse_quoted()));
+				else
+				{
+					auto index = this->parse_integer();
+					if (!index)
+						this->fail("filter paths only take keys and indices");
+					if (*index < 0)
+						this->fail("negative indices are not supported in filter paths");
+
+					path.append(static_cast<size_t>(*index));
+				}
+
+				this->expect(']', "expected ']'");
+			}
+			else
+				return path;
+		}
+	}
+
+	mctx parse_number()
+	{
+		const size_t begin = this->position;
+		bool fractional = false;
+
+		while (!this->at_end())
+		{
+			const char c = this->text[this->position];
+			if (c == '.' || c == 'e' || c == 'E')
+				fractional = true;
+			else if (!(c >= '0' && c <= '9') && c != '-' && c != '+')
+				break;
+
+			++this->position;
+		}
+
+		const char* first = this->text.data() + begin;
+		const char* last = this->text.data() + this->position;
+
+		if (!fractional)
+		{
+			int64_t value = 0;
+			auto [end, error] = std::from_chars(first, last, value);
+			if (error == std::errc() && end == last)
+				return mctx(value);
+		}
+
+		double value = 0;
+		auto [end, error] = std::from_chars(first, last, value);
+		if (error != std::errc() || end != last)
+			this->fail("invalid number");
+
+		return mctx(value);
+	}
+
+	query_operand parse_operand()
+	{
+		this->skip_whitespace();
+
+		query_operand operand;
+		const char c = this->peek();
+
+		if (c == '@' || c == '$')
+		{
+			++this->position;
+			operand.from = c == '@' ? query_operand::origin::current : query_operand::origin::root;
+			operand.path = this->parse_singular_path();
+		}
+		else if (c == '\'' || c == '"')
+			operand.value = mctx(this->parse_quoted());
+		else if (c == '-' || (c >= '0' && c <= '9'))
+			operand.value = this->parse_number();
+		else if (this->consume("true"))
+			operand.value = mctx(true);
+		else if (this->consume("false"))
+			operand.value = mctx(false);
+		else if (!this->consume("null"))
+			this->fail("expected a path or a literal");
+
+		return operand;
+	}
+
+	std::unique_ptr<query_expression> parse_comparison()
+	{
+		auto node = std::make_unique<query_expression>();
+		node->left = this->parse_operand();
+		this->skip_whitespace();
+
+		using op = query_expression::op;
+		static constexpr std::pair<std::string_view, op> operators[] = {
+			{ "==", op::equal },
+			{ "!=", op::not_equal },
+			{ "<=", op::less_equal },
+			{ ">=", op::greater_equal },
+			{ "<", op::less },
+			{ ">", op::greater }
+		};
+
+		for (const auto& [token, code] : operators)
+		{
+			if (this->consume(token))
+			{
+				node->code = code;
+				node->right = this->parse_operand();
+				return node;
+			}
+		}
+
+		if (node->left.from == query_operand::origin::literal)
+			this->fail("a literal is not a test on its own");
+
+		node->code = op::exists;
+		return node;
+	}
+
+	std::unique_ptr<query_expression> parse_unary()
+	{
+		this->skip_whitespace();
+
+		if (this->consume('!'))
+		{
+			auto node = std::make_unique<query_expression>();
+			node->code = query_expression::op::negate;
+			node->first = this->parse_unary();
+			return node;
+		}
+
+		if (this->consume('('))
+		{
+			auto node = this->parse_or();
+			this->expect(')', "expected ')'");
+			return node;
+		}
+
+		return this->parse_comparison();
+	}
+
+	std::unique_ptr<query_expression> parse_binary(query_expression::op code, std::string_view token, std::unique_ptr<query_expression> (query_compiler::*operand)())
+	{
+		auto node = (this->*operand)();
+
+		while (this->skip_whitespace(), this->consume(token))
+		{
+			auto parent = std::make_unique<query_expression>();
+			parent->code = code;
+			parent->first = std::move(node);
+			parent->second = (this->*operand)();
+			node = std::move(parent);
+		}
+
+		return node;
+	}
+
+	std::unique_ptr<query_expression> parse_and()
+	{
+		return this->parse_binary(query_expression::op::all, "&&", &query_compiler::parse_unary);
+	}
+
+	std::unique_ptr<query_expression> parse_or()
+	{
+		return this->parse_binary(query_expression::op::any, "||", &query_compiler::parse_and);
+	}
+
+public:
+	explicit query_compiler(std::string_view text) noexcept :
+		text(text) {}
+
+	std::vector<query_step> compile()
+	{
+		std::vector<query_step> steps;
+
+		this->skip_whitespace();
+		if (!this->consume('$'))
+			this->fail("expected '$'");
+
+		while (this->skip_whitespace(), !this->at_end())
+		{
+			query_step& step = steps.emplace_back();
+
+			if (this->consume(".."))
+			{
+				step.descendant = true;
+
+				if (this->peek() == '[')
+				{
+					this->parse_bracket(step);
+					continue;
+				}
+			}
+			else if (this->peek() == '[')
+			{
+				this->parse_bracket(step);
+				continue;
+			}
+			else if (!this->consume('.'))
+				this->fail("expected '.' or '['");
+
+			if (this->consume('*'))
+				step.type = query_step::kind::wildcard;
+			else
+				step.selectors.emplace_back(mctx_key(this->parse_name()));
+		}
+
+		return steps;
+	}
+};
+
+// Scalar view of a node for filter comparisons
+struct comparable
+{
+	enum class type : uint8_t
+	{
+		null,
+		boolean,
+		number,
+		text,
+		other
+	};
+
+	type kind = type::other;
+	bool flag = false;
+	std::variant<int64_t, uint64_t, double> number;
+	std::string_view text;
+};
+
+comparable classify(const mctx& node)
+{
+	return node.visit([&node](const auto& v)
+	{
+		using T = std::remove_cvref_t<decltype(v)>;
+		using type = comparable::type;
+
+		comparable c;
+		if constexpr (std::is_same_v<T, std::monostate>)
+			c.kind = type::null;
+		else if constexpr (std::is_same_v<T, bool>)
+		{
+			c.kind = type::boolean;
+			c.flag = v;
+		}
+		else if constexpr (std::is_same_v<T, int64_t> || std::is_same_v<T, uint64_t>)
+		{
+			c.kind = type::number;
+			c.number = v;
+		}
+		else if constexpr (std::is_floating_point_v<T>)
+		{
+			c.kind = type::number;
+			c.number = static_cast<double>(v);
+		}
+		else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, mctx_string_slice>)
+		{
+			c.kind = type::text;
+			c.text = node.as_string_view();
+		}
+
+		return c;
+	});
+}
+
+// Three-way comparison of numbers of any kind, nullopt if one of them is NaN
+std::optional<int> compare_numbers(const comparable& a, const comparable& b)
+{
+	return std::visit([](auto x, auto y) -> std::optional<int>
+	{
+		if constexpr (std::is_integral_v<decltype(x)> && std::is_integral_v<decltype(y)>)
+			return std::cmp_less(x, y) ? -1 : std::cmp_equal(x, y) ? 0 : 1;
+		else
+		{
+			const auto dx = static_cast<double>(x);
+			const auto dy = static_cast<double>(y);
+
+			if (dx < dy)
+				return -1;
+			if (dx > dy)
+				return 1;
+			if (dx == dy)
+				return 0;
+
+			return std::nullopt;
+		}
+	}, a.number, b.number);
+}
+
+// Missing operands are only equal to each other and never ordered
+bool compare(query_expression::op code, const mctx* lhs, const mctx* rhs)
+{
+	using op = query_expression::op;
+	using type = comparable::type;
+
+	bool equal = false;
+	std::optional<int> order;
+
+	if (lhs == nullptr || rhs == nullptr)
+		equal = lhs == rhs;
+	else
+	{
+		const auto a = classify(*lhs);
+		const auto b = classify(*rhs);
+
+		if (a.kind != b.kind)
+			equal = false;
+		else if (a.kind == type::number)
+		{
+			order = compare_numbers(a, b);
+			equal = order == 0;
+		}
+		else if (a.kind == type::text)
+		{
+			const int c = a.text.compare(b.text);
+			order = (c > 0) - (c < 0);
+			equal = c == 0;
+		}
+		else if (a.kind == type::boolean)
+			equal = a.flag == b.flag;
+		else if (a.kind == type::null)
+			equal = true;
+		else
+			equal = *lhs == *rhs;
+	}
+
+	switch (code)
+	{
+	case op::equal: return equal;
+	case op::not_equal: return !equal;
+	case op::less: return order && *order < 0;
+	case op::less_equal: return equal || (order && *order < 0);
+	case op::greater: return order && *order > 0;
+	case op::greater_equal: return equal || (order && *order > 0);
+	default: return false;
+	}
+}
+
+// One evaluation: the program walked depth first, matches go straight to the sink
+class query_runner
+{
+	const query_program& program;
+	const mctx& root;
+	bool (*callback)(void*, const mctx&);
+	void* context;
+
+	[[nodiscard]] const mctx* resolve(const query_operand& operand, const mctx& current) const
+	{
+		switch (operand.from)
+		{
+		case query_operand::origin::current: return current.resolve(operand.path);
+		case query_operand::origin::root: return this->root.resolve(operand.path);
+		default: return &operand.value;
+		}
+	}
+
+	[[nodiscard]] bool test(const query_expression& expression, const mctx& current) const
+	{
+		using op = query_expression::op;
+
+		switch (expression.code)
+		{
+		case op::exists: return this->resolve(expression.left, current) != nullptr;
+		case op::all: return this->test(*expression.first, current) && this->test(*expression.second, current);
+		case op::any: return this->test(*expression.first, current) || this->test(*expression.second, current);
+		case op::negate: return !this->test(*expression.first, current);
+		default: return compare(expression.code, this->resolve(expression.left, current), this->resolve(expression.right, current));
+		}
+	}
+
+	// Calls f on every child in document order, stops once f returns false
+	template<typename F>
+	static bool each_child(const mctx& node, F&& f)
+	{
+		if (const auto* a = node.if_array())
+		{
+			for (const auto& child : *a)
+				if (!f(child))
+					return false;
+		}
+		else if (const auto* o = node.if_object())
+		{
+			for (const auto& [key, child] : *o)
+				if (!f(child))
+					return false;
+		}
+
+		return true;
+	}
+
+	bool select_slice(size_t pc, const mctx_array& a, const query_slice& slice)
+	{
+		if (slice.step == 0)
+			return true;
+
+		const auto size = static_cast<int64_t>(a.size());
+		const auto normalize = [size](int64_t i) { return i >= 0 ? i : size + i; };
+
+		// Steps past the size select the same elements, clamping keeps i + step from overflowing
+		const int64_t step = std::clamp<int64_t>(slice.step, -size - 1, size + 1);
+
+		if (step > 0)
+		{
+			const int64_t lower = std::clamp<int64_t>(normalize(slice.start.value_or(0)), 0, size);
+			const int64_t upper = std::clamp<int64_t>(slice.end ? normalize(*slice.end) : size, 0, size);
+
+			for (int64_t i = lower; i < upper; i += step)
+				if (!this->walk(pc, a[static_cast<size_t>(i)]))
+					return false;
+		}
+		else
+		{
+			const int64_t upper = std::clamp<int64_t>(slice.start ? normalize(*slice.start) : size - 1, -1, size - 1);
+			const int64_t lower = std::clamp<int64_t>(slice.end ? normalize(*slice.end) : -1, -1, size - 1);
+
+			for (int64_t i = upper; i > lower; i += step)
+				if (!this->walk(pc, a[static_cast<size_t>(i)]))
+					return false;
+		}
+
+		return true;
+	}
+
+	bool apply(size_t pc, const query_step& step, const mctx& node)
+	{
+		switch (step.type)
+		{
+		case query_step::kind::wildcard:
+			return each_child(node, [this, pc](const mctx& child) { return this->walk(pc + 1, child); });
+
+		case query_step::kind::filter:
+			return each_child(node, [this, pc, &step](const mctx& child)
+			{
+				return !this->test(*step.filter, child) || this->walk(pc + 1, child);
+			});
+
+		default:
+			break;
+		}
+
+		for (const auto& selector : step.selectors)
+		{
+			if (const auto* key = std::get_if<mctx_key>(&selector))
+			{
+				const auto* o = node.if_object();
+				if (o == nullptr)
+					continue;
+
+				auto iter = o->find(*key);
+				if (iter != o->end() && !this->walk(pc + 1, iter->second))
+					return false;
+
+				continue;
+			}
+
+			const auto* a = node.if_array();
+			if (a == nullptr)
+				continue;
+
+			if (const auto* index = std::get_if<int64_t>(&selector))
+			{
+				const int64_t i = *index >= 0 ? *index : static_cast<int64_t>(a->size()) + *index;
+				if (i >= 0 && i < static_cast<int64_t>(a->size()) && !this->walk(pc + 1, (*a)[static_cast<size_t>(i)]))
+					return false;
+			}
+			else if (!this->select_slice(pc + 1, *a, std::get<query_slice>(selector)))
+				return false;
+		}
+
+		return true;
+	}
+
+public:
+	query_runner(const query_program& program, const mctx& root, bool (*callback)(void*, const mctx&), void* context) noexcept :
+		program(program), root(root), callback(callback), context(context) {}
+
+	// False once the sink asked to stop
+	bool walk(size_t pc, const mctx& node)
+	{
+		if (pc == this->program.steps.size())
+			return this->callback(this->context, node);
+
+		const auto& step = this->program.steps[pc];
+		if (!this->apply(pc, step, node))
+			return false;
+
+		if (!step.descendant)
+			return true;
+
+		return each_child(node, [this, pc](const mctx& child) { return this->walk(pc, child); });
+	}
+};
+
+} // namespace
+
+mctx_query::mctx_query(std::string_view expression)
+{
+	auto compiled = std::make_shared<details::query_program>();
+	compiled->source = std::string(expression);
+	compiled->steps = query_compiler(compiled->source).compile();
+
+	this->program = std::move(compiled);
+}
+
+std::string_view mctx_query::expression() const noexcept { return this->program->source; }
+
+void mctx_query::run(const mctx& root, sink callback, void* context) const
+{
+	query_runner(*this->program, root, callback, context).walk(0, root);
+}
+
+std::vector<const mctx*> mctx_query::select(const mctx& root) const
+{
+	std::vector<const mctx*> matches;
+	this->for_each(root, [&matches](const mctx& match) { matches.push_back(&match); });
+
+	return matches;
+}
+
+const mctx* mctx_query::first(const mctx& root) const
+{
+	const mctx* match = nullptr;
+	this->for_each(root, [&match](const mctx& node)
+	{
+		match = &node;
+		return false;
+	});
+
+	return match;
+}
+
+size_t mctx_query::count(const mctx& root) const
+{
+	size_t matches = 0;
+	this->for_each(root, [&matches](const mctx&) { ++matches; });
+
+	return matches;
+}
+
+} // namespace dixelu
@@ -0,0 +1,106 @@
+#include "mctx_snapshot.h"
+
+namespace dixelu
+{
+
+mctx_snapshot::mctx_snapshot(std::shared_ptr<const mctx> root) noexcept :
+	root(std::move(root)) {}
+
+mctx_snapshot::mctx_snapshot() :
+	root(std::make_shared<const mctx>()) {}
+
+mctx_snapshot::mctx_snapshot(mctx value) :
+	root(std::make_shared<const mctx>(std::move(value))) {}
+
+const mctx& mctx_snapshot::get() const noexcept { return *this->root; }
+
+const mctx& mctx_snapshot::operator*() const noexcept { return *this->root; }
+const mctx* mctx_snapshot::operator->() const noexcept { return this->root.get(); }
+
+const mctx* mctx_snapshot::find(std::initializer_list<std::string_view> path) const
+{
+	const mctx* node = this->root.get();
+
+	for (auto key : path)
+	{
+		if (!node->is_object())
+			return nullptr;
+
+		auto iter = node->find(key);
+		if (iter == node->end())
+			return nullptr;
+
+		node = &*iter;
+	}
+
+	return node;
+}
+
+mctx_snapshot mctx_snapshot::set(std::initializer_list<std::string_view> path, mctx value) const
+{
+	return this->update([&](mctx& root)
+	{
+		mctx* node = &root;
+		for (auto key : path)
+			node = &(*node)[key];
+
+		*node = std::move(value);
+	});
+}
+
+mctx_snapshot mctx_snapshot::erase(std::initializer_list<std::string_view> path) const
+{
+	if (path.size() == 0 || this->find(path) == nullptr)
+		return *this;
+
+	return this->update([&](mctx& root)
+	{
+		mctx* node = &root;
+		for (auto key = path.begin(); key + 1 != path.end(); ++key)
+			node = &node->at(*key);
+
+		node->erase(*(path.end() - 1));
+	});
+}
+
+bool mctx_snapshot::operator==(const mctx_snapshot& other) const
+{
+	return this->root == other.root || *this->root == *other.root;
+}
+
+mctx_store::mctx_store(mctx value) :
+	current(std::make_shared<const mctx>(std::move(value))) {}
+
+mctx_store::mctx_store(mctx_snapshot snapshot) :
+	current(std::move(snapshot.root)) {}
+
+mctx_snapshot mctx_store::load() const
+{
+	return mctx_snapshot(this->current.load(std::memory_order_acquire));
+}
+
+void mctx_store::store(mctx_snapshot snapshot)
+{
+	this->current.store(std::move(snapshot.root), std::memory_order_release);
+	this->generation.fetch_add(1, std::memory_order_release);
+}
+
+mctx_store::reader::reader(const mctx_store& store) :
+	store(&store),
+	generation(store.generation.load(std::memory_order_acquire)),
+	cached(store.load()) {}
+
+const mctx_snapshot& mctx_store::reader::load()
+{
+	const auto latest = this->store->generation.load(std::memory_order_acquire);
+	if (latest != this->generation)
+	{
+		// Snapshot is at least as new as the generation, a newer one is picked up on the next bump
+		this->cached = this->store->load();
+		this->generation = latest;
+	}
+
+	return this->cached;
+}
+
+} // namespace dixelu
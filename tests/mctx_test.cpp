@@ -2,12 +2,23 @@
 
 #include <boost/test/included/unit_test.hpp>
 
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <numeric>
+#include <ranges>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "mctx.h"
+#include "mctx_binary.h"
 #include "mctx_json.h"
+#include "mctx_patch.h"
+#include "mctx_query.h"
+#include "mctx_snapshot.h"
 
 using dixelu::mctx;
 
@@ -228,4 +239,1410 @@ BOOST_AUTO_TEST_CASE(custom_head_test)
 	BOOST_CHECK(small_struct1.as<SmallStruct>().y == small_struct2.as<SmallStruct>().y);
 }
 
+BOOST_AUTO_TEST_CASE(custom_head_storage_test)
+{
+	struct SmallHandle
+	{
+		uint32_t id;
+		bool operator==(const SmallHandle& other) const { return id == other.id; }
+	};
+
+	struct BigPayload
+	{
+		std::string name;
+		std::vector<int> values;
+		char padding[64];
+		bool operator==(const BigPayload& other) const { return name == other.name && values == other.values; }
+	};
+
+	static_assert(dixelu::details::is_inline_storable<SmallHandle>);
+	static_assert(!dixelu::details::is_inline_storable<BigPayload>);
+	static_assert(dixelu::details::is_inline_storable<std::shared_ptr<int>>);
+	static_assert(dixelu::details::is_inline_storable<std::vector<int>>);
+
+	mctx small = SmallHandle{7};
+	mctx big = BigPayload{"payload", {1, 2, 3}, {}};
+
+	mctx small_copy = small;
+	mctx big_copy = big;
+	BOOST_CHECK(small_copy == small);
+	BOOST_CHECK(big_copy == big);
+	BOOST_CHECK_EQUAL(big_copy.as<BigPayload>().values.size(), 3);
+
+	mctx small_moved = std::move(small_copy);
+	mctx big_moved = std::move(big_copy);
+	BOOST_CHECK_EQUAL(small_moved.get<SmallHandle>().id, 7);
+	BOOST_CHECK_EQUAL(big_moved.as<BigPayload>().name, "payload");
+
+	dixelu::details::custom_head a{SmallHandle{1}};
+	dixelu::details::custom_head b{BigPayload{"b", {4}, {}}};
+	a.swap(b);
+	BOOST_CHECK(a.is<BigPayload>());
+	BOOST_CHECK(b.is<SmallHandle>());
+	BOOST_CHECK_EQUAL(a.as<BigPayload>().name, "b");
+	BOOST_CHECK_EQUAL(b.as<SmallHandle>().id, 1);
+
+	a = b;
+	BOOST_CHECK(a == b);
+	BOOST_CHECK(a.is<const SmallHandle>());
+	BOOST_CHECK(!a.is<BigPayload>());
+	BOOST_CHECK_EQUAL(std::string(a.get_type_name()), typeid(SmallHandle).name());
+	b.reset();
+	BOOST_CHECK(b.empty());
+	BOOST_CHECK(!a.empty());
+}
+
+BOOST_AUTO_TEST_CASE(arena_test)
+{
+	struct BigPayload
+	{
+		std::string name;
+		char padding[128];
+	};
+
+	struct counting_resource : std::pmr::memory_resource
+	{
+		size_t allocations = 0;
+
+		void* do_allocate(size_t bytes, size_t alignment) override
+		{
+			++allocations;
+			return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+		}
+
+		void do_deallocate(void* p, size_t bytes, size_t alignment) override
+		{
+			std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+	};
+
+	counting_resource counter;
+	mctx copy;
+
+	{
+		dixelu::mctx_resource_scope scope(&counter);
+
+		mctx doc;
+		for (int i = 0; i < 16; ++i)
+			doc["items"].push_back(i);
+		doc["nested"]["custom"] = BigPayload{"payload", {}};
+
+		BOOST_CHECK(counter.allocations > 0);
+		BOOST_CHECK(doc["items"].as<dixelu::mctx_array>().get_allocator().get_resource() == &counter);
+
+		// copies taken outside of the scope leave the arena behind
+		auto allocations = counter.allocations;
+		{
+			dixelu::mctx_resource_scope outer(std::pmr::new_delete_resource());
+			copy = doc;
+		}
+		BOOST_CHECK_EQUAL(counter.allocations, allocations);
+	}
+
+	BOOST_CHECK(dixelu::details::current_memory_resource() == std::pmr::new_delete_resource());
+	BOOST_CHECK_EQUAL(copy["items"].size(), 16);
+	BOOST_CHECK_EQUAL(copy["nested"]["custom"].as<BigPayload>().name, "payload");
+
+	{
+		dixelu::mctx_arena arena;
+		mctx doc;
+		for (int i = 0; i < 100; ++i)
+			doc["key_" + std::to_string(i)] = i;
+
+		BOOST_CHECK_EQUAL(doc.size(), 100);
+		BOOST_CHECK_EQUAL(doc.at("key_42").get<int>(), 42);
+	}
+
+	// Moving an object into one from another resource copies the entries over, so it may throw
+	static_assert(!std::is_nothrow_move_assignable_v<dixelu::mctx_object>);
+	static_assert(!std::is_nothrow_move_assignable_v<dixelu::mctx_packed_array>);
+	{
+		dixelu::mctx_object target;
+		dixelu::mctx_arena arena;
+
+		dixelu::mctx_object source;
+		for (int i = 0; i < 40; ++i)
+			source["key_" + std::to_string(i)] = i;
+
+		target = std::move(source);
+		BOOST_CHECK(target.get_allocator().get_resource() == std::pmr::new_delete_resource());
+		BOOST_CHECK_EQUAL(target.size(), 40);
+		BOOST_CHECK_EQUAL(target.at("key_33").get<int>(), 33);
+		BOOST_CHECK(target.find("key_40") == target.end());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(flat_object_test)
+{
+	mctx small;
+	small["b"] = 1;
+	small["a"] = 2;
+	small["c"] = 3;
+
+	// insertion order is kept
+	std::string order;
+	for (auto it = small.kvbegin(); it != small.kvend(); ++it)
+		order += it->first;
+	BOOST_CHECK_EQUAL(order, "bac");
+
+	mctx reordered;
+	reordered["c"] = 3;
+	reordered["b"] = 1;
+	reordered["a"] = 2;
+	BOOST_CHECK(small == reordered);
+
+	reordered["a"] = 4;
+	BOOST_CHECK(!(small == reordered));
+
+	// grows past the linear threshold and gets indexed
+	mctx big;
+	const size_t count = dixelu::mctx_object::linear_threshold * 8;
+	for (size_t i = 0; i < count; ++i)
+		big["key_" + std::to_string(i)] = i;
+
+	BOOST_CHECK_EQUAL(big.size(), count);
+	for (size_t i = 0; i < count; ++i)
+		BOOST_CHECK_EQUAL(big.at("key_" + std::to_string(i)).get<size_t>(), i);
+
+	BOOST_CHECK(big.find("key_missing") == big.end());
+
+	for (size_t i = 0; i < count; i += 2)
+		big.erase("key_" + std::to_string(i));
+
+	BOOST_CHECK_EQUAL(big.size(), count / 2);
+	for (size_t i = 0; i < count; ++i)
+		BOOST_CHECK_EQUAL(big.find("key_" + std::to_string(i)) != big.end(), i % 2 == 1);
+
+	mctx big_copy = big;
+	BOOST_CHECK(big_copy == big);
+	BOOST_CHECK_EQUAL(big_copy.at("key_99").get<int>(), 99);
+
+	auto kv = big_copy.kvbegin();
+	while (kv != big_copy.kvend())
+		kv = big_copy.erase(kv);
+	BOOST_CHECK(big_copy.empty());
+
+	// Order is kept past the threshold, through erasing and reassigning, and by the text formats
+	std::vector<std::string> expected;
+	for (size_t i = 1; i < count; i += 2)
+		expected.push_back("key_" + std::to_string(i));
+
+	big["key_9"] = -9;
+	std::vector<std::string> keys;
+	for (auto it = big.kvbegin(); it != big.kvend(); ++it)
+		keys.emplace_back(it->first);
+	BOOST_CHECK(keys == expected);
+
+	// Single erases keep the index in line without rebuilding it
+	dixelu::mctx_object churn;
+	std::vector<std::string> inserted;
+	uint64_t seed = 7;
+	for (size_t round = 0; round < 4000; ++round)
+	{
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		const auto key = "churn_" + std::to_string((seed >> 33) % 300);
+		const auto found = std::ranges::find(inserted, key);
+		if (found != inserted.end())
+		{
+			BOOST_CHECK_EQUAL(churn.erase(key), 1);
+			inserted.erase(found);
+		}
+		else
+		{
+			churn[key] = static_cast<int64_t>(round);
+			inserted.push_back(key);
+		}
+
+		if (round % 97 != 0)
+			continue;
+
+		BOOST_REQUIRE_EQUAL(churn.size(), inserted.size());
+		for (size_t i = 0; i < inserted.size(); ++i)
+		{
+			BOOST_CHECK(churn.begin()[static_cast<ptrdiff_t>(i)].first == inserted[i]);
+			BOOST_CHECK(churn.find(inserted[i]) == churn.begin() + static_cast<ptrdiff_t>(i));
+		}
+	}
+
+	const auto text = dixelu::mctx_json::serialize(small);
+	BOOST_CHECK_EQUAL(text, R"({"b":1,"a":2,"c":3})");
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize_mctx(small).dump(), R"({"a":2,"b":1,"c":3})");
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(dixelu::mctx_json::parse(text)), text);
+}
+
+BOOST_AUTO_TEST_CASE(string_view_lookup_test)
+{
+	mctx obj;
+	obj["id"] = 17;
+	obj[std::string("name")] = "seventeen";
+	obj[std::string_view("ratio")] = 0.5;
+
+	const std::string_view id_key = "id";
+	const mctx& cobj = obj;
+
+	BOOST_CHECK(cobj.find(id_key) != cobj.end());
+	BOOST_CHECK(cobj.kvfind("name") != cobj.kvend());
+	BOOST_CHECK_EQUAL(cobj.at(id_key).get<int>(), 17);
+	BOOST_CHECK_EQUAL(obj.at("name").get<std::string>(), "seventeen");
+
+	BOOST_CHECK_EQUAL(cobj.get<int>(id_key, -1), 17);
+	BOOST_CHECK_EQUAL(cobj.get<int>("missing", -1), -1);
+	BOOST_CHECK_CLOSE(cobj.get<double>("ratio", 0.0), 0.5, 0.0001);
+	BOOST_CHECK_EQUAL(cobj.get_as<std::string>("id"), "17");
+
+	obj.erase(std::string_view("ratio"));
+	obj.erase("name");
+	BOOST_CHECK_EQUAL(obj.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(compact_node_test)
+{
+	static_assert(sizeof(mctx) <= 16);
+	static_assert(!std::is_polymorphic_v<mctx>);
+
+	mctx negative = -42;
+	BOOST_CHECK(negative.kind() == mctx::value_kind::signed_integer);
+	BOOST_CHECK(negative.is<int>());
+	BOOST_CHECK_EQUAL(negative.get<int64_t>(), -42);
+	BOOST_CHECK_EQUAL(negative.get_as<double>(), -42.0);
+	BOOST_CHECK_EQUAL(negative.get_as<std::string>(), "-42");
+
+	mctx positive = 42u;
+	BOOST_CHECK(positive.kind() == mctx::value_kind::unsigned_integer);
+	BOOST_CHECK(positive.is<int>());
+	BOOST_CHECK(positive == mctx(42));
+	BOOST_CHECK(!(negative == mctx(static_cast<uint64_t>(-42))));
+
+	mctx doc;
+	doc["negative"] = -7;
+	doc["big"] = std::numeric_limits<uint64_t>::max();
+	doc["none"] = nullptr;
+
+	auto restored = dixelu::mctx_json::deserialize(dixelu::mctx_json::serialize(doc));
+	BOOST_CHECK(restored == doc);
+	BOOST_CHECK_EQUAL(restored["negative"].get<int64_t>(), -7);
+	BOOST_CHECK(restored["negative"].kind() == mctx::value_kind::signed_integer);
+	BOOST_CHECK(restored["none"].is_none());
+
+	mctx s = "moved";
+	mctx t = std::move(s);
+	BOOST_CHECK(s.is_none());
+	BOOST_CHECK_EQUAL(t.as<std::string>(), "moved");
+}
+
+BOOST_AUTO_TEST_CASE(packed_array_test)
+{
+	mctx numbers = std::vector<int>{3, 1, 2};
+	BOOST_CHECK(numbers.is_packed());
+	BOOST_CHECK(numbers.is_array());
+	BOOST_CHECK(numbers.kind() == mctx::value_kind::packed_array);
+	BOOST_CHECK_EQUAL(numbers.size(), 3);
+	BOOST_CHECK_EQUAL(numbers.as_packed<int64_t>()[1], 1);
+
+	const auto& view = numbers;
+	BOOST_CHECK_EQUAL(view[2].get<int>(), 2);
+
+	int sum = 0;
+	for (const auto& item : view)
+		sum += item.get<int>();
+	BOOST_CHECK_EQUAL(sum, 6);
+	BOOST_CHECK(numbers.is_packed());
+
+	numbers.push_back(4);
+	BOOST_CHECK(numbers.is_packed());
+	BOOST_CHECK_EQUAL(numbers.size(), 4);
+
+	mctx generic = mctx::make_array();
+	for (int i : {3, 1, 2, 4})
+		generic.push_back(i);
+	BOOST_CHECK(numbers == generic);
+	BOOST_CHECK(generic == numbers);
+
+	numbers.push_back("five");
+	BOOST_CHECK(!numbers.is_packed());
+	BOOST_CHECK_EQUAL(numbers.size(), 5);
+	BOOST_CHECK_EQUAL(numbers[4].as<std::string>(), "five");
+
+	BOOST_CHECK(generic.try_pack());
+	BOOST_CHECK(generic.is_packed());
+	generic[0] = 10;
+	BOOST_CHECK(!generic.is_packed());
+	BOOST_CHECK_EQUAL(generic[0].get<int>(), 10);
+
+	mctx doubles = mctx::make_packed_array<double>(2);
+	doubles.push_back(0.5);
+	doubles.push_back(1.5);
+	BOOST_CHECK(doubles.is_packed());
+
+	auto restored = dixelu::mctx_json::deserialize(dixelu::mctx_json::serialize(doubles));
+	BOOST_CHECK(!restored.is_packed());
+	BOOST_CHECK(restored == doubles);
+
+	// Signedness of packed integers is a storage detail too, same as for scalars
+	const mctx signed_packed = std::vector<int64_t>{1, 2};
+	const mctx unsigned_packed = std::vector<uint64_t>{1, 2};
+	BOOST_CHECK(signed_packed == unsigned_packed);
+	BOOST_CHECK(unsigned_packed == signed_packed);
+	BOOST_CHECK_EQUAL(signed_packed.hash(), unsigned_packed.hash());
+	BOOST_CHECK(!(mctx(std::vector<int64_t>{-1}) == mctx(std::vector<uint64_t>{std::numeric_limits<uint64_t>::max()})));
+	BOOST_CHECK(!(mctx(std::vector<int64_t>{1, 2}) == mctx(std::vector<uint64_t>{1, 2, 3})));
+	BOOST_CHECK(!(mctx(std::vector<int64_t>{1, 2}) == mctx(std::vector<double>{1, 2})));
+}
+
+BOOST_AUTO_TEST_CASE(copy_on_write_test)
+{
+	mctx defaults;
+	defaults["name"] = std::string(64, 'x');
+	for (int i = 0; i < 32; ++i)
+		defaults["limits"].push_back(i);
+	defaults["nested"]["level"] = "deep";
+
+	mctx copy = defaults;
+	const auto& shared_copy = copy;
+	const auto& shared_defaults = defaults;
+
+	BOOST_CHECK(&shared_copy.at("name").as<std::string>() == &shared_defaults.at("name").as<std::string>());
+	BOOST_CHECK(&shared_copy.at("limits").as<dixelu::mctx_array>() == &shared_defaults.at("limits").as<dixelu::mctx_array>());
+
+	// only the modified path is cloned
+	copy["nested"]["level"] = "changed";
+	BOOST_CHECK_EQUAL(defaults["nested"]["level"].as<std::string>(), "deep");
+	BOOST_CHECK_EQUAL(copy["nested"]["level"].as<std::string>(), "changed");
+	BOOST_CHECK(&shared_copy.at("limits").as<dixelu::mctx_array>() == &shared_defaults.at("limits").as<dixelu::mctx_array>());
+
+	copy["limits"].push_back(32);
+	copy["limits"].erase(copy["limits"].begin());
+	BOOST_CHECK_EQUAL(defaults["limits"].size(), 32);
+	BOOST_CHECK_EQUAL(copy["limits"].size(), 32);
+	BOOST_CHECK_EQUAL(defaults["limits"][0].get<int>(), 0);
+	BOOST_CHECK_EQUAL(copy["limits"][0].get<int>(), 1);
+
+	copy["name"].as<std::string>()[0] = 'y';
+	BOOST_CHECK_EQUAL(defaults["name"].as<std::string>()[0], 'x');
+
+	BOOST_CHECK(!(copy == defaults));
+	defaults = copy;
+	BOOST_CHECK(copy == defaults);
+
+	// References taken before a copy only ever reach the original
+	mctx doc;
+	doc["child"]["k"] = 1;
+	mctx& child = doc["child"];
+	mctx before = doc;
+	child["k"] = 2;
+	BOOST_CHECK_EQUAL(before.at("child").at("k").get<int>(), 1);
+	BOOST_CHECK_EQUAL(doc.at("child").at("k").get<int>(), 2);
+
+	doc["list"].push_back(0);
+	doc["list"].push_back(1);
+	auto iter = ++doc["list"].begin();
+	before = doc;
+	*iter = 5;
+	BOOST_CHECK_EQUAL(before.at("list").at(1).get<int>(), 1);
+	BOOST_CHECK_EQUAL(doc.at("list").at(1).get<int>(), 5);
+
+	// Elements holding references keep the arrays they are appended to unshared
+	mctx held;
+	mctx& inner = held["inner"];
+	mctx list = mctx::make_array();
+	list.push_back(std::move(held));
+	mctx list_copy = list;
+	inner = "changed";
+	BOOST_CHECK(list_copy.at(0).at("inner").is_none());
+	BOOST_CHECK_EQUAL(list.at(0).at("inner").as<std::string>(), "changed");
+
+	// Appending and erasing hand out no references, the nodes stay shared
+	mctx appended = mctx::make_array();
+	for (int i = 0; i < 4; ++i)
+		appended.push_back(std::string(32, 'a' + i));
+	mctx appended_copy = appended;
+	BOOST_CHECK(&std::as_const(appended).as<dixelu::mctx_array>() == &std::as_const(appended_copy).as<dixelu::mctx_array>());
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_test)
+{
+	mctx config;
+	config["service"]["name"] = "api";
+	config["service"]["threads"] = 4;
+	config["limits"]["rps"] = 100;
+
+	dixelu::mctx_snapshot base(config);
+	auto changed = base.set({"service", "threads"}, 8);
+
+	BOOST_CHECK_EQUAL(base->at("service").at("threads").get<int>(), 4);
+	BOOST_CHECK_EQUAL(changed->at("service").at("threads").get<int>(), 8);
+
+	// untouched subtrees are shared between the snapshots
+	BOOST_CHECK(&base->at("limits").as<dixelu::mctx_object>() == &changed->at("limits").as<dixelu::mctx_object>());
+	BOOST_CHECK(&base->at("service").at("name").as<std::string>() == &changed->at("service").at("name").as<std::string>());
+
+	// Paths mutated by one update are shared again by the next
+	auto again = changed.set({"limits", "burst"}, 10);
+	BOOST_CHECK(&changed->at("service").as<dixelu::mctx_object>() == &again->at("service").as<dixelu::mctx_object>());
+
+	auto erased = changed.erase({"limits", "rps"});
+	BOOST_CHECK(erased.find({"limits", "rps"}) == nullptr);
+	BOOST_CHECK(changed.find({"limits", "rps"}) != nullptr);
+	BOOST_CHECK(erased.find({"service", "missing", "key"}) == nullptr);
+
+	dixelu::mctx_store store(base);
+	std::atomic<bool> done = false;
+	std::atomic<size_t> inconsistent = 0;
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; ++i)
+	{
+		readers.emplace_back([&]
+		{
+			while (!done.load())
+			{
+				auto snapshot = store.load();
+				auto threads = snapshot->at("service").at("threads").get<int64_t>();
+				if (snapshot->at("limits").at("rps").get<int64_t>() != threads * 25)
+					++inconsistent;
+			}
+		});
+	}
+
+	// Cached readers never see an older snapshot than the one they saw before
+	std::atomic<size_t> went_back = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		readers.emplace_back([&]
+		{
+			dixelu::mctx_store::reader reader(store);
+			int64_t last = 0;
+
+			while (!done.load())
+			{
+				const auto& snapshot = reader.load();
+				auto threads = snapshot->at("service").at("threads").get<int64_t>();
+				if (snapshot->at("limits").at("rps").get<int64_t>() != threads * 25)
+					++inconsistent;
+				if (threads < last)
+					++went_back;
+				last = threads;
+			}
+		});
+	}
+
+	// Past the base value, so every published snapshot is newer than the ones before
+	for (int64_t i = 5; i <= 200; ++i)
+	{
+		store.update([i](mctx& root)
+		{
+			root["service"]["threads"] = i;
+			root["limits"]["rps"] = i * 25;
+		});
+	}
+
+	done = true;
+	for (auto& reader : readers)
+		reader.join();
+
+	BOOST_CHECK_EQUAL(inconsistent.load(), 0);
+	BOOST_CHECK_EQUAL(went_back.load(), 0);
+	BOOST_CHECK_EQUAL(store.load()->at("service").at("threads").get<int>(), 200);
+
+	dixelu::mctx_store::reader reader(store);
+	const auto* first = &reader.load().get();
+	BOOST_CHECK(&reader.load().get() == first);
+	store.store(base);
+	BOOST_CHECK_EQUAL(reader.load()->at("service").at("threads").get<int>(), 4);
+	BOOST_CHECK_EQUAL(base->at("service").at("threads").get<int>(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(visit_test)
+{
+	mctx doc;
+	doc["name"] = "visit";
+	doc["count"] = 3;
+	doc["list"] = std::vector<double>{1.0, 2.0};
+	doc["nested"]["flag"] = true;
+
+	auto describe = [](const mctx& value)
+	{
+		return value.visit(dixelu::details::overloaded{
+			[](const std::string&) { return std::string("string"); },
+			[](int64_t) { return std::string("int"); },
+			[](const dixelu::mctx_packed_array& p) { return "packed:" + std::to_string(p.size()); },
+			[](const dixelu::mctx_object&) { return std::string("object"); },
+			[](const auto&) { return std::string("other"); }
+		});
+	};
+
+	BOOST_CHECK_EQUAL(describe(doc), "object");
+	BOOST_CHECK_EQUAL(describe(doc.at("name")), "string");
+	BOOST_CHECK_EQUAL(describe(doc.at("count")), "int");
+	BOOST_CHECK_EQUAL(describe(doc.at("list")), "packed:2");
+	BOOST_CHECK_EQUAL(describe(doc.at("nested").at("flag")), "other");
+
+	const auto& view = doc;
+	BOOST_CHECK(view.if_object() != nullptr);
+	BOOST_CHECK(view.if_array() == nullptr);
+	BOOST_CHECK_EQUAL(*view.at("name").if_string(), "visit");
+	BOOST_CHECK(view.at("count").if_string() == nullptr);
+	BOOST_CHECK_EQUAL(view.at("list").if_array()->size(), 2);
+	BOOST_CHECK(doc["list"].is_packed());
+
+	doc["list"].if_array()->push_back("three");
+	BOOST_CHECK(!doc["list"].is_packed());
+	BOOST_CHECK_EQUAL(doc["list"].size(), 3);
+
+	doc.visit([](auto& v)
+	{
+		if constexpr (std::is_same_v<std::remove_cvref_t<decltype(v)>, dixelu::mctx_object>)
+			v["added"] = 1;
+	});
+	BOOST_CHECK(doc.if_object()->contains("added"));
+}
+
+BOOST_AUTO_TEST_CASE(json_writer_test)
+{
+	// Keys are inserted in order so the DOM (which sorts them) gives the same text
+	mctx doc;
+	doc["array"] = std::vector<int>{1, -2, 3};
+	doc["double"] = 2.0;
+	doc["empty"] = mctx::make_object();
+	doc["escaped"] = "quote\" slash\\ tab\t ctl\x01 \xc3\xa9 \xf0\x9f\x98\x80";
+	doc["fraction"] = 0.1;
+	doc["nested"]["list"].push_back(true);
+	doc["nested"]["list"].push_back(nullptr);
+	doc["unsigned"] = std::numeric_limits<uint64_t>::max();
+
+	using dixelu::mctx_json::serialize_mctx;
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(doc), serialize_mctx(doc).dump());
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize_pretty(doc), serialize_mctx(doc).dump(1, '\t', true));
+
+	std::ostringstream stream;
+	dixelu::mctx_json::write(doc, stream, { 2, ' ', false });
+	BOOST_CHECK_EQUAL(stream.str(), serialize_mctx(doc).dump(2, ' ', false));
+
+	mctx big = mctx::make_array();
+	for (int i = 0; i < 10000; ++i)
+		big.push_back(std::to_string(i));
+
+	std::ostringstream big_stream;
+	dixelu::mctx_json::write(big, big_stream);
+	BOOST_CHECK_EQUAL(big_stream.str(), dixelu::mctx_json::serialize(big));
+
+	mctx invalid = "\xc3";
+	BOOST_CHECK(check_exception([&]() { (void)dixelu::mctx_json::serialize(invalid); }));
+
+	// Doubles switch to exponent notation where json::dump does
+	const std::vector<double> doubles = {
+		123456789012345680.0, 1e15, 1e14, 123456789012345.6, 1.5, -2.0, -0.0, 0.0,
+		0.1, 0.0001, 0.00012345, 0.00001, -1.5e-7, 1e100, 1.7976931348623157e308, 5e-324
+	};
+
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(mctx(doubles)),
+		"[1.2345678901234568e+17,1e+15,100000000000000.0,123456789012345.6,1.5,-2.0,-0.0,0.0,"
+		"0.1,0.0001,0.00012345,1e-05,-1.5e-07,1e+100,1.7976931348623157e+308,5e-324]");
+
+	mctx unpacked = mctx::make_array();
+	for (double value : doubles)
+	{
+		unpacked.push_back(value);
+		BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(mctx(value)), serialize_mctx(mctx(value)).dump());
+	}
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(unpacked), dixelu::mctx_json::serialize(mctx(doubles)));
+}
+
+BOOST_AUTO_TEST_CASE(json_parser_test)
+{
+	const std::string text = R"( {
+		"int": -12, "uint": 18446744073709551615, "huge": 18446744073709551616,
+		"double": 1.5e3, "zero": -0, "flag": false, "none": null,
+		"text": "tab\t \u00e9 \ud83d\ude00 \/ \"q\"",
+		"list": [1, [2, [3, []]], {}], "dup": 1, "dup": 2
+	} )";
+
+	auto native = dixelu::mctx_json::parse(text);
+	auto dom = dixelu::mctx_json::deserialize_mctx(dixelu::mctx_json::json::parse(text));
+	BOOST_CHECK(native == dom);
+
+	BOOST_CHECK(native["int"].kind() == mctx::value_kind::signed_integer);
+	BOOST_CHECK(native["uint"].kind() == mctx::value_kind::unsigned_integer);
+	BOOST_CHECK(native["huge"].kind() == mctx::value_kind::float64);
+	BOOST_CHECK_EQUAL(native["double"].get<double>(), 1500.0);
+	BOOST_CHECK_EQUAL(native["text"].as<std::string>(), "tab\t \xc3\xa9 \xf0\x9f\x98\x80 / \"q\"");
+	BOOST_CHECK_EQUAL(native["dup"].get<int>(), 2);
+	BOOST_CHECK_EQUAL(native["list"][1][1][1].size(), 0);
+
+	for (const char* bad : { "", "[1,]", "{\"a\" 1}", "[1] 2", "\"\\ud800\"", "01", "\"\x01\"", "\"\xc3\"", "tru", "{\"a\":1,}", "-" })
+		BOOST_CHECK_MESSAGE(check_exception([&]() { (void)dixelu::mctx_json::parse(bad); }), bad);
+}
+
+BOOST_AUTO_TEST_CASE(json_scan_test)
+{
+	using dixelu::mctx_json::details::scan_string;
+	using dixelu::mctx_json::details::validate_utf8;
+
+	const std::vector<std::string> valid = { "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbf", "\xf4\x8f\xbf\xbf" };
+	const std::vector<std::string> invalid = {
+		"\x80", "\xc0\x80", "\xe0\x80\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf0\x80\x80\x80", "\xff", "\xc3", "\xe2\x82", "\xf0\x9f\x98"
+	};
+
+	// Shifting the sequence around checks the block boundaries of the vectorized paths
+	for (size_t offset = 0; offset < 70; ++offset)
+	{
+		const std::string padding(offset, 'a');
+
+		for (const auto& sequence : valid)
+			BOOST_CHECK(validate_utf8(padding + sequence + padding));
+
+		for (const auto& sequence : invalid)
+		{
+			BOOST_CHECK(!validate_utf8(padding + sequence + padding));
+			BOOST_CHECK(!validate_utf8(padding + sequence));
+		}
+
+		bool non_ascii = false;
+		BOOST_CHECK_EQUAL(scan_string(padding + "\"tail", non_ascii), offset);
+		BOOST_CHECK(!non_ascii);
+
+		BOOST_CHECK_EQUAL(scan_string(padding + "\xc3\xa9\\", non_ascii), offset + 2);
+		BOOST_CHECK(non_ascii);
+
+		non_ascii = false;
+		BOOST_CHECK_EQUAL(scan_string(padding + "\n\xc3\xa9", non_ascii), offset);
+		BOOST_CHECK(!non_ascii);
+		BOOST_CHECK_EQUAL(scan_string(padding, non_ascii), offset);
+	}
+
+	const std::string long_text(1000, 'x');
+	auto parsed = dixelu::mctx_json::parse("[\"" + long_text + "\xc3\xa9\\n\"]");
+	BOOST_CHECK_EQUAL(parsed[0].as<std::string>(), long_text + "\xc3\xa9\n");
+	BOOST_CHECK(check_exception([&]() { (void)dixelu::mctx_json::parse("[\"" + long_text + "\xed\xa0\x80\"]"); }));
+}
+
+BOOST_AUTO_TEST_CASE(string_slice_test)
+{
+	const std::string long_text = "a fairly long string value without escapes";
+	auto text = std::make_shared<const std::string>(
+		R"({"long": ")" + long_text + R"(", "short": "tiny", "escaped": "a fairly long string with \"escapes\""})");
+
+	auto doc = dixelu::mctx_json::parse_shared(text);
+
+	BOOST_CHECK(doc["long"].is_slice());
+	BOOST_CHECK(doc["long"].kind() == mctx::value_kind::string_slice);
+	BOOST_CHECK(!doc["short"].is_slice());
+	BOOST_CHECK(!doc["escaped"].is_slice());
+	BOOST_CHECK_EQUAL(doc["escaped"].as<std::string>(), "a fairly long string with \"escapes\"");
+
+	const auto& view = doc;
+	const auto slice_text = view.at("long").as_string_view();
+	BOOST_CHECK_EQUAL(slice_text, long_text);
+	BOOST_CHECK(slice_text.data() >= text->data() && slice_text.data() < text->data() + text->size());
+
+	BOOST_CHECK(view.at("long").is<std::string>());
+	BOOST_CHECK_EQUAL(view.at("long").get<std::string>(), long_text);
+	BOOST_CHECK_EQUAL(view.at("long").as<std::string>(), long_text);
+	BOOST_CHECK_EQUAL(*view.at("long").if_string(), long_text);
+	BOOST_CHECK(view.at("long").is_slice());
+	BOOST_CHECK(view.at("long") == mctx(long_text));
+	BOOST_CHECK(mctx(long_text) == view.at("long"));
+
+	// the tree keeps the text alive
+	std::weak_ptr<const std::string> watch = text;
+	text.reset();
+	BOOST_CHECK(!watch.expired());
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(doc["long"]), "\"" + long_text + "\"");
+
+	doc["long"].as<std::string>() += "!";
+	BOOST_CHECK(!doc["long"].is_slice());
+	BOOST_CHECK_EQUAL(doc["long"].as_string_view(), long_text + "!");
+
+	doc = mctx();
+	BOOST_CHECK(watch.expired());
+}
+
+BOOST_AUTO_TEST_CASE(key_interning_test)
+{
+	auto records = dixelu::mctx_json::parse(R"([{"id": 1, "ts": 10}, {"id": 2, "ts": 20}, {"ts": 30, "id": 3}])");
+
+	const auto& first = records[0].as<dixelu::mctx_object>();
+	const auto& second = records[1].as<dixelu::mctx_object>();
+	const auto& third = records[2].as<dixelu::mctx_object>();
+
+	// equal keys share one atom
+	BOOST_CHECK(first.begin()->first.data() == second.begin()->first.data());
+	BOOST_CHECK(third.begin()->first.data() == first.find("ts")->first.data());
+
+	dixelu::mctx_key ts("ts");
+	BOOST_CHECK(ts == first.begin()[1].first);
+	BOOST_CHECK(ts == "ts");
+	BOOST_CHECK_EQUAL(ts.view(), "ts");
+	BOOST_CHECK_EQUAL(ts.hash(), dixelu::details::key_hash("ts"));
+	BOOST_CHECK_EQUAL(third.find(ts)->second.get<int>(), 30);
+	BOOST_CHECK(!first.contains(dixelu::mctx_key("value")));
+
+	mctx built;
+	for (int i = 0; i < 64; ++i)
+		built["key_" + std::to_string(i)] = i;
+
+	dixelu::mctx_key key_42("key_42");
+	BOOST_CHECK_EQUAL(built.as<dixelu::mctx_object>().find(key_42)->second.get<int>(), 42);
+	BOOST_CHECK_EQUAL(built.as<dixelu::mctx_object>()[key_42].get<int>(), 42);
+
+	dixelu::mctx_key empty;
+	BOOST_CHECK(empty.empty());
+	BOOST_CHECK(empty == dixelu::mctx_key(""));
+	BOOST_CHECK_EQUAL(std::string(empty.data()), "");
+
+	dixelu::mctx_key moved = std::move(ts);
+	BOOST_CHECK(ts.empty());
+	BOOST_CHECK_EQUAL(moved.view(), "ts");
+}
+
+BOOST_AUTO_TEST_CASE(path_test)
+{
+	mctx doc;
+	doc["a"]["b"] = std::vector<int>{10, 20, 30, 40};
+	doc["a"]["c"].push_back("zero");
+	doc["a"]["c"].push_back(mctx::make_object());
+	doc["a"]["c"][1]["name"] = "nested";
+	doc["ratio"] = "0.25";
+
+	static const dixelu::mctx_path b3{"a", "b", 3};
+	static const dixelu::mctx_path name{"a", "c", 1, "name"};
+	const dixelu::mctx_path missing{"a", "x", 0};
+	const dixelu::mctx_path out_of_range{"a", "b", 10};
+
+	const auto& view = doc;
+	BOOST_CHECK_EQUAL(view.get<int>(b3, -1), 40);
+	BOOST_CHECK_EQUAL(view.get<std::string>(name), "nested");
+	BOOST_CHECK_EQUAL(view.get<int>(missing, -1), -1);
+	BOOST_CHECK_EQUAL(view.get<int>(out_of_range, -1), -1);
+	BOOST_CHECK_EQUAL(view.get<int>(dixelu::mctx_path{"a", "b", "key"}, -1), -1);
+	BOOST_CHECK_EQUAL(view.get_as<std::string>(b3), "40");
+	BOOST_CHECK(view.resolve(dixelu::mctx_path{}) == &view);
+	BOOST_CHECK(doc["a"]["b"].is_packed());
+
+	mctx copy = doc;
+	*copy.resolve(name) = "changed";
+	BOOST_CHECK_EQUAL(copy.get<std::string>(name), "changed");
+	BOOST_CHECK_EQUAL(doc.get<std::string>(name), "nested");
+	BOOST_CHECK(copy.resolve(missing) == nullptr);
+
+	dixelu::mctx_path built;
+	built.append("a").append(dixelu::mctx_key("c")).append(0);
+	BOOST_CHECK_EQUAL(view.get<std::string>(built), "zero");
+	BOOST_CHECK(check_exception([]() { dixelu::mctx_path bad{"a", -1}; }));
+}
+
+BOOST_AUTO_TEST_CASE(query_test)
+{
+	using dixelu::mctx_query;
+
+	mctx doc = dixelu::mctx_json::parse(R"({
+		"store": {
+			"items": [
+				{ "name": "pen", "price": 2, "qty": 10 },
+				{ "name": "book", "price": 12.5, "qty": 3 },
+				{ "name": "lamp", "price": 30, "qty": 7, "tags": ["home", "light"] }
+			],
+			"owner": { "name": "ann" }
+		},
+		"limit": 5,
+		"ids": [1, 2, 3, 4, 5]
+	})");
+
+	const auto names = [&doc](const mctx_query& query)
+	{
+		std::vector<std::string> out;
+		query.for_each(doc, [&out](const mctx& match) { out.push_back(dixelu::mctx_json::serialize(match)); });
+		return out;
+	};
+
+	using list = std::vector<std::string>;
+	BOOST_CHECK(names(mctx_query("$.store.items[*].price")) == (list{ "2", "12.5", "30" }));
+	BOOST_CHECK(names(mctx_query("$['store']['items'][-1].name")) == (list{ "\"lamp\"" }));
+	BOOST_CHECK(names(mctx_query("$.store.items[?(@.qty > 5)].name")) == (list{ "\"pen\"", "\"lamp\"" }));
+	BOOST_CHECK(names(mctx_query("$.store.items[?(@.qty > $.limit && @.price < 10)].name")) == (list{ "\"pen\"" }));
+	BOOST_CHECK(names(mctx_query("$.store.items[?(@.tags)].tags[0]")) == (list{ "\"home\"" }));
+	BOOST_CHECK(names(mctx_query("$.store.items[?(!(@.name == 'pen') || @.price >= 30)].qty")) == (list{ "3", "7" }));
+	BOOST_CHECK(names(mctx_query("$..name")) == (list{ "\"pen\"", "\"book\"", "\"lamp\"", "\"ann\"" }));
+	BOOST_CHECK(names(mctx_query("$.store..tags[*]")) == (list{ "\"home\"", "\"light\"" }));
+	BOOST_CHECK(names(mctx_query(R"($.store.items[?(@.name == 'l\u0061mp')].qty)")) == (list{ "7" }));
+
+	// Escapes in quoted names decode to UTF-8, surrogate pairs included
+	mctx unicode;
+	unicode["\xc3\xa9\xf0\x9f\x98\x80"] = 1;
+	size_t found = 0;
+	mctx_query(R"($['\u00e9\ud83d\ude00'])").for_each(unicode, [&found](const mctx& match) { found += match.get<size_t>(); });
+	BOOST_CHECK_EQUAL(found, 1);
+
+	// Packed arrays are served from their mirror
+	BOOST_CHECK(doc["ids"].try_pack());
+	BOOST_CHECK(names(mctx_query("$.ids[1:4]")) == (list{ "2", "3", "4" }));
+	BOOST_CHECK(names(mctx_query("$.ids[::-2]")) == (list{ "5", "3", "1" }));
+	BOOST_CHECK(names(mctx_query("$.ids[0:10:9223372036854775807]")) == (list{ "1" }));
+	BOOST_CHECK(names(mctx_query("$.ids[::-9223372036854775808]")) == (list{ "5" }));
+	BOOST_CHECK(names(mctx_query("$.ids[1::5]")) == (list{ "2" }));
+	BOOST_CHECK(names(mctx_query("$.ids[0, -1]")) == (list{ "1", "5" }));
+	BOOST_CHECK(names(mctx_query("$.ids[?(@ >= 4)]")) == (list{ "4", "5" }));
+
+	// Matches point into the document
+	const mctx_query owner("$.store.owner");
+	BOOST_CHECK(owner.first(doc) == &doc.at("store").at("owner"));
+	BOOST_CHECK_EQUAL(mctx_query("$..*").count(doc), 26);
+	BOOST_CHECK(mctx_query("$.missing[0]").first(doc) == nullptr);
+	BOOST_CHECK_EQUAL(owner.expression(), "$.store.owner");
+
+	BOOST_CHECK(check_exception([]() { mctx_query("store"); }));
+	BOOST_CHECK(check_exception([]() { mctx_query("$.items[?(@.a > )]"); }));
+	BOOST_CHECK(check_exception([]() { mctx_query("$.items[1"); }));
+}
+
+BOOST_AUTO_TEST_CASE(range_view_test)
+{
+	static_assert(std::ranges::contiguous_range<mctx::array_view>);
+	static_assert(std::ranges::contiguous_range<mctx::const_object_view>);
+	static_assert(std::ranges::view<mctx::const_array_view>);
+
+	mctx doc;
+	for (int i = 0; i < 100; ++i)
+		doc["values"].push_back(i);
+	doc["packed"] = std::vector<int>{1, 2, 3};
+	doc["name"] = "x";
+
+	const auto& view = doc;
+	int64_t sum = 0;
+	for (const auto& element : view.at("values").elements())
+		sum += element.get<int64_t>();
+	BOOST_CHECK_EQUAL(sum, 4950);
+
+	auto evens = view.at("values").elements() | std::views::filter([](const mctx& m) { return m.get<int64_t>() % 2 == 0; });
+	BOOST_CHECK_EQUAL(std::ranges::distance(evens), 50);
+
+	// Const access to packed arrays goes through the mirror and keeps them packed
+	BOOST_CHECK_EQUAL(view.at("packed").elements().size(), 3);
+	BOOST_CHECK_EQUAL(view.at("packed").elements()[2].get<int>(), 3);
+	BOOST_CHECK(view.at("packed").is_packed());
+
+	std::vector<std::string> keys;
+	for (const auto& [key, value] : view.members())
+		keys.push_back(key.str());
+	BOOST_CHECK(keys == (std::vector<std::string>{ "values", "packed", "name" }));
+	BOOST_CHECK_EQUAL(std::ranges::distance(std::views::values(view.members()) | std::views::filter(&mctx::is_array)), 2);
+
+	// Other kinds give empty views
+	BOOST_CHECK(view.at("name").elements().empty());
+	BOOST_CHECK(view.at("values").members().empty());
+	BOOST_CHECK(mctx().elements().empty());
+
+	// Mutable views unshare and unpack
+	mctx copy = doc;
+	for (auto& element : copy["values"].elements())
+		element = element.get<int64_t>() * 2;
+	for (auto& element : copy["packed"].elements())
+		element = "s";
+	BOOST_CHECK(!copy.at("packed").is_packed());
+	BOOST_CHECK_EQUAL(copy.at("values").at(99).get<int64_t>(), 198);
+	BOOST_CHECK_EQUAL(doc.at("values").at(99).get<int64_t>(), 99);
+	BOOST_CHECK(doc.at("packed").is_packed());
+
+	for (auto& [key, value] : copy.members())
+		value = key.str();
+	BOOST_CHECK_EQUAL(copy.at("name").get<std::string>(), "name");
+	BOOST_CHECK_EQUAL(doc.at("name").get<std::string>(), "x");
+}
+
+BOOST_AUTO_TEST_CASE(erase_if_test)
+{
+	mctx arr = mctx::make_array();
+	for (int i = 0; i < 1000; ++i)
+		arr.push_back(i);
+
+	mctx shared = arr;
+	BOOST_CHECK_EQUAL(arr.erase_if([](const mctx& m) { return m.get<int64_t>() % 3 != 0; }), 666);
+	BOOST_CHECK_EQUAL(arr.size(), 334);
+	BOOST_CHECK_EQUAL(arr.at(1).get<int64_t>(), 3);
+	BOOST_CHECK_EQUAL(shared.size(), 1000);
+
+	BOOST_CHECK_EQUAL(arr.retain([](const mctx& m) { return m.get<int64_t>() < 30; }), 324);
+	BOOST_CHECK_EQUAL(arr.size(), 10);
+	BOOST_CHECK_EQUAL(arr.at(9).get<int64_t>(), 27);
+
+	mctx packed = std::vector<double>{0.5, 1.5, 2.5, 3.5};
+	BOOST_CHECK_EQUAL(packed.erase_if([](const mctx& m) { return m.get<double>() > 2; }), 2);
+	BOOST_CHECK(packed.is_packed());
+	BOOST_CHECK(packed == (mctx(std::vector<double>{0.5, 1.5})));
+
+	mctx obj;
+	for (int i = 0; i < 40; ++i)
+		obj["key_" + std::to_string(i)] = i;
+
+	BOOST_CHECK_EQUAL(obj.erase_if([](const dixelu::mctx_key& key, const mctx&) { return key.find("key_1") != std::string_view::npos; }), 11);
+	BOOST_CHECK_EQUAL(obj.retain([](const mctx& value) { return value.get<int64_t>() < 35; }), 5);
+	BOOST_CHECK_EQUAL(obj.size(), 24);
+	BOOST_CHECK(!std::as_const(obj).if_object()->contains("key_15"));
+	BOOST_CHECK_EQUAL(obj.at("key_34").get<int64_t>(), 34);
+
+	BOOST_CHECK_EQUAL(mctx("text").erase_if([](const mctx&) { return true; }), 0);
+	BOOST_CHECK(check_exception([]() { mctx::make_array().erase_if([](const dixelu::mctx_key&, const mctx&) { return true; }); }));
+}
+
+BOOST_AUTO_TEST_CASE(erase_batch_test)
+{
+	mctx arr = std::vector<int>{0, 1, 2, 3, 4, 5};
+
+	{
+		mctx::erase_batch batch(arr);
+		BOOST_CHECK(batch.erase(1));
+		BOOST_CHECK(!batch.erase(1));
+		BOOST_CHECK(batch.erase(4));
+
+		// Positions stay valid until the batch is committed
+		BOOST_CHECK_EQUAL(arr.size(), 6);
+		BOOST_CHECK(batch.erased(4));
+		BOOST_CHECK_EQUAL(batch.pending(), 2);
+		BOOST_CHECK(check_exception([&]() { batch.erase(6); }));
+
+		arr.push_back(6);
+		BOOST_CHECK(batch.erase(6));
+	}
+
+	BOOST_CHECK(arr.is_packed());
+	BOOST_CHECK(arr == (mctx(std::vector<int>{0, 2, 3, 5})));
+
+	mctx obj;
+	obj["a"] = 1;
+	obj["b"] = 2;
+	obj["c"] = 3;
+
+	mctx::erase_batch batch(obj);
+	BOOST_CHECK(batch.erase("b"));
+	BOOST_CHECK(!batch.erase("missing"));
+	BOOST_CHECK(batch.erase(0));
+	BOOST_CHECK_EQUAL(batch.commit(), 2);
+	BOOST_CHECK_EQUAL(batch.commit(), 0);
+	BOOST_CHECK_EQUAL(obj.size(), 1);
+	BOOST_CHECK_EQUAL(obj.at("c").get<int>(), 3);
+
+	BOOST_CHECK(check_exception([]() { mctx value = 5; mctx::erase_batch bad(value); }));
+}
+
+BOOST_AUTO_TEST_CASE(hash_test)
+{
+	const mctx doc = dixelu::mctx_json::parse(R"({"a": [1, 2, 3], "b": {"x": "long enough to be a string slice", "y": -0.0}, "c": null})");
+
+	// Key order, packing, slicing and integer signedness don't change the hash
+	mctx same;
+	same["c"] = nullptr;
+	same["b"]["y"] = 0.0;
+	same["b"]["x"] = std::string("long enough to be a string slice");
+	same["a"] = std::vector<uint64_t>{1, 2, 3};
+
+	BOOST_CHECK(same.at("a").is_packed());
+	BOOST_CHECK(same == doc);
+	BOOST_CHECK_EQUAL(same.hash(), doc.hash());
+	BOOST_CHECK_EQUAL(std::hash<mctx>()(doc), doc.hash());
+	BOOST_CHECK_EQUAL(mctx(5).hash(), mctx(5u).hash());
+
+	// Mutable access drops the cached hash of the node
+	const auto before = same.hash();
+	same["a"].push_back(4);
+	BOOST_CHECK_NE(same.hash(), before);
+	BOOST_CHECK(!(same == doc));
+	same["a"].erase_if([](const mctx& m) { return m.get<int64_t>() == 4; });
+	BOOST_CHECK_EQUAL(same.hash(), before);
+	BOOST_CHECK(same == doc);
+
+	// Copies share nodes and compare equal without a walk, the original keeps its hash
+	mctx copy = doc;
+	BOOST_CHECK(copy == doc);
+	copy["b"]["x"] = "changed";
+	BOOST_CHECK(!(copy == doc));
+	BOOST_CHECK_NE(copy.hash(), doc.hash());
+	BOOST_CHECK_EQUAL(doc.hash(), before);
+
+	std::unordered_map<mctx, int> seen;
+	seen[doc] = 1;
+	seen[same] += 1;
+	seen[copy] = 3;
+	BOOST_CHECK_EQUAL(seen.size(), 2);
+	BOOST_CHECK_EQUAL(seen.at(doc), 2);
+
+	// Mutation through a reference taken before hashing doesn't leave a stale hash behind
+	mctx a;
+	a["x"]["y"] = 1;
+	mctx& x = a["x"];
+	const auto first = a.hash();
+	x["y"] = 2;
+
+	mctx b;
+	b["x"]["y"] = 2;
+	BOOST_CHECK(a == b);
+	BOOST_CHECK_EQUAL(a.hash(), b.hash());
+	BOOST_CHECK_NE(a.hash(), first);
+	BOOST_CHECK(dixelu::mctx_diff(a, b).empty());
+
+	// A copy keeps the hash of the state it was taken in
+	const mctx old = a;
+	BOOST_CHECK(old == a);
+	BOOST_CHECK_EQUAL(old.hash(), a.hash());
+	a["x"]["y"] = 3;
+	BOOST_CHECK(!(old == a));
+	BOOST_CHECK_EQUAL(old.hash(), b.hash());
+	BOOST_CHECK_EQUAL(dixelu::mctx_diff(old, a).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(patch_test)
+{
+	using dixelu::mctx_json::parse;
+	using dixelu::mctx_json::serialize;
+
+	const mctx from = parse(R"({"name": "cfg", "list": [1, 2, 3, 4], "nested": {"a/b": 1, "c~d": [true], "gone": null}, "big": [{"x": 1}, {"x": 2}]})");
+	const mctx to = parse(R"({"name": "cfg", "list": [1, 2, 9, 3, 4], "nested": {"a/b": 2, "c~d": [true, false], "new": {"k": "v"}}, "big": [{"x": 2}]})");
+
+	const mctx patch = dixelu::mctx_diff(from, to);
+	BOOST_CHECK_EQUAL(serialize(patch),
+		R"([{"op":"add","path":"/list/2","value":9},)"
+		R"({"op":"replace","path":"/nested/a~1b","value":2},)"
+		R"({"op":"add","path":"/nested/c~0d/1","value":false},)"
+		R"({"op":"remove","path":"/nested/gone"},)"
+		R"({"op":"add","path":"/nested/new","value":{"k":"v"}},)"
+		R"({"op":"remove","path":"/big/0"}])");
+
+	mctx target = from;
+	dixelu::apply_patch(target, patch);
+	BOOST_CHECK(target == to);
+
+	// Identical trees give an empty patch, packing is not a difference
+	BOOST_CHECK_EQUAL(dixelu::mctx_diff(to, target).size(), 0);
+	BOOST_CHECK_EQUAL(dixelu::mctx_diff(from, mctx(5)).size(), 1);
+	BOOST_CHECK_EQUAL(dixelu::mctx_diff(mctx(std::vector<int>{1, 2}), parse("[1, 2]")).size(), 0);
+
+	mctx doc = parse(R"({"a": {"b": [1, 2]}, "c": 3})");
+	dixelu::apply_patch(doc, parse(R"([
+		{"op": "test", "path": "/c", "value": 3},
+		{"op": "copy", "from": "/a/b", "path": "/copied"},
+		{"op": "move", "from": "/c", "path": "/a/b/-"},
+		{"op": "replace", "path": "/copied/0", "value": "x"}
+	])"));
+	BOOST_CHECK_EQUAL(serialize(doc), R"({"a":{"b":[1,2,3]},"copied":["x",2]})");
+
+	// Either all operations apply or none of them
+	const mctx before = doc;
+	BOOST_CHECK(check_exception([&]() { dixelu::apply_patch(doc, parse(R"([{"op": "remove", "path": "/a"}, {"op": "test", "path": "/copied/1", "value": 5}])")); }));
+	BOOST_CHECK(check_exception([&]() { dixelu::apply_patch(doc, parse(R"([{"op": "move", "from": "/a", "path": "/a/b/0"}])")); }));
+	BOOST_CHECK(check_exception([&]() { dixelu::apply_patch(doc, parse(R"([{"op": "add", "path": "/a/b/07", "value": 1}])")); }));
+	BOOST_CHECK(check_exception([&]() { dixelu::apply_patch(doc, parse(R"([{"op": "jump", "path": ""}])")); }));
+	BOOST_CHECK(doc == before);
+}
+
+BOOST_AUTO_TEST_CASE(serialize_cache_test)
+{
+	using dixelu::mctx_json::serialize_cache;
+	using dixelu::mctx_json::write_options;
+
+	mctx doc;
+	for (int i = 0; i < 50; ++i)
+	{
+		auto& entry = doc["entries"]["entry_" + std::to_string(i)];
+		entry["id"] = i;
+		entry["tags"] = std::vector<int>{i, i + 1, i + 2};
+		entry["label"] = "some text to make the entry long enough to be cached";
+	}
+
+	for (const auto& options : { write_options{}, write_options{ 2, ' ', false } })
+	{
+		serialize_cache cache(options, 16);
+		mctx current = doc;
+
+		const auto expect_fresh = [&]()
+		{
+			std::string fresh;
+			dixelu::mctx_json::write(current, fresh, options);
+			BOOST_CHECK_EQUAL(cache.write(current), fresh);
+		};
+
+		expect_fresh();
+		expect_fresh();
+
+		// Mutation goes through the parents, so they are written again
+		current["entries"]["entry_7"]["tags"].push_back(100);
+		current["entries"]["entry_3"]["id"] = "changed";
+		expect_fresh();
+
+		// Unchanged entries moved to another depth, and entries shared by copies
+		current["entries"]["entry_0"]["nested"] = current.at("entries").at("entry_1");
+		current["copy"] = current.at("entries").at("entry_2");
+		(void)std::as_const(current).at("entries").at("entry_9").hash();
+		expect_fresh();
+
+		current["entries"].erase_if([](const mctx& entry) { return entry.at("id").is<int64_t>() && entry.at("id").get<int64_t>() % 2 == 0; });
+		expect_fresh();
+
+		// Writes through references held across passes don't go through the parents
+		mctx& child = current["child"];
+		for (int i = 0; i < 8; ++i)
+			child["k" + std::to_string(i)] = "value " + std::to_string(i);
+		mctx& label = child["k3"];
+		expect_fresh();
+
+		child["k0"] = 12345;
+		expect_fresh();
+
+		label = "another label";
+		expect_fresh();
+
+		cache.clear();
+		expect_fresh();
+	}
+
+	// The source document keeps its text
+	BOOST_CHECK_EQUAL(serialize_cache().write(doc), dixelu::mctx_json::serialize(doc));
+
+	// Parsed trees hold no leaked nodes, the cache keys them by node and keeps them
+	std::string list = "[";
+	for (int i = 0; i < 10; ++i)
+		list += (i == 0 ? "" : ",") + dixelu::mctx_json::serialize(doc.at("entries").at("entry_" + std::to_string(i)));
+	mctx rows = dixelu::mctx_json::parse(list + "]");
+
+	BOOST_CHECK(rows.stable_node() != nullptr);
+	BOOST_CHECK(std::as_const(rows).at(4).stable_node() != nullptr);
+	BOOST_CHECK(dixelu::mctx_json::parse("[]").stable_node() != nullptr);
+
+	serialize_cache cache({}, 16);
+	BOOST_CHECK_EQUAL(cache.write(rows), dixelu::mctx_json::serialize(rows));
+
+	// Changes that leak nothing clone the kept nodes instead of changing them
+	const auto* kept = rows.stable_node();
+	rows.push_back(std::as_const(rows).at(0));
+	BOOST_CHECK(rows.stable_node() != kept);
+	BOOST_CHECK_EQUAL(cache.write(rows), dixelu::mctx_json::serialize(rows));
+
+	rows.erase_if([](const mctx& entry) { return entry.at("id").get<int64_t>() % 3 == 0; });
+	BOOST_CHECK_EQUAL(cache.write(rows), dixelu::mctx_json::serialize(rows));
+
+	rows[1]["id"] = -1;
+	BOOST_CHECK(rows.stable_node() == nullptr);
+	BOOST_CHECK(std::as_const(rows).at(0).stable_node() != nullptr);
+	BOOST_CHECK_EQUAL(cache.write(rows), dixelu::mctx_json::serialize(rows));
+
+	const mctx copy = rows;
+	BOOST_CHECK(copy.stable_node() != nullptr);
+	BOOST_CHECK_EQUAL(cache.write(copy), dixelu::mctx_json::serialize(rows));
+}
+
+BOOST_AUTO_TEST_CASE(lazy_parse_test)
+{
+	std::string text = R"({"name": "catalog", "items": [)";
+	for (int i = 0; i < 20; ++i)
+	{
+		if (i != 0)
+			text += ", ";
+		text += R"({"id": )" + std::to_string(i) + R"(, "label": "item number )" + std::to_string(i) + R"(", "tags": ["a", "b", "c", "d"], "nested": {"deep": [)" + std::to_string(i) + R"(, "x\"]y"]}})";
+	}
+	text += R"(], "small": [1, 2]})";
+
+	const mctx eager = dixelu::mctx_json::parse(text);
+	mctx doc = dixelu::mctx_json::parse_lazy(text);
+	const mctx& view = doc;
+
+	BOOST_CHECK(!view.is_lazy());
+	BOOST_CHECK(view.at("items").is_lazy());
+	BOOST_CHECK(!view.at("small").is_lazy());
+	BOOST_CHECK(view.at("items").is_array());
+	BOOST_CHECK(view.at("items").kind() == mctx::value_kind::array);
+	BOOST_CHECK_EQUAL(view.at("items").size(), 20);
+
+	// Const reads build one level at a time and leave the nodes lazy
+	BOOST_CHECK(view.at("items").at(7).is_lazy());
+	BOOST_CHECK_EQUAL(view.at("items").at(7).at("label").as_string_view(), "item number 7");
+	BOOST_CHECK_EQUAL(view.at("items").at(7).at("nested").at("deep").at(1).as_string_view(), "x\"]y");
+	BOOST_CHECK(view.at("items").is_lazy());
+
+	BOOST_CHECK(doc == eager);
+	BOOST_CHECK(eager == doc);
+	BOOST_CHECK_EQUAL(doc.hash(), eager.hash());
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(doc), dixelu::mctx_json::serialize(eager));
+
+	// Copies share what is already built
+	const mctx copy = doc;
+	BOOST_CHECK(copy.at("items").at(3) == eager.at("items").at(3));
+
+	// Mutable access replaces the nodes on the way by what they build
+	doc["items"][2]["id"] = 100;
+	BOOST_CHECK(!view.at("items").is_lazy());
+	BOOST_CHECK(!view.at("items").at(2).is_lazy());
+	BOOST_CHECK(view.at("items").at(3).is_lazy());
+	BOOST_CHECK_EQUAL(view.at("items").at(2).at("id").get<int64_t>(), 100);
+	BOOST_CHECK(copy == eager);
+	BOOST_CHECK(!(doc == eager));
+
+	// Concurrent const reads build each node once
+	const mctx shared = dixelu::mctx_json::parse_lazy(text);
+	std::vector<std::thread> readers;
+	std::vector<int64_t> sums(4, 0);
+
+	for (size_t t = 0; t < sums.size(); ++t)
+		readers.emplace_back([&shared, &sums, t]()
+		{
+			for (const auto& item : shared.at("items").elements())
+				sums[t] += item.at("nested").at("deep").at(0).get<int64_t>();
+		});
+
+	for (auto& reader : readers)
+		reader.join();
+
+	for (const auto sum : sums)
+		BOOST_CHECK_EQUAL(sum, 190);
+
+	// Only brackets and strings are checked up front
+	mctx broken = dixelu::mctx_json::parse_lazy(R"({"ok": 1, "bad": [1, 2, tru, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19]})");
+	BOOST_CHECK_EQUAL(broken.at("ok").get<int64_t>(), 1);
+	BOOST_CHECK_THROW((void)std::as_const(broken).at("bad").size(), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse_lazy(R"({"a": [1, 2)"), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse_lazy(R"({"a": ["]"})"), std::runtime_error);
+
+	// Text cut right after a backslash
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse_lazy(R"({"a": ["\)"), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse_lazy(R"([[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, "\)"), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse_lazy(R"(["\)"), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(projection_parse_test)
+{
+	using dixelu::mctx_json::projection;
+
+	const std::string text = R"({
+		"id": 17,
+		"meta": {"source": "feed", "tags": ["x", "y"], "raw": {"blob": "[{\"not\": \"json\"}]"}},
+		"items": [
+			{"sku": "a-1", "price": 10, "stock": {"count": 3, "where": ["n", "s"]}},
+			{"sku": "b-2", "price": 12.5, "extra": [1, [2, 3], {"deep": null}]},
+			7,
+			[{"sku": "c-3"}]
+		],
+		"escaped\u006bey": true,
+		"ignored": [tru, {"broken": }]
+	})";
+
+	// Malformed text is only noticed where it is built
+	const auto doc = dixelu::mctx_json::parse(text, projection{ { "id" }, { "meta", "source" }, { "items", "sku" }, { "items", 0, "stock" }, { "escapedkey" } });
+
+	BOOST_CHECK_EQUAL(doc.size(), 4);
+	BOOST_CHECK_EQUAL(doc.at("id").get<int64_t>(), 17);
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(doc.at("meta")), R"({"source":"feed"})");
+	BOOST_CHECK_EQUAL(dixelu::mctx_json::serialize(doc.at("items")), R"([{"stock":{"count":3,"where":["n","s"]}},{"sku":"b-2"},[{"sku":"c-3"}]])");
+	BOOST_CHECK(doc.at("escapedkey").get<bool>());
+	BOOST_CHECK(!doc.if_object()->contains("ignored"));
+
+	// Paths under a kept value are covered by it
+	const auto whole_meta = dixelu::mctx_json::deserialize(text, projection{ { "meta", "tags" }, { "meta" }, { "meta", "raw", "blob" } });
+	BOOST_CHECK_EQUAL(whole_meta.size(), 1);
+	BOOST_CHECK_EQUAL(whole_meta.at("meta").at("raw").at("blob").as_string_view(), R"([{"not": "json"}])");
+	BOOST_CHECK_EQUAL(whole_meta.at("meta").at("tags").size(), 2);
+
+	// Nothing kept gives an empty container, an empty path everything
+	BOOST_CHECK(dixelu::mctx_json::parse(R"({"a": [1, 2], "b": "c"})", projection()).empty());
+	BOOST_CHECK(dixelu::mctx_json::parse(R"({"a": [1, 2], "b": "c"})", projection{ dixelu::mctx_path() }) == dixelu::mctx_json::parse(R"({"a": [1, 2], "b": "c"})"));
+
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a": [1, 2})", projection{ { "b" } }), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a": "unterminated})", projection{ { "b" } }), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a": 1} x)", projection{ { "a" } }), std::runtime_error);
+
+	// Text cut right after a backslash, in skipped and in kept values
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a":1,"b":"\)", projection{ { "a" } }), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a":1,"b":["x", {"c": "\)", projection{ { "a" } }), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"a":"\)", projection{ { "a" } }), std::runtime_error);
+	BOOST_CHECK_THROW(dixelu::mctx_json::parse(R"({"\)", projection{ { "a" } }), std::runtime_error);
+}
+
+// Custom type with a binary codec for binary_encoding_test
+struct binary_point
+{
+	int32_t x;
+	int32_t y;
+
+	bool operator==(const binary_point& other) const = default;
+
+	static void encode(const binary_point& p, std::vector<std::byte>& out)
+	{
+		const auto* bytes = reinterpret_cast<const std::byte*>(&p);
+		out.insert(out.end(), bytes, bytes + sizeof(binary_point));
+	}
+
+	static binary_point decode(std::span<const std::byte> payload)
+	{
+		if (payload.size() != sizeof(binary_point))
+			throw std::runtime_error("bad point");
+
+		binary_point p{};
+		std::memcpy(&p, payload.data(), sizeof(binary_point));
+		return p;
+	}
+};
+
+BOOST_AUTO_TEST_CASE(binary_encoding_test)
+{
+	namespace binary = dixelu::mctx_binary;
+
+	binary::type_registry types;
+	types.add<binary_point, &binary_point::encode, &binary_point::decode>(7);
+
+	mctx doc;
+	doc["signed"] = int64_t(5);
+	doc["negative"] = int64_t(-100000);
+	doc["unsigned"] = uint64_t(5);
+	doc["big"] = std::numeric_limits<uint64_t>::max();
+	doc["single"] = 1.5f;
+	doc["double"] = 0.1;
+	doc["flag"] = false;
+	doc["nothing"] = nullptr;
+	doc["text"] = std::string(40, 'x');
+	doc["packed"] = std::vector<double>{1.0, 2.5, -3.0};
+	doc["bytes"] = binary::blob{ { std::byte{0}, std::byte{0xff}, std::byte{0x10} } };
+	doc["where"] = binary_point{ 3, -4 };
+	for (int i = 0; i < 20; ++i)
+		doc["list"].push_back(i * 1000);
+
+	const auto data = binary::encode(doc, types);
+	const auto back = binary::decode(data, types);
+
+	BOOST_CHECK(back == doc);
+	BOOST_CHECK(back.at("signed").is<int64_t>());
+	BOOST_CHECK(back.at("unsigned").is<uint64_t>());
+	BOOST_CHECK(back.at("big").is<uint64_t>());
+	BOOST_CHECK(back.at("single").is<float>());
+	BOOST_CHECK(back.at("double").is<double>());
+	BOOST_CHECK(back.at("bytes").as<binary::blob>() == doc.at("bytes").as<binary::blob>());
+	BOOST_CHECK(back.at("where").as<binary_point>() == (binary_point{ 3, -4 }));
+	BOOST_CHECK(binary::encode(back, types) == data);
+
+	// Known encodings
+	const auto bytes = [](std::initializer_list<int> values)
+	{
+		std::vector<std::byte> result;
+		for (int v : values)
+			result.push_back(static_cast<std::byte>(v));
+		return result;
+	};
+
+	BOOST_CHECK(binary::encode(mctx(int64_t(-1))) == bytes({ 0xff }));
+	BOOST_CHECK(binary::encode(mctx(int64_t(200))) == bytes({ 0xd1, 0x00, 0xc8 }));
+	BOOST_CHECK(binary::encode(mctx(uint64_t(1))) == bytes({ 0xcc, 0x01 }));
+	BOOST_CHECK(binary::encode(mctx(1.0f)) == bytes({ 0xca, 0x3f, 0x80, 0x00, 0x00 }));
+	BOOST_CHECK(binary::encode(dixelu::mctx_json::parse(R"({"a": [true, "b"]})")) == bytes({ 0x81, 0xa1, 'a', 0x92, 0xc3, 0xa1, 'b' }));
+	BOOST_CHECK(binary::encode(mctx(binary_point{ 1, 2 }), types).size() == 2 + sizeof(binary_point));
+
+	// Lazy nodes are written as what they build
+	BOOST_CHECK(binary::encode(dixelu::mctx_json::parse_lazy(R"({"n": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21]})"))
+		== binary::encode(dixelu::mctx_json::parse(R"({"n": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21]})")));
+
+	BOOST_CHECK_THROW((void)binary::encode(doc), std::runtime_error);
+	BOOST_CHECK_THROW((void)binary::decode(data), std::runtime_error);
+	BOOST_CHECK_THROW((void)binary::decode(std::span(data).first(data.size() - 1), types), std::runtime_error);
+	BOOST_CHECK_THROW((void)binary::decode(bytes({ 0xc1 })), std::runtime_error);
+	BOOST_CHECK_THROW((void)binary::decode(bytes({ 0x81, 0x01, 0x02 })), std::runtime_error);
+	BOOST_CHECK_THROW((void)binary::decode(bytes({ 0xc0, 0xc0 })), std::runtime_error);
+	BOOST_CHECK_THROW((types.add<binary_point, &binary_point::encode, &binary_point::decode>(8)), std::runtime_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()